@@ -1,5 +1,14 @@
 #include <assert.h>
+#include <math.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
 #include "btree.h"
 
 KeyValuePair::KeyValuePair()
@@ -16,29 +25,398 @@ KeyValuePair::KeyValuePair(const KeyValuePair &rhs) :
 {}
 
 
+KeyValuePair::KeyValuePair(KeyValuePair &&rhs)
+{
+  SwapBuffers(key,rhs.key);
+  SwapBuffers(value,rhs.value);
+}
+
+
 KeyValuePair::~KeyValuePair()
 {}
 
 
 KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 {
-  return *( new (this) KeyValuePair(rhs));
+  key=rhs.key;
+  value=rhs.value;
+  return *this;
+}
+
+
+KeyValuePair & KeyValuePair::operator=(KeyValuePair &&rhs)
+{
+  SwapBuffers(key,rhs.key);
+  SwapBuffers(value,rhs.value);
+  return *this;
+}
+
+//
+// Key orders
+//
+
+static int CompareBytes(const char *lhs, const char *rhs, const SIZE_T keysize)
+{
+  return memcmp(lhs,rhs,keysize);
+}
+
+template <typename T>
+static inline T LoadKeyAs(const char *p)
+{
+  T v;
+  memcpy(&v,p,sizeof(T));
+  return v;
+}
+
+template <typename T>
+static int CompareAs(const char *lhs, const char *rhs, const SIZE_T /*keysize*/)
+{
+  T l=LoadKeyAs<T>(lhs);
+  T r=LoadKeyAs<T>(rhs);
+  return (l<r) ? -1 : (r<l) ? 1 : 0;
+}
+
+static BTreeKeyCompareFn customcompare[BTREE_MAX_CUSTOM_CMP];
+
+// Each attachment of any index takes the next, see fingerepoch
+static std::atomic<SIZE_T> fingerepochs(0);
+
+ERROR_T BTreeIndex::RegisterKeyCompare(const SIZE_T id, BTreeKeyCompareFn fn)
+{
+  if (id<BTREE_CMP_CUSTOM || id>=BTREE_CMP_CUSTOM+BTREE_MAX_CUSTOM_CMP || fn==0) {
+    return ERROR_BADCONFIG;
+  }
+  customcompare[id-BTREE_CMP_CUSTOM]=fn;
+  return ERROR_NOERROR;
+}
+
+static ERROR_T ResolveKeyCompare(const SIZE_T keycompare, const SIZE_T keysize, BTreeKeyCompareFn &fn)
+{
+  switch (keycompare) {
+  case BTREE_CMP_BYTES:
+    fn=CompareBytes;
+    return ERROR_NOERROR;
+  case BTREE_CMP_UINT64:
+    fn=CompareAs<unsigned long long>;
+    break;
+  case BTREE_CMP_INT64:
+    fn=CompareAs<long long>;
+    break;
+  case BTREE_CMP_DOUBLE:
+    fn=CompareAs<double>;
+    break;
+  default:
+    if (keycompare<BTREE_CMP_CUSTOM || keycompare>=BTREE_CMP_CUSTOM+BTREE_MAX_CUSTOM_CMP) {
+      return ERROR_BADCONFIG;
+    }
+    fn=customcompare[keycompare-BTREE_CMP_CUSTOM];
+    return fn ? ERROR_NOERROR : ERROR_BADCONFIG;
+  }
+  // the numeric orders all read 8 byte keys
+  return (keysize==8) ? ERROR_NOERROR : ERROR_SIZE;
+}
+
+// Binary search over keys laid out stride bytes apart, loading each one
+// as a T so the loop is a plain integer or floating point compare
+template <typename T>
+static SIZE_T LowerBoundAs(const char *base, const SIZE_T stride, const SIZE_T numkeys, const char *key, SIZE_T &compares)
+{
+  T k=LoadKeyAs<T>(key);
+  SIZE_T lo=0;
+  SIZE_T hi=numkeys;
+  while (lo<hi) {
+    SIZE_T mid=(lo+hi)/2;
+    compares++;
+    if (LoadKeyAs<T>(base+mid*stride)<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+// Same answer as LowerBoundAs.  Each step guesses the slot from where
+// key falls between the keys bounding the range still in play, which on
+// evenly spread keys narrows the range to a few slots in two or three
+// steps.  A guess that fails to halve the range is followed by a plain
+// bisection, so skewed keys cost at most about twice a binary search.
+template <typename T>
+static SIZE_T InterpolateAs(const char *base, const SIZE_T stride, const SIZE_T numkeys, const char *key, SIZE_T &compares)
+{
+  T k=LoadKeyAs<T>(key);
+  SIZE_T lo;
+  SIZE_T hi;
+
+  if (numkeys==0) {
+    return 0;
+  }
+  T lov=LoadKeyAs<T>(base);
+  T hiv=LoadKeyAs<T>(base+(numkeys-1)*stride);
+  compares+=2;
+  if (!(lov<k)) {
+    return 0;
+  }
+  if (hiv<k) {
+    return numkeys;
+  }
+  // key[lo-1] (lov) < k <= key[hi] (hiv)
+  lo=1;
+  hi=numkeys-1;
+  while (hi-lo>1) {
+    SIZE_T before=hi-lo;
+    long double frac=((long double)k-(long double)lov)/((long double)hiv-(long double)lov);
+    if (!(frac>=0 && frac<=1)) {
+      // infinities in a double key
+      frac=0.5;
+    }
+    SIZE_T guess=(lo-1)+(SIZE_T)(frac*(hi-lo+1));
+    if (guess<lo) { guess=lo; }
+    if (guess>hi-1) { guess=hi-1; }
+    T v=LoadKeyAs<T>(base+guess*stride);
+    compares++;
+    if (v<k) {
+      lo=guess+1;
+      lov=v;
+    } else {
+      hi=guess;
+      hiv=v;
+    }
+    if (hi-lo>before/2 && hi-lo>1) {
+      SIZE_T mid=(lo+hi)/2;
+      v=LoadKeyAs<T>(base+mid*stride);
+      compares++;
+      if (v<k) {
+	lo=mid+1;
+	lov=v;
+      } else {
+	hi=mid;
+	hiv=v;
+      }
+    }
+  }
+  while (lo<hi) {
+    SIZE_T mid=(lo+hi)/2;
+    compares++;
+    if (LoadKeyAs<T>(base+mid*stride)<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+SIZE_T BTreeIndex::LowerBound(const BTreeNode &b, const char *key) const
+{
+  const char *base=KeyAt(b,0);
+  SIZE_T stride=KeyStride(b);
+  SIZE_T lo;
+  SIZE_T hi;
+  SIZE_T compares=0;
+
+  if (searchmode==BTREE_SEARCH_INTERPOLATE) {
+    switch (keycompare) {
+    case BTREE_CMP_UINT64:
+      lo=InterpolateAs<unsigned long long>(base,stride,b.info.numkeys,key,compares);
+      break;
+    case BTREE_CMP_INT64:
+      lo=InterpolateAs<long long>(base,stride,b.info.numkeys,key,compares);
+      break;
+    default:
+      lo=InterpolateAs<double>(base,stride,b.info.numkeys,key,compares);
+      break;
+    }
+    searchcompares.fetch_add(compares,std::memory_order_relaxed);
+    return lo;
+  }
+
+  switch (keycompare) {
+  case BTREE_CMP_UINT64:
+    lo=LowerBoundAs<unsigned long long>(base,stride,b.info.numkeys,key,compares);
+    break;
+  case BTREE_CMP_INT64:
+    lo=LowerBoundAs<long long>(base,stride,b.info.numkeys,key,compares);
+    break;
+  case BTREE_CMP_DOUBLE:
+    lo=LowerBoundAs<double>(base,stride,b.info.numkeys,key,compares);
+    break;
+  default:
+    lo=0;
+    hi=b.info.numkeys;
+    while (lo<hi) {
+      SIZE_T mid=(lo+hi)/2;
+      compares++;
+      if (CompareKeys(base+mid*stride,key)<0) {
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    break;
+  }
+  searchcompares.fetch_add(compares,std::memory_order_relaxed);
+  return lo;
+}
+
+ERROR_T BTreeIndex::SetSearchMode(const SIZE_T mode)
+{
+  switch (mode) {
+  case BTREE_SEARCH_BINARY:
+    break;
+  case BTREE_SEARCH_INTERPOLATE:
+    if (keycompare!=BTREE_CMP_UINT64 && keycompare!=BTREE_CMP_INT64 && keycompare!=BTREE_CMP_DOUBLE) {
+      return ERROR_BADCONFIG;
+    }
+    break;
+  default:
+    return ERROR_BADCONFIG;
+  }
+  searchmode=mode;
+  return ERROR_NOERROR;
+}
+
+bool BTreeIndex::FindKey(const BTreeNode &b, const char *key, SIZE_T &offset) const
+{
+  offset=LowerBound(b,key);
+  return offset<b.info.numkeys && CompareKeys(KeyAt(b,offset),key)==0;
+}
+
+SIZE_T BTreeIndex::KeyStride(const BTreeNode &b) const
+{
+  if (b.info.nodetype!=BTREE_LEAF_NODE) {
+    return b.info.keysize+sizeof(SIZE_T);
+  }
+  if (format&BTREE_FORMAT_SPLITLEAF) {
+    return b.info.keysize;
+  }
+  return b.info.keysize+b.info.valuesize;
+}
+
+ERROR_T BTreeIndex::GetLeafVal(const BTreeNode &b, const SIZE_T offset, VALUE_T &value) const
+{
+  // a value of the right size, as the caller's usually is, is filled
+  // in place
+  if (value.length!=b.info.valuesize) {
+    value=VALUE_T(b.info.valuesize);
+  }
+  memcpy(value.data,ValAt(b,offset),b.info.valuesize);
+  return ERROR_NOERROR;
+}
+
+void BTreeIndex::MoveLeafSlots(BTreeNode &dst,
+			       const SIZE_T dstoff,
+			       const BTreeNode &src,
+			       const SIZE_T srcoff,
+			       const SIZE_T count) const
+{
+  if (format&BTREE_FORMAT_SPLITLEAF) {
+    memmove(KeyAt(dst,dstoff),KeyAt(src,srcoff),count*src.info.keysize);
+    memmove(ValAt(dst,dstoff),ValAt(src,srcoff),count*src.info.valuesize);
+  } else {
+    memmove(KeyAt(dst,dstoff),KeyAt(src,srcoff),count*(src.info.keysize+src.info.valuesize));
+  }
 }
 
+
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
 		       SIZE_T valuesize,
 		       BufferCache *cache,
-		       bool unique) 
+		       bool /*unique*/,
+		       SIZE_T kc)
 {
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
   buffercache=cache;
+  keycompare=kc;
+  keycomparefn=CompareBytes;
+  format=0;
+  searchmode=BTREE_SEARCH_BINARY;
+  searchcompares=0;
+  version=0;
+  numsnapshots=0;
+  snapshotreaders=0;
+  filterbitsperkey=0;
+  filterhashes=0;
+  filterbudget=0;
+  filterbytes=0;
+  filterskips=0;
+  hashmask=0;
+  hashfound=0;
+  leafcachesize=BTREE_DEFAULT_LEAFCACHE;
+  cachelock=&ownlock;
+  allocator=0;
+  nextfresh=0;
+  journalstart=0;
+  journalnext=0;
+  journalhead=0;
+  journalheight=0;
+  journalfailed=false;
+  checkpointroot=0;
+  checkpointfreelist=0;
+  checkpointfresh=0;
+  journalblocks=0;
+  checkpoints=0;
+  recovered=0;
+  warmlevels=0;
+  rightleaf=0;
+  rightlone=false;
+  appendrun=0;
+  splitright=false;
+  appends=0;
+  fingersearch=false;
+  fingerepoch=0;
+  fingerhits=0;
+  tracing=false;
+  tracenext=0;
+  tracecount=0;
   // note: ignoring unique now
 }
 
 BTreeIndex::BTreeIndex()
 {
-  // shouldn't have to do anything
+  keycompare=BTREE_CMP_BYTES;
+  keycomparefn=CompareBytes;
+  format=0;
+  searchmode=BTREE_SEARCH_BINARY;
+  searchcompares=0;
+  version=0;
+  numsnapshots=0;
+  snapshotreaders=0;
+  filterbitsperkey=0;
+  filterhashes=0;
+  filterbudget=0;
+  filterbytes=0;
+  filterskips=0;
+  hashmask=0;
+  hashfound=0;
+  leafcachesize=BTREE_DEFAULT_LEAFCACHE;
+  cachelock=&ownlock;
+  allocator=0;
+  nextfresh=0;
+  journalstart=0;
+  journalnext=0;
+  journalhead=0;
+  journalheight=0;
+  journalfailed=false;
+  checkpointroot=0;
+  checkpointfreelist=0;
+  checkpointfresh=0;
+  journalblocks=0;
+  checkpoints=0;
+  recovered=0;
+  warmlevels=0;
+  rightleaf=0;
+  rightlone=false;
+  appendrun=0;
+  splitright=false;
+  appends=0;
+  fingersearch=false;
+  fingerepoch=0;
+  fingerhits=0;
+  tracing=false;
+  tracenext=0;
+  tracecount=0;
 }
 
 
@@ -50,6 +428,50 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  keycompare=rhs.keycompare;
+  keycomparefn=rhs.keycomparefn;
+  format=rhs.format;
+  searchmode=rhs.searchmode;
+  searchcompares=0;
+  version=rhs.version;
+  // snapshots and filters belong to the attached index, not to copies
+  // of it
+  numsnapshots=0;
+  snapshotreaders=0;
+  filterbitsperkey=rhs.filterbitsperkey;
+  filterhashes=rhs.filterhashes;
+  filterbudget=rhs.filterbudget;
+  filterbytes=0;
+  filterskips=0;
+  hashmask=0;
+  hashfound=0;
+  leafcachesize=BTREE_DEFAULT_LEAFCACHE;
+  cachelock=&ownlock;
+  allocator=0;
+  nextfresh=0;
+  journalstart=0;
+  journalnext=0;
+  journalhead=0;
+  journalheight=0;
+  journalfailed=false;
+  checkpointroot=0;
+  checkpointfreelist=0;
+  checkpointfresh=0;
+  journalblocks=0;
+  checkpoints=0;
+  recovered=0;
+  warmlevels=0;
+  rightleaf=0;
+  rightlone=false;
+  appendrun=0;
+  splitright=false;
+  appends=0;
+  fingersearch=false;
+  fingerepoch=0;
+  fingerhits=0;
+  tracing=false;
+  tracenext=0;
+  tracecount=0;
 }
 
 BTreeIndex::~BTreeIndex()
@@ -60,1188 +482,5247 @@ BTreeIndex::~BTreeIndex()
 
 BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 {
-  return *(new(this)BTreeIndex(rhs));
+  buffercache=rhs.buffercache;
+  superblock_index=rhs.superblock_index;
+  superblock=rhs.superblock;
+  keycompare=rhs.keycompare;
+  keycomparefn=rhs.keycomparefn;
+  format=rhs.format;
+  searchmode=rhs.searchmode;
+  version=rhs.version;
+  return *this;
 }
 
 
-ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+//
+// Tracing
+//
+// Each span is timed by a BTreeTraceSpan on the stack of the function it
+// covers, and only goes into the ring, under tracelock, once it ends, so
+// a span holds no lock while it runs.  Spans of one thread nest: a
+// descent step holds the read of its node, an insert the split and
+// allocations under it.
+//
+
+static const char *tracenames[]={
+  "Insert", "Lookup", "Update", "Delete", "Descend",
+  "Unserialize", "Serialize", "SplitNode", "AddKeyVal", "AllocateNode"
+};
+
+// A small number for the calling thread, for the trace's tid
+static SIZE_T TraceThread()
 {
-  n=superblock.info.freelist;
+  static std::atomic<SIZE_T> threads(0);
+  static thread_local SIZE_T thread=++threads;
+  return thread;
+}
 
-  if (n==0) { 
-    return ERROR_NOSPACE;
+// Times one span, from construction to destruction, if tracing was on
+// when it started
+class BTreeTraceSpan {
+ public:
+  BTreeTraceSpan(const BTreeIndex *i, const SIZE_T kind, const SIZE_T block) :
+    index(i->tracing ? i : 0)
+  {
+    if (index) {
+      e.kind=kind;
+      e.block=block;
+      e.miss=false;
+      e.start=index->TraceClock();
+    }
+  }
+  ~BTreeTraceSpan()
+  {
+    if (index) {
+      e.duration=index->TraceClock()-e.start;
+      e.thread=TraceThread();
+      index->RecordTrace(e);
+    }
   }
+  bool On() const { return index!=0; }
+  void SetBlock(const SIZE_T block) { e.block=block; }
+  void SetMiss(const bool miss) { e.miss=miss; }
 
-  BTreeNode node;
+ private:
+  const BTreeIndex *index;
+  BTreeTraceEvent   e;
+};
 
-  node.Unserialize(buffercache,n);
+unsigned long long BTreeIndex::TraceClock() const
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-tracestart).count();
+}
 
-  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+void BTreeIndex::RecordTrace(const BTreeTraceEvent &e) const
+{
+  std::lock_guard<std::mutex> g(tracelock);
 
-  superblock.info.freelist=node.info.freelist;
+  if (trace.empty()) {
+    // turned off while the span ran
+    return;
+  }
+  trace[tracenext]=e;
+  tracenext=(tracenext+1)%trace.size();
+  tracecount++;
+}
 
-  superblock.Serialize(buffercache,superblock_index);
+void BTreeIndex::SetTracing(const SIZE_T events)
+{
+  std::lock_guard<std::mutex> g(tracelock);
+
+  tracing=false;
+  trace.clear();
+  trace.shrink_to_fit();
+  tracenext=0;
+  tracecount=0;
+  if (events>0) {
+    trace.resize(events);
+    tracestart=std::chrono::steady_clock::now();
+    tracing=true;
+  }
+}
 
-  buffercache->NotifyAllocateBlock(n);
+SIZE_T BTreeIndex::GetNumTraceEvents() const
+{
+  std::lock_guard<std::mutex> g(tracelock);
+  return tracecount;
+}
 
-  return ERROR_NOERROR;
+ERROR_T BTreeIndex::DumpTrace(ostream &o) const
+{
+  std::lock_guard<std::mutex> g(tracelock);
+  SIZE_T n=tracecount<trace.size() ? tracecount : trace.size();
+  // oldest first: once the ring has wrapped, that is the next to go
+  SIZE_T first=tracecount<trace.size() ? 0 : tracenext;
+  bool any=false;
+
+  o << "{\"traceEvents\":[";
+  for (SIZE_T i=0; i<n; i++) {
+    const BTreeTraceEvent &e=trace[(first+i)%trace.size()];
+    // microseconds, to the nanosecond
+    o << (any ? ",\n" : "\n")
+      << "{\"name\":\"" << tracenames[e.kind] << "\",\"cat\":\"btree\",\"ph\":\"X\""
+      << ",\"ts\":" << e.start/1000 << "." << (char)('0'+e.start/100%10) << (char)('0'+e.start/10%10) << (char)('0'+e.start%10)
+      << ",\"dur\":" << e.duration/1000 << "." << (char)('0'+e.duration/100%10) << (char)('0'+e.duration/10%10) << (char)('0'+e.duration%10)
+      // the superblock tells apart the indexes of a catalog
+      << ",\"pid\":" << superblock_index << ",\"tid\":" << e.thread;
+    if (e.kind>=BTREE_TRACE_DESCEND) {
+      o << ",\"args\":{\"block\":" << e.block;
+      if (e.kind==BTREE_TRACE_READ) {
+	o << ",\"cache\":\"" << (e.miss ? "miss" : "hit") << "\"";
+      }
+      o << "}";
+    }
+    o << "}";
+    any=true;
+  }
+  o << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  return o.good() ? ERROR_NOERROR : ERROR_NOSPACE;
 }
 
 
-ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
-{
-  BTreeNode node;
+//
+// Node I/O
+//
 
-  node.Unserialize(buffercache,n);
+// The hot paths take their nodes from a pool kept by each thread, and
+// ReadNode fills a node's data area in place when it is already the
+// right size, so once a thread has warmed up an operation allocates no
+// node buffers.  Blocks go through one scratch block per thread, laid
+// out as BTreeNode::Serialize has them: the metadata, then the data
+// area.
 
-  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
+#define BTREE_NODE_POOL 32   // nodes a thread keeps for reuse
 
-  node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+struct NodePool {
+  std::vector<BTreeNode *> free;
+
+  ~NodePool()
+  {
+    for (SIZE_T i=0; i<free.size(); i++) {
+      delete free[i];
+    }
+  }
+};
+
+// A node from the calling thread's pool, returned to it at the end of
+// the scope.  Its contents are whatever it last held.
+class ScratchNode {
+ public:
+  ScratchNode()
+  {
+    NodePool &p=Pool();
+    if (p.free.empty()) {
+      node=new BTreeNode();
+    } else {
+      node=p.free.back();
+      p.free.pop_back();
+    }
+  }
+  ~ScratchNode()
+  {
+    NodePool &p=Pool();
+    if (p.free.size()<BTREE_NODE_POOL) {
+      p.free.push_back(node);
+    } else {
+      delete node;
+    }
+  }
+  BTreeNode & operator*() { return *node; }
 
-  node.info.freelist=superblock.info.freelist;
+ private:
+  ScratchNode(const ScratchNode &);
+  ScratchNode & operator=(const ScratchNode &);
 
-  node.Serialize(buffercache,n);
+  static NodePool & Pool()
+  {
+    static thread_local NodePool pool;
+    return pool;
+  }
 
-  superblock.info.freelist=n;
+  BTreeNode *node;
+};
 
-  superblock.Serialize(buffercache,superblock_index);
+static Block & ScratchBlock()
+{
+  static thread_local Block block;
+  return block;
+}
 
-  buffercache->NotifyDeallocateBlock(n);
+// Where an insert has SplitNode put the key it promotes, which AddKeyVal
+// takes before the next split
+static KEY_T & ScratchKey()
+{
+  static thread_local KEY_T key;
+  return key;
+}
 
-  return ERROR_NOERROR;
+// Make b an empty node of this shape, as the BTreeNode constructor does,
+// keeping its data area if that is already the size
+static void ShapeNode(BTreeNode &b,
+		      const int nodetype,
+		      const SIZE_T keysize,
+		      const SIZE_T valuesize,
+		      const SIZE_T blocksize)
+{
+  if (!b.data || b.info.blocksize!=blocksize) {
+    b=BTreeNode(nodetype,keysize,valuesize,blocksize);
+    return;
+  }
+  b.info.nodetype=nodetype;
+  b.info.keysize=keysize;
+  b.info.valuesize=valuesize;
+  b.info.rootnode=0;
+  b.info.freelist=0;
+  b.info.numkeys=0;
+  memset(b.data,0,b.info.GetNumDataBytes());
+}
 
+// b=src, into b's own data area if that is the size
+static void CopyNode(BTreeNode &b, const BTreeNode &src)
+{
+  if (!b.data || !src.data || b.info.blocksize!=src.info.blocksize) {
+    b=src;
+    return;
+  }
+  b.info=src.info;
+  memcpy(b.data,src.data,src.info.GetNumDataBytes());
 }
 
-ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+// b.Unserialize, but into b's data area if that is the size.  Caller
+// holds the cache lock.
+static ERROR_T ReadInto(BufferCache *cache, const SIZE_T node, BTreeNode &b)
 {
+  Block &raw=ScratchBlock();
+  NodeMetadata info;
   ERROR_T rc;
 
-  superblock_index=initblock;
-  assert(superblock_index==0);
+  rc=cache->ReadBlock(node,raw);
+  if (rc) {
+    return rc;
+  }
+  if (raw.length<sizeof(info)) {
+    return ERROR_INSANE;
+  }
+  memcpy(&info,raw.data,sizeof(info));
+  if (info.blocksize!=raw.length) {
+    // not something Serialize wrote
+    return b.Unserialize(cache,node);
+  }
+  if (!b.data || b.info.blocksize!=info.blocksize) {
+    b=BTreeNode(info.nodetype,info.keysize,info.valuesize,info.blocksize);
+  }
+  b.info=info;
+  memcpy(b.data,raw.data+sizeof(info),info.GetNumDataBytes());
+  return ERROR_NOERROR;
+}
 
-  if (create) {
-    // build a super block, root node, and a free space list
-    //
-    // Superblock at superblock_index
-    // root node at superblock_index+1
-    // free space list for rest
-    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-    newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
-    newsuperblock.info.numkeys=0;
+// b.Serialize through the thread's scratch block.  Caller holds the
+// cache lock.
+static ERROR_T WriteFrom(BufferCache *cache, const SIZE_T node, const BTreeNode &b)
+{
+  Block &raw=ScratchBlock();
 
-    buffercache->NotifyAllocateBlock(superblock_index);
+  if (b.info.blocksize!=cache->GetBlockSize()) {
+    return b.Serialize(cache,node);
+  }
+  if (raw.length!=b.info.blocksize) {
+    raw=Block(b.info.blocksize);
+  }
+  memcpy(raw.data,&b.info,sizeof(b.info));
+  memcpy(raw.data+sizeof(b.info),b.data,b.info.GetNumDataBytes());
+  return cache->WriteBlock(node,raw);
+}
 
-    rc=newsuperblock.Serialize(buffercache,superblock_index);
+static unsigned crctable[256];
 
-    if (rc) { 
-      return rc;
+static void InitCRCTable()
+{
+  for (unsigned i=0;i<256;i++) {
+    unsigned c=i;
+    for (int j=0;j<8;j++) {
+      c = (c&1) ? (0xEDB88320U^(c>>1)) : (c>>1);
     }
-    
-    BTreeNode newrootnode(BTREE_ROOT_NODE,
-			  superblock.info.keysize,
-			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
-    newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
-    newrootnode.info.numkeys=0;
+    crctable[i]=c;
+  }
+}
 
-    buffercache->NotifyAllocateBlock(superblock_index+1);
+static unsigned CRC32(unsigned crc, const void *buf, SIZE_T len)
+{
+  static std::once_flag once;
+  std::call_once(once,InitCRCTable);
 
-    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+  const unsigned char *p=(const unsigned char *)buf;
+  crc=~crc;
+  while (len--) {
+    crc=crctable[(crc^*p++)&0xff]^(crc>>8);
+  }
+  return ~crc;
+}
 
-    if (rc) { 
-      return rc;
-    }
+static bool IsTreeNode(const BTreeNode &b)
+{
+  return b.info.nodetype==BTREE_ROOT_NODE
+    || b.info.nodetype==BTREE_INTERIOR_NODE
+    || b.info.nodetype==BTREE_LEAF_NODE;
+}
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) { 
-      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-      newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
-      
-      rc = newfreenode.Serialize(buffercache,i);
+SIZE_T BTreeIndex::TrailerBytes(const BTreeNode &b) const
+{
+  SIZE_T bytes=(format&BTREE_FORMAT_CHECKSUM) ? sizeof(unsigned) : 0;
+  SIZE_T slots=NumMessageSlots(b);
 
-      if (rc) {
-	return rc;
-      }
+  if (slots>0) {
+    bytes+=sizeof(SIZE_T)+slots*MessageBytes();
+  }
+  return bytes+NumCountSlots(b)*sizeof(SIZE_T);
+}
 
-    }
+SIZE_T BTreeIndex::NumMessageSlots(const BTreeNode &b) const
+{
+  SIZE_T bytes;
+  SIZE_T pairSize=b.info.keysize+sizeof(SIZE_T);
+  SIZE_T pivots;
+
+  if (!(format&BTREE_FORMAT_BUFFERED) ||
+      (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE)) {
+    return 0;
+  }
+  bytes=b.info.GetNumDataBytes()-sizeof(SIZE_T);
+  if (format&BTREE_FORMAT_CHECKSUM) {
+    bytes-=sizeof(unsigned);
+  }
+  // Pivots get room for about the square root of the keys the node could
+  // otherwise hold, and the buffer the rest.  The tree is taller for it,
+  // but a flush then moves many messages to each child it writes.
+  pivots=(SIZE_T)sqrt((double)(bytes/pairSize));
+  if (pivots<4) {
+    pivots=4;
+  }
+  if (bytes<pivots*pairSize+sizeof(SIZE_T)+MessageBytes()) {
+    return 0;
   }
+  return (bytes-pivots*pairSize-sizeof(SIZE_T))/MessageBytes();
+}
 
-  // OK, now, mounting the btree is simply a matter of reading the superblock 
+char * BTreeIndex::MessageBuffer(const BTreeNode &b) const
+{
+  SIZE_T end=b.info.GetNumDataBytes();
 
-  return superblock.Unserialize(buffercache,initblock);
+  // just ahead of the checksum
+  if (format&BTREE_FORMAT_CHECKSUM) {
+    end-=sizeof(unsigned);
+  }
+  return b.data+end-sizeof(SIZE_T)-NumMessageSlots(b)*MessageBytes();
 }
-    
 
-ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+SIZE_T BTreeIndex::NumMessages(const BTreeNode &b) const
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  SIZE_T n;
+
+  memcpy(&n,MessageBuffer(b),sizeof(n));
+  return n;
 }
- 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
-					   const KEY_T &key,
-					   VALUE_T &value)
+void BTreeIndex::SetNumMessages(BTreeNode &b, const SIZE_T n) const
 {
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+  memcpy(MessageBuffer(b),&n,sizeof(n));
+}
 
-  rc= b.Unserialize(buffercache,node);
+bool BTreeIndex::FindMessage(const BTreeNode &b, const char *key, SIZE_T &slot) const
+{
+  SIZE_T lo=0;
+  SIZE_T hi;
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
+  if (NumMessageSlots(b)==0) {
+    return false;
   }
-
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) {
-	// OK, so we now have the first key that's larger
-	// so we ned to recurse on the ptr immediately previous to 
-	// this one, if it exists
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	return LookupOrUpdateInternal(ptr,op,key,value);
-      }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
+  hi=NumMessages(b);
+  while (lo<hi) {
+    SIZE_T mid=(lo+hi)/2;
+    if (CompareKeys(MessageAt(b,mid),key)<0) {
+      lo=mid+1;
     } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
+      hi=mid;
     }
-    break;
+  }
+  slot=lo;
+  return slot<NumMessages(b) && CompareKeys(MessageAt(b,slot),key)==0;
+}
+
+void BTreeIndex::ChildMessages(const BTreeNode &b,
+			       const SIZE_T offset,
+			       SIZE_T &first,
+			       SIZE_T &count) const
+{
+  SIZE_T last;
+
+  // child offset gets the keys above key offset-1, up to and including
+  // key offset
+  first=0;
+  if (offset>0 && FindMessage(b,b.ResolveKey(offset-1),first)) {
+    first++;
+  }
+  last=NumMessages(b);
+  if (offset<b.info.numkeys && FindMessage(b,b.ResolveKey(offset),last)) {
+    last++;
+  }
+  count=last-first;
+}
+
+void BTreeIndex::TakeMessages(BTreeNode &b,
+			      const SIZE_T first,
+			      const SIZE_T count,
+			      std::vector<char> &msgs) const
+{
+  SIZE_T n=NumMessages(b);
+  SIZE_T mb=MessageBytes();
+
+  msgs.insert(msgs.end(),MessageAt(b,first),MessageAt(b,first+count));
+  memmove(MessageAt(b,first),MessageAt(b,first+count),(n-first-count)*mb);
+  SetNumMessages(b,n-count);
+}
+
+ERROR_T BTreeIndex::MergeMessages(BTreeNode &b, const char *msgs, const SIZE_T count) const
+{
+  SIZE_T n=NumMessages(b);
+  SIZE_T mb=MessageBytes();
+  std::vector<char> merged((n+count)*mb);
+  SIZE_T i=0;
+  SIZE_T j=0;
+  SIZE_T k=0;
+  int c;
+
+  while (i<n || j<count) {
+    if (i==n) {
+      c=1;
+    } else if (j==count) {
+      c=-1;
+    } else {
+      c=CompareKeys(MessageAt(b,i),msgs+j*mb);
+    }
+    if (c<0) {
+      memcpy(&merged[k*mb],MessageAt(b,i),mb);
+      i++;
+    } else {
+      // the incoming message is the newer one
+      memcpy(&merged[k*mb],msgs+j*mb,mb);
+      j++;
+      if (c==0) {
+	i++;
+      }
+    }
+    k++;
+  }
+  if (k>NumMessageSlots(b)) {
+    return ERROR_NOSPACE;
+  }
+  if (k>0) {
+    memcpy(MessageAt(b,0),&merged[0],k*mb);
+  }
+  SetNumMessages(b,k);
+  return ERROR_NOERROR;
+}
+
+SIZE_T BTreeIndex::NumCountSlots(const BTreeNode &b) const
+{
+  SIZE_T bytes;
+
+  if (!(format&BTREE_FORMAT_COUNTED) ||
+      (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE)) {
+    return 0;
+  }
+  // every key brings a pointer and a count with it, on top of the first
+  // pointer and its count
+  bytes=b.info.GetNumDataBytes()-2*sizeof(SIZE_T);
+  if (format&BTREE_FORMAT_CHECKSUM) {
+    bytes-=sizeof(unsigned);
+  }
+  return bytes/(b.info.keysize+2*sizeof(SIZE_T))+1;
+}
+
+// The counts sit just ahead of the checksum
+static char * CountBuffer(const BTreeNode &b, const SIZE_T format, const SIZE_T slots)
+{
+  SIZE_T end=b.info.GetNumDataBytes();
+
+  if (format&BTREE_FORMAT_CHECKSUM) {
+    end-=sizeof(unsigned);
+  }
+  return b.data+end-slots*sizeof(SIZE_T);
+}
+
+SIZE_T BTreeIndex::ChildCount(const BTreeNode &b, const SIZE_T offset) const
+{
+  SIZE_T n;
+
+  memcpy(&n,CountBuffer(b,format,NumCountSlots(b))+offset*sizeof(SIZE_T),sizeof(n));
+  return n;
+}
+
+void BTreeIndex::SetChildCount(BTreeNode &b, const SIZE_T offset, const SIZE_T n) const
+{
+  memcpy(CountBuffer(b,format,NumCountSlots(b))+offset*sizeof(SIZE_T),&n,sizeof(n));
+}
+
+SIZE_T BTreeIndex::SubtreeCount(const BTreeNode &b) const
+{
+  SIZE_T n=0;
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) {
+    return b.info.numkeys;
+  }
+  if (NumCountSlots(b)==0 || b.info.numkeys==0) {
+    return 0;
+  }
+  for (SIZE_T i=0;i<=b.info.numkeys;i++) {
+    n+=ChildCount(b,i);
+  }
+  return n;
+}
+
+ERROR_T BTreeIndex::RecountChild(BTreeNode &b, const SIZE_T offset) const
+{
+  BTreeNode c;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  if (NumCountSlots(b)==0) {
+    return ERROR_NOERROR;
+  }
+  rc=b.GetPtr(offset,ptr);
+  if (rc) { return rc; }
+  rc=ReadNode(ptr,c);
+  if (rc) { return rc; }
+  SetChildCount(b,offset,SubtreeCount(c));
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::RecountPath(const KEY_VIEW_T &key)
+{
+  std::vector<SIZE_T> path;
+  std::vector<SIZE_T> offsets;
+  std::vector<BTreeNode> nodes;
+  BTreeNode b;
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T total;
+  ERROR_T rc;
+
+  if (!(format&BTREE_FORMAT_COUNTED)) {
+    return ERROR_NOERROR;
+  }
+  while (1) {
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE) {
+      break;
+    }
+    if (b.info.numkeys==0) {
+      // an empty tree; nothing under the root to count
+      return ERROR_NOERROR;
+    }
+    path.push_back(node);
+    offsets.push_back(LowerBound(b,key.data));
+    nodes.push_back(b);
+    rc=b.GetPtr(offsets.back(),node);
+    if (rc) { return rc; }
+  }
+
+  total=b.info.numkeys;
+  for (SIZE_T level=path.size();level>0;level--) {
+    BTreeNode &p=nodes[level-1];
+    // a split on the way may already have recounted this one, but not
+    // necessarily the ones above, so keep going either way
+    if (ChildCount(p,offsets[level-1])!=total) {
+      SetChildCount(p,offsets[level-1],total);
+      rc=WriteNode(path[level-1],p);
+      if (rc) { return rc; }
+    }
+    total=SubtreeCount(p);
+  }
+  return ERROR_NOERROR;
+}
+
+SIZE_T BTreeIndex::NumSlots(const BTreeNode &b) const
+{
+  SIZE_T bytes=b.info.GetNumDataBytes()-sizeof(SIZE_T)-TrailerBytes(b);
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) {
+    if (format&BTREE_FORMAT_COMPRESS) {
+      // A compressed leaf may hold up to twice what fits in a block
+      // uncompressed, less two: splitting a full one leaves at most a
+      // block's worth on either side, which fits even if it does not
+      // compress at all
+      bytes-=b.info.blocksize-buffercache->GetBlockSize();
+      return 2*(bytes/(b.info.keysize+b.info.valuesize))-2;
+    }
+    return bytes/(b.info.keysize+b.info.valuesize);
+  } else if (NumCountSlots(b)>0) {
+    // one count for each pointer, including that of a full node
+    return NumCountSlots(b)-1;
+  } else {
+    return bytes/(b.info.keysize+sizeof(SIZE_T));
+  }
+}
+
+SIZE_T BTreeIndex::MinKeys(const BTreeNode &b) const
+{
+  if ((format&BTREE_FORMAT_COMPRESS) && b.info.nodetype==BTREE_LEAF_NODE) {
+    // a leaf that stops compressing splits once it outgrows a block
+    return (NumSlots(b)+2)/2/2;
+  }
+  // a split leaves at least (slots-1)/2 keys on each side
+  return (NumSlots(b)-1)/2;
+}
+
+SIZE_T BTreeIndex::LeafBlockSize() const
+{
+  if (format&BTREE_FORMAT_COMPRESS) {
+    return 2*buffercache->GetBlockSize();
+  }
+  return buffercache->GetBlockSize();
+}
+
+// Covers the metadata that describes the node's contents and every data
+// byte ahead of the checksum itself
+unsigned BTreeIndex::NodeChecksum(const BTreeNode &b) const
+{
+  unsigned crc=0;
+
+  crc=CRC32(crc,&b.info.nodetype,sizeof(b.info.nodetype));
+  crc=CRC32(crc,&b.info.keysize,sizeof(b.info.keysize));
+  crc=CRC32(crc,&b.info.valuesize,sizeof(b.info.valuesize));
+  crc=CRC32(crc,&b.info.numkeys,sizeof(b.info.numkeys));
+  return CRC32(crc,b.data,b.info.GetNumDataBytes()-sizeof(unsigned));
+}
+
+ERROR_T BTreeIndex::ReadNode(const SIZE_T node, BTreeNode &b) const
+{
+  BTreeTraceSpan span(this,BTREE_TRACE_READ,node);
+  SIZE_T diskreads;
+  ERROR_T rc;
+  unsigned stored;
+
+  if (format&BTREE_FORMAT_COMPRESS) {
+    // Everything under the lock, so a leaf unpacked here cannot be
+    // cached over a newer write
+    std::lock_guard<std::mutex> g(*cachelock);
+    std::map<SIZE_T,BTreeNode>::const_iterator o=oversize.find(node);
+    if (o!=oversize.end()) {
+      CopyNode(b,o->second);
+      return ERROR_NOERROR;
+    }
+    std::map<SIZE_T,std::pair<BTreeNode,std::list<SIZE_T>::iterator> >::iterator c=leafcache.find(node);
+    if (c!=leafcache.end()) {
+      leafcachelru.splice(leafcachelru.begin(),leafcachelru,c->second.second);
+      CopyNode(b,c->second.first);
+      return ERROR_NOERROR;
+    }
+    ScratchNode scratch;
+    BTreeNode &phys=*scratch;
+    diskreads=span.On() ? buffercache->GetNumDiskReads() : 0;
+    rc=ReadInto(buffercache,node,phys);
+    if (rc) { return rc; }
+    if (span.On()) {
+      span.SetMiss(buffercache->GetNumDiskReads()!=diskreads);
+    }
+    if ((format&BTREE_FORMAT_CHECKSUM) && IsTreeNode(phys)) {
+      memcpy(&stored,phys.data+phys.info.GetNumDataBytes()-sizeof(unsigned),sizeof(unsigned));
+      if (stored!=NodeChecksum(phys)) {
+	return ERROR_INSANE;
+      }
+    }
+    if (phys.info.nodetype!=BTREE_LEAF_NODE) {
+      CopyNode(b,phys);
+      return ERROR_NOERROR;
+    }
+    rc=UnpackLeaf(phys,b);
+    if (rc) { return rc; }
+    CacheLeaf(node,b);
+    return ERROR_NOERROR;
+  }
+
+  {
+    // every block read is under cachelock, so any disk read between
+    // these two is this one's
+    std::lock_guard<std::mutex> g(*cachelock);
+    diskreads=span.On() ? buffercache->GetNumDiskReads() : 0;
+    rc=ReadInto(buffercache,node,b);
+    if (span.On()) {
+      span.SetMiss(buffercache->GetNumDiskReads()!=diskreads);
+    }
+  }
+  if (rc) {
+    return rc;
+  }
+  if ((format&BTREE_FORMAT_CHECKSUM) && IsTreeNode(b)) {
+    memcpy(&stored,b.data+b.info.GetNumDataBytes()-sizeof(unsigned),sizeof(unsigned));
+    if (stored!=NodeChecksum(b)) {
+      return ERROR_INSANE;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::WriteNode(const SIZE_T node, BTreeNode &b)
+{
+  ERROR_T rc;
+
+  if (!blockversions.empty()) {
+    blockversions[node]++;
+  }
+  if (filterbudget>0) {
+    if (b.info.nodetype==BTREE_LEAF_NODE) {
+      BuildLeafFilter(node,b);
+    } else {
+      DropLeafFilter(node);
+    }
+  }
+  // The superblock is not part of any snapshot
+  if (numsnapshots==0 || node==superblock_index) {
+    return StoreNode(node,b);
+  }
+  // Hold snaplock across the copy and the write, so a snapshot reader
+  // sees either the old block or the copy, never the new contents
+  std::lock_guard<std::mutex> g(snaplock);
+  rc=PreserveForSnapshots(node);
+  if (rc) { return rc; }
+  return StoreNode(node,b);
+}
+
+ERROR_T BTreeIndex::StoreNode(const SIZE_T node, BTreeNode &b)
+{
+  BTreeTraceSpan span(this,BTREE_TRACE_WRITE,node);
+  unsigned crc;
+  ERROR_T rc;
+
+  rc=JournalBlock(node);
+  if (rc) {
+    return rc;
+  }
+
+  if ((format&BTREE_FORMAT_COMPRESS) && b.info.nodetype==BTREE_LEAF_NODE) {
+    ScratchNode scratch;
+    BTreeNode &phys=*scratch;
+    rc=PackLeaf(b,phys);
+    if (rc && rc!=ERROR_SIZE) {
+      return rc;
+    }
+    std::lock_guard<std::mutex> g(*cachelock);
+    if (rc==ERROR_SIZE) {
+      // Too big for a block.  Insert and Update split it before they
+      // return, which writes both halves out.
+      UncacheLeaf(node);
+      oversize[node]=b;
+      return ERROR_NOERROR;
+    }
+    oversize.erase(node);
+    CacheLeaf(node,b);
+    if (format&BTREE_FORMAT_CHECKSUM) {
+      crc=NodeChecksum(phys);
+      memcpy(phys.data+phys.info.GetNumDataBytes()-sizeof(unsigned),&crc,sizeof(unsigned));
+    }
+    return WriteFrom(buffercache,node,phys);
+  }
+  if (format&BTREE_FORMAT_COMPRESS) {
+    std::lock_guard<std::mutex> g(*cachelock);
+    oversize.erase(node);
+    UncacheLeaf(node);
+  }
+
+  if ((format&BTREE_FORMAT_CHECKSUM) && IsTreeNode(b)) {
+    crc=NodeChecksum(b);
+    memcpy(b.data+b.info.GetNumDataBytes()-sizeof(unsigned),&crc,sizeof(unsigned));
+  }
+  std::lock_guard<std::mutex> g(*cachelock);
+  return WriteFrom(buffercache,node,b);
+}
+
+
+//
+// Leaf compression
+//
+// A compressed leaf is stored as an unsigned header, the payload, and
+// the usual trailer.  The payload is the leaf's keys followed by its
+// values, packed together whatever the in-memory layout, so that keys
+// sit next to keys; it is LZ compressed unless that would not make it
+// smaller, in which case the header's top bit is set and it is stored
+// as is.
+//
+
+#define BTREE_LZ_RAW      0x80000000U
+#define BTREE_LZ_MINMATCH 4
+#define BTREE_LZ_HASHBITS 12
+
+static inline unsigned LZLoad32(const unsigned char *p)
+{
+  unsigned v;
+  memcpy(&v,p,sizeof(v));
+  return v;
+}
+
+// Lengths of 15 and up continue in following bytes, 255 at a time
+static inline bool LZPutLength(unsigned char *out, SIZE_T &op, const SIZE_T cap, SIZE_T len)
+{
+  while (len>=255) {
+    if (op>=cap) { return false; }
+    out[op++]=255;
+    len-=255;
+  }
+  if (op>=cap) { return false; }
+  out[op++]=(unsigned char)len;
+  return true;
+}
+
+// One sequence: a token (literal count high nibble, match length less
+// BTREE_LZ_MINMATCH low nibble), the literals, then a 16 bit offset back
+// to the match.  The last sequence has only literals.
+static bool LZPutSequence(unsigned char *out, SIZE_T &op, const SIZE_T cap,
+			  const unsigned char *lit, const SIZE_T litlen,
+			  const SIZE_T offset, const SIZE_T matchlen)
+{
+  SIZE_T ml=matchlen ? matchlen-BTREE_LZ_MINMATCH : 0;
+
+  if (op>=cap) { return false; }
+  out[op++]=(unsigned char)(((litlen<15 ? litlen : 15)<<4) | (ml<15 ? ml : 15));
+  if (litlen>=15 && !LZPutLength(out,op,cap,litlen-15)) { return false; }
+  if (op+litlen>cap) { return false; }
+  memcpy(out+op,lit,litlen);
+  op+=litlen;
+  if (matchlen==0) {
+    return true;
+  }
+  if (op+2>cap) { return false; }
+  out[op++]=(unsigned char)(offset&0xff);
+  out[op++]=(unsigned char)(offset>>8);
+  if (ml>=15 && !LZPutLength(out,op,cap,ml-15)) { return false; }
+  return true;
+}
+
+// Greedy LZ77 with a single-entry hash of the last position each four
+// byte sequence was seen at.  Returns the compressed size, or 0 if it
+// would not fit in cap bytes.
+static SIZE_T LZCompress(const unsigned char *in, const SIZE_T n, unsigned char *out, const SIZE_T cap)
+{
+  SIZE_T table[1<<BTREE_LZ_HASHBITS];
+  SIZE_T ip=0;
+  SIZE_T anchor=0;
+  SIZE_T op=0;
+
+  for (SIZE_T i=0;i<(1<<BTREE_LZ_HASHBITS);i++) {
+    table[i]=(SIZE_T)-1;
+  }
+  while (ip+BTREE_LZ_MINMATCH<=n) {
+    unsigned seq=LZLoad32(in+ip);
+    unsigned h=(seq*2654435761U)>>(32-BTREE_LZ_HASHBITS);
+    SIZE_T ref=table[h];
+    table[h]=ip;
+    if (ref!=(SIZE_T)-1 && ip-ref<=0xffff && LZLoad32(in+ref)==seq) {
+      SIZE_T len=BTREE_LZ_MINMATCH;
+      while (ip+len<n && in[ref+len]==in[ip+len]) {
+	len++;
+      }
+      if (!LZPutSequence(out,op,cap,in+anchor,ip-anchor,ip-ref,len)) {
+	return 0;
+      }
+      ip+=len;
+      anchor=ip;
+    } else {
+      ip++;
+    }
+  }
+  if (!LZPutSequence(out,op,cap,in+anchor,n-anchor,0,0)) {
+    return 0;
+  }
+  return op;
+}
+
+// Returns the decompressed size, or 0 if the input is malformed or
+// decompresses to more than cap bytes
+static SIZE_T LZDecompress(const unsigned char *in, const SIZE_T n, unsigned char *out, const SIZE_T cap)
+{
+  SIZE_T ip=0;
+  SIZE_T op=0;
+
+  while (ip<n) {
+    unsigned token=in[ip++];
+    SIZE_T litlen=token>>4;
+    if (litlen==15) {
+      unsigned char c;
+      do {
+	if (ip>=n) { return 0; }
+	c=in[ip++];
+	litlen+=c;
+      } while (c==255);
+    }
+    if (ip+litlen>n || op+litlen>cap) { return 0; }
+    memcpy(out+op,in+ip,litlen);
+    ip+=litlen;
+    op+=litlen;
+    if (ip==n) {
+      break;
+    }
+    if (ip+2>n) { return 0; }
+    SIZE_T offset=in[ip] | ((SIZE_T)in[ip+1]<<8);
+    ip+=2;
+    SIZE_T matchlen=(token&15);
+    if (matchlen==15) {
+      unsigned char c;
+      do {
+	if (ip>=n) { return 0; }
+	c=in[ip++];
+	matchlen+=c;
+      } while (c==255);
+    }
+    matchlen+=BTREE_LZ_MINMATCH;
+    if (offset==0 || offset>op || op+matchlen>cap) { return 0; }
+    // byte at a time, since the match may overlap what it produces
+    for (SIZE_T i=0;i<matchlen;i++,op++) {
+      out[op]=out[op-offset];
+    }
+  }
+  return op;
+}
+
+ERROR_T BTreeIndex::PackLeaf(const BTreeNode &b, BTreeNode &phys) const
+{
+  static thread_local std::vector<unsigned char> packed;
+  SIZE_T keybytes=b.info.numkeys*b.info.keysize;
+  SIZE_T rawbytes=b.info.numkeys*(b.info.keysize+b.info.valuesize);
+  unsigned header;
+
+  ShapeNode(phys,BTREE_LEAF_NODE,b.info.keysize,b.info.valuesize,buffercache->GetBlockSize());
+  phys.info=b.info;
+  phys.info.blocksize=buffercache->GetBlockSize();
+
+  SIZE_T cap=phys.info.GetNumDataBytes()-sizeof(unsigned)-TrailerBytes(phys);
+  unsigned char *out=(unsigned char *)phys.data+sizeof(unsigned);
+
+  packed.resize(rawbytes+1);
+  if (format&BTREE_FORMAT_SPLITLEAF) {
+    memcpy(&packed[0],KeyAt(b,0),keybytes);
+    memcpy(&packed[keybytes],ValAt(b,0),rawbytes-keybytes);
+  } else {
+    for (SIZE_T i=0;i<b.info.numkeys;i++) {
+      memcpy(&packed[i*b.info.keysize],KeyAt(b,i),b.info.keysize);
+      memcpy(&packed[keybytes+i*b.info.valuesize],ValAt(b,i),b.info.valuesize);
+    }
+  }
+
+  // only worth it if it comes out smaller
+  SIZE_T len=LZCompress(&packed[0],rawbytes,out,rawbytes<cap ? rawbytes : cap);
+  if (len>0 && len<rawbytes) {
+    header=len;
+  } else if (rawbytes<=cap) {
+    memcpy(out,&packed[0],rawbytes);
+    header=rawbytes|BTREE_LZ_RAW;
+  } else {
+    return ERROR_SIZE;
+  }
+  memcpy(phys.data,&header,sizeof(header));
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::UnpackLeaf(const BTreeNode &phys, BTreeNode &b) const
+{
+  static thread_local std::vector<unsigned char> packed;
+  unsigned header;
+
+  ShapeNode(b,BTREE_LEAF_NODE,phys.info.keysize,phys.info.valuesize,LeafBlockSize());
+  b.info=phys.info;
+  b.info.blocksize=LeafBlockSize();
+  if (b.info.numkeys>NumSlots(b)) {
+    return ERROR_INSANE;
+  }
+
+  SIZE_T keybytes=b.info.numkeys*b.info.keysize;
+  SIZE_T rawbytes=b.info.numkeys*(b.info.keysize+b.info.valuesize);
+  SIZE_T cap=phys.info.GetNumDataBytes()-sizeof(unsigned)-TrailerBytes(phys);
+  const unsigned char *in=(const unsigned char *)phys.data+sizeof(unsigned);
+
+  memcpy(&header,phys.data,sizeof(header));
+  SIZE_T len=header&~BTREE_LZ_RAW;
+  if (len>cap) {
+    return ERROR_INSANE;
+  }
+  packed.resize(rawbytes+1);
+  if (header&BTREE_LZ_RAW) {
+    if (len!=rawbytes) { return ERROR_INSANE; }
+    memcpy(&packed[0],in,rawbytes);
+  } else if (LZDecompress(in,len,&packed[0],rawbytes)!=rawbytes) {
+    return ERROR_INSANE;
+  }
+
+  if (format&BTREE_FORMAT_SPLITLEAF) {
+    memcpy(KeyAt(b,0),&packed[0],keybytes);
+    memcpy(ValAt(b,0),&packed[keybytes],rawbytes-keybytes);
+  } else {
+    for (SIZE_T i=0;i<b.info.numkeys;i++) {
+      memcpy(KeyAt(b,i),&packed[i*b.info.keysize],b.info.keysize);
+      memcpy(ValAt(b,i),&packed[keybytes+i*b.info.valuesize],b.info.valuesize);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+void BTreeIndex::CacheLeaf(const SIZE_T node, const BTreeNode &b) const
+{
+  std::map<SIZE_T,std::pair<BTreeNode,std::list<SIZE_T>::iterator> >::iterator c=leafcache.find(node);
+
+  if (leafcachesize==0) {
+    return;
+  }
+  if (c!=leafcache.end()) {
+    c->second.first=b;
+    leafcachelru.splice(leafcachelru.begin(),leafcachelru,c->second.second);
+    return;
+  }
+  if (leafcache.size()>=leafcachesize) {
+    leafcache.erase(leafcachelru.back());
+    leafcachelru.pop_back();
+  }
+  leafcachelru.push_front(node);
+  leafcache.insert(std::make_pair(node,std::make_pair(b,leafcachelru.begin())));
+}
+
+void BTreeIndex::UncacheLeaf(const SIZE_T node) const
+{
+  std::map<SIZE_T,std::pair<BTreeNode,std::list<SIZE_T>::iterator> >::iterator c=leafcache.find(node);
+
+  if (c!=leafcache.end()) {
+    leafcachelru.erase(c->second.second);
+    leafcache.erase(c);
+  }
+}
+
+
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+{
+  std::lock_guard<std::mutex> g(snaplock);
+  return AllocateNodeLocked(n);
+}
+
+
+ERROR_T BTreeIndex::AllocateNodeLocked(SIZE_T &n)
+{
+  BTreeTraceSpan span(this,BTREE_TRACE_ALLOCATE,0);
+
+  if (!reclaim.empty()) {
+    // a snapshot copy nobody needs any more; still allocated, so no
+    // trip through the free list
+    n=reclaim.back();
+    reclaim.pop_back();
+    span.SetBlock(n);
+    if (numsnapshots>0) {
+      allocversion[n]=version;
+    }
+    return ERROR_NOERROR;
+  }
+
+  if (allocator) {
+    ERROR_T rc=allocator->AllocateBlock(n);
+    if (rc) { return rc; }
+    span.SetBlock(n);
+    if (numsnapshots>0) {
+      allocversion[n]=version;
+    }
+    return ERROR_NOERROR;
+  }
+
+  n=superblock.info.freelist;
+
+  if (n==0) { 
+    // nothing freed to reuse; take a block never used before
+    if (nextfresh==0 || nextfresh>=(journalstart ? journalstart : buffercache->GetNumBlocks())) {
+      // the update asking may have written half of what it meant to
+      journalfailed=(format&BTREE_FORMAT_JOURNAL)!=0;
+      return ERROR_NOSPACE;
+    }
+    n=nextfresh++;
+    WriteSuperblock();
+    {
+      // snapshot readers are using the cache
+      std::lock_guard<std::mutex> g(*cachelock);
+      buffercache->NotifyAllocateBlock(n);
+    }
+    span.SetBlock(n);
+    if (numsnapshots>0) {
+      allocversion[n]=version;
+    }
+    return ERROR_NOERROR;
+  }
+
+  ScratchNode scratch;
+  BTreeNode &node=*scratch;
+
+  ReadNode(n,node);
+
+  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+
+  superblock.info.freelist=node.info.freelist;
+
+  WriteSuperblock();
+
+  {
+    std::lock_guard<std::mutex> g(*cachelock);
+    buffercache->NotifyAllocateBlock(n);
+  }
+
+  span.SetBlock(n);
+  if (numsnapshots>0) {
+    allocversion[n]=version;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
+{
+  ERROR_T rc;
+
+  DropLeafFilter(n);
+  rightleaf=0;
+  if (!blockversions.empty()) {
+    blockversions[n]++;
+  }
+  if (numsnapshots>0) {
+    std::lock_guard<std::mutex> g(snaplock);
+    rc=PreserveForSnapshots(n);
+    if (rc) { return rc; }
+    allocversion.erase(n);
+    return FreeNode(n);
+  }
+  return FreeNode(n);
+}
+
+
+ERROR_T BTreeIndex::FreeNode(const SIZE_T n)
+{
+  ScratchNode scratch;
+  BTreeNode &node=*scratch;
+
+  ReadNode(n,node);
+
+  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
+
+  if (allocator) {
+    // the allocator writes the block out itself, so forget any copy of it
+    if (format&BTREE_FORMAT_COMPRESS) {
+      std::lock_guard<std::mutex> g(*cachelock);
+      oversize.erase(n);
+      UncacheLeaf(n);
+    }
+    return allocator->FreeBlock(n);
+  }
+
+  // start from a plain block: a compressed leaf is read back unpacked,
+  // bigger than a block
+  BTreeNode &freed=node;
+  ShapeNode(freed,
+	    BTREE_UNALLOCATED_BLOCK,
+	    superblock.info.keysize,
+	    superblock.info.valuesize,
+	    buffercache->GetBlockSize());
+  freed.info.rootnode=superblock.info.rootnode;
+  freed.info.freelist=superblock.info.freelist;
+
+  StoreNode(n,freed);
+
+  superblock.info.freelist=n;
+
+  WriteSuperblock();
+
+  {
+    std::lock_guard<std::mutex> g(*cachelock);
+    buffercache->NotifyDeallocateBlock(n);
+  }
+
+  return ERROR_NOERROR;
+
+}
+
+void BTreeIndex::WriteSuperblockData(BTreeNode &sb) const
+{
+  SuperblockData d;
+
+  d.magic=BTREE_SUPERBLOCK_MAGIC;
+  d.keycompare=keycompare;
+  d.format=format;
+  d.version=version;
+  d.nextfresh=nextfresh;
+  d.journalstart=journalstart;
+  d.journal=journalhead;
+  d.checkpointroot=checkpointroot;
+  d.checkpointfreelist=checkpointfreelist;
+  d.checkpointfresh=checkpointfresh;
+  memcpy(sb.data,&d,sizeof(d));
+}
+
+ERROR_T BTreeIndex::WriteSuperblock()
+{
+  WriteSuperblockData(superblock);
+  return WriteNode(superblock_index,superblock);
+}
+
+ERROR_T BTreeIndex::ReadSuperblockData()
+{
+  SuperblockData d;
+
+  memcpy(&d,superblock.data,sizeof(d));
+  if (d.magic==BTREE_SUPERBLOCK_MAGIC) {
+    keycompare=d.keycompare;
+    format=d.format;
+    version=d.version;
+    nextfresh=d.nextfresh;
+    journalstart=d.journalstart;
+    journalhead=d.journal;
+    checkpointroot=d.checkpointroot;
+    checkpointfreelist=d.checkpointfreelist;
+    checkpointfresh=d.checkpointfresh;
+  } else {
+    keycompare=BTREE_CMP_BYTES;
+    format=0;
+    version=0;
+    nextfresh=0;
+    journalstart=0;
+    journalhead=0;
+  }
+  return ResolveKeyCompare(keycompare,superblock.info.keysize,keycomparefn);
+}
+
+ERROR_T BTreeIndex::WriteEmptyIndex(const SIZE_T root, const SIZE_T fresh)
+{
+  SIZE_T numblocks=buffercache->GetNumBlocks();
+  SIZE_T blocks;
+  ERROR_T rc;
+
+  rc=ResolveKeyCompare(keycompare,superblock.info.keysize,keycomparefn);
+  if (rc) {
+    return rc;
+  }
+  // pending messages leave no way to know how many keys are below
+  if ((format&BTREE_FORMAT_COUNTED) && (format&BTREE_FORMAT_BUFFERED)) {
+    return ERROR_BADCONFIG;
+  }
+  journalstart=0;
+  if (format&BTREE_FORMAT_JOURNAL) {
+    // draining buffers rewrites any number of blocks in one go, and a
+    // catalog's disk is not the index's to keep a journal at the end of
+    if ((format&BTREE_FORMAT_BUFFERED) || allocator) {
+      return ERROR_BADCONFIG;
+    }
+    blocks=journalblocks ? journalblocks : numblocks/16;
+    if (blocks<BTREE_MIN_JOURNAL) {
+      blocks=BTREE_MIN_JOURNAL;
+    }
+    if (fresh+blocks>=numblocks) {
+      return ERROR_NOSPACE;
+    }
+    journalstart=numblocks-blocks;
+  }
+  nextfresh=fresh;
+  journalhead=0;
+  // no block has anything to journal before the superblock is written
+  checkpointfresh=0;
+
+  BTreeNode newrootnode(BTREE_ROOT_NODE,
+			superblock.info.keysize,
+			superblock.info.valuesize,
+			buffercache->GetBlockSize());
+  newrootnode.info.rootnode=root;
+  newrootnode.info.freelist=0;
+  newrootnode.info.numkeys=0;
+  if (format&BTREE_FORMAT_BUFFERED) {
+    // a buffer this small would flush on nearly every update
+    if (NumMessageSlots(newrootnode)<2 || NumSlots(newrootnode)<3) {
+      return ERROR_BADCONFIG;
+    }
+    SetNumMessages(newrootnode,0);
+  }
+
+  buffercache->NotifyAllocateBlock(root);
+
+  rc=WriteNode(root,newrootnode);
+
+  if (rc) { 
+    return rc;
+  }
+
+  checkpointroot=root;
+  checkpointfreelist=0;
+  checkpointfresh=fresh;
+
+  BTreeNode newsuperblock(BTREE_SUPERBLOCK,
+			  superblock.info.keysize,
+			  superblock.info.valuesize,
+			  buffercache->GetBlockSize());
+  newsuperblock.info.rootnode=root;
+  newsuperblock.info.freelist=0;
+  newsuperblock.info.numkeys=0;
+  WriteSuperblockData(newsuperblock);
+
+  buffercache->NotifyAllocateBlock(superblock_index);
+
+  return WriteNode(superblock_index,newsuperblock);
+}
+
+ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+{
+  ERROR_T rc;
+
+  superblock_index=initblock;
+
+  {
+    std::lock_guard<std::mutex> g(filterlock);
+    leaffilters.clear();
+    filterbytes=0;
+  }
+  rightleaf=0;
+  appendrun=0;
+  lastinsert.clear();
+  fingerepoch=++fingerepochs;
+  leafcache.clear();
+  leafcachelru.clear();
+  oversize.clear();
+  if (hashmask>0) {
+    SetHashIndex(hashmask+1);
+  }
+
+  if (create) {
+    // build a super block and root node
+    //
+    // Superblock at superblock_index
+    // root node at superblock_index+1
+    // the rest is handed out as it is needed, so it is not written here
+    rc=WriteEmptyIndex(superblock_index+1,superblock_index+2);
+    if (rc) {
+      return rc;
+    }
+  }
+
+  // OK, now, mounting the btree is simply a matter of reading the superblock 
+
+  rc=ReadNode(initblock,superblock);
+  if (rc) {
+    return rc;
+  }
+  rc=ReadSuperblockData();
+  if (rc) {
+    return rc;
+  }
+  // the existing index may not have the numeric order the mode needs
+  if (SetSearchMode(searchmode)) {
+    searchmode=BTREE_SEARCH_BINARY;
+  }
+  journalfailed=false;
+  recovered=0;
+  if (format&BTREE_FORMAT_JOURNAL) {
+    // after a clean detach there is nothing in the journal to copy back
+    rc=Recover();
+    if (rc) {
+      return rc;
+    }
+  }
+  if (warmlevels>0) {
+    return Preload(warmlevels);
+  }
+  return ERROR_NOERROR;
+}
+    
+
+ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+{
+  ERROR_T rc;
+  std::vector<SIZE_T> copies;
+
+  rc=Flush();
+  if (rc) { return rc; }
+
+  // Snapshots live only as long as the attachment; give their copies back
+  {
+    std::lock_guard<std::mutex> g(snaplock);
+    for (std::map<SIZE_T,SIZE_T>::const_iterator i=copyrefs.begin();i!=copyrefs.end();++i) {
+      copies.push_back(i->first);
+    }
+    copies.insert(copies.end(),reclaim.begin(),reclaim.end());
+    snapshots.clear();
+    allocversion.clear();
+    copyrefs.clear();
+    reclaim.clear();
+    numsnapshots=0;
+  }
+  for (SIZE_T i=0;i<copies.size();i++) {
+    rc=BeginUpdate();
+    if (rc) { return rc; }
+    rc=FreeNode(copies[i]);
+    if (rc) { return rc; }
+  }
+
+  initblock=superblock_index;
+  if (format&BTREE_FORMAT_JOURNAL) {
+    return Checkpoint();
+  }
+  return WriteSuperblock();
+}
+
+
+//
+// Checkpoints and the undo journal
+//
+// A journal block is a BTREE_SUPERBLOCK node whose data is the journal
+// magic followed by numkeys (block, copy) pairs; its freelist is the
+// journal block before it, so the superblock's journal is the newest of
+// a chain.  Blocks are only ever copied into the journal before they
+// are written, never out of it, until Recover.
+//
+
+ERROR_T BTreeIndex::JournalBlock(const SIZE_T node)
+{
+  SIZE_T perpage;
+  SIZE_T entry[2];
+  Block &old=ScratchBlock();
+  bool newpage;
+  ERROR_T rc;
+
+  if (!(format&BTREE_FORMAT_JOURNAL) || node==superblock_index) {
+    return ERROR_NOERROR;
+  }
+  // blocks the checkpoint had never used, the journal's own among them,
+  // held nothing it needs
+  if (node>=checkpointfresh || journaled.find(node)!=journaled.end()) {
+    return ERROR_NOERROR;
+  }
+  perpage=(journalpage.info.GetNumDataBytes()-sizeof(SIZE_T))/sizeof(entry);
+  newpage=journalhead==0 || journalpage.info.numkeys==perpage;
+  if (journalnext+(newpage ? 2 : 1)>buffercache->GetNumBlocks()) {
+    journalfailed=true;
+    return ERROR_NOSPACE;
+  }
+  if (newpage) {
+    journalpage.info.freelist=journalhead;
+    journalpage.info.numkeys=0;
+    journalhead=journalnext++;
+  }
+  entry[0]=node;
+  entry[1]=journalnext++;
+  {
+    // the block as it is on disk, packed or not, copied whole
+    std::lock_guard<std::mutex> g(*cachelock);
+    rc=buffercache->ReadBlock(node,old);
+    if (!rc) {
+      rc=buffercache->WriteBlock(entry[1],old);
+    }
+    if (!rc) {
+      memcpy(journalpage.data+sizeof(SIZE_T)+journalpage.info.numkeys*sizeof(entry),entry,sizeof(entry));
+      journalpage.info.numkeys++;
+      rc=WriteFrom(buffercache,journalhead,journalpage);
+    }
+  }
+  if (!rc && newpage) {
+    rc=WriteSuperblock();
+  }
+  if (rc) {
+    journalfailed=true;
+    return rc;
+  }
+  journaled[node]=entry[1];
+  return ERROR_NOERROR;
+}
+
+SIZE_T BTreeIndex::JournalReserve() const
+{
+  SIZE_T perpage=(journalpage.info.GetNumDataBytes()-sizeof(SIZE_T))/(2*sizeof(SIZE_T));
+  // on each level an update may rewrite a node, its sibling and their
+  // parent, and free one of them; a few more levels for the tree to grow
+  SIZE_T entries=4*(journalheight+3);
+
+  if (numsnapshots>0) {
+    // and copy each of them for the snapshots
+    entries*=2;
+  }
+  return entries+entries/perpage+2;
+}
+
+ERROR_T BTreeIndex::BeginUpdate()
+{
+  ERROR_T rc;
+
+  if (!(format&BTREE_FORMAT_JOURNAL)) {
+    return ERROR_NOERROR;
+  }
+  if (journalfailed) {
+    // the last update stopped part way, and only the checkpoint is
+    // known to be whole
+    rc=Rollback();
+    if (rc) { return rc; }
+  }
+  if (buffercache->GetNumBlocks()-journalnext<JournalReserve()) {
+    rc=Checkpoint();
+    if (rc) { return rc; }
+    if (buffercache->GetNumBlocks()-journalnext<JournalReserve()) {
+      return ERROR_NOSPACE;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Checkpoint()
+{
+  ERROR_T rc;
+
+  if (!(format&BTREE_FORMAT_JOURNAL)) {
+    return ERROR_BADCONFIG;
+  }
+  if (journalfailed) {
+    return Rollback();
+  }
+  checkpointroot=superblock.info.rootnode;
+  checkpointfreelist=superblock.info.freelist;
+  checkpointfresh=nextfresh;
+  journalhead=0;
+  rc=WriteSuperblock();
+  if (rc) {
+    return rc;
+  }
+  ResetJournal();
+  checkpoints++;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Recover()
+{
+  SIZE_T numblocks=buffercache->GetNumBlocks();
+  SIZE_T perpage;
+  SIZE_T magic;
+  SIZE_T entry[2];
+  BTreeNode page;
+  BTreeNode b;
+  ERROR_T rc;
+
+  recovered=0;
+  // each block is in the journal once, so the order does not matter
+  for (SIZE_T p=journalhead; p!=0; p=page.info.freelist) {
+    if (p<journalstart || p>=numblocks) {
+      return ERROR_INSANE;
+    }
+    {
+      std::lock_guard<std::mutex> g(*cachelock);
+      rc=page.Unserialize(buffercache,p);
+    }
+    if (rc) {
+      return rc;
+    }
+    memcpy(&magic,page.data,sizeof(magic));
+    perpage=(page.info.GetNumDataBytes()-sizeof(SIZE_T))/sizeof(entry);
+    if (page.info.nodetype!=BTREE_SUPERBLOCK ||
+	magic!=BTREE_JOURNAL_MAGIC ||
+	page.info.numkeys>perpage) {
+      return ERROR_INSANE;
+    }
+    for (SIZE_T i=0; i<page.info.numkeys; i++) {
+      memcpy(entry,page.data+sizeof(SIZE_T)+i*sizeof(entry),sizeof(entry));
+      if (!blockversions.empty()) {
+	blockversions[entry[0]]++;
+      }
+      std::lock_guard<std::mutex> g(*cachelock);
+      rc=b.Unserialize(buffercache,entry[1]);
+      if (!rc) {
+	rc=b.Serialize(buffercache,entry[0]);
+      }
+      if (rc) {
+	return rc;
+      }
+      recovered++;
+    }
+  }
+  // a crash can also come between taking a block off the free list and
+  // the first write to it
+  if (journalhead!=0 ||
+      superblock.info.rootnode!=checkpointroot ||
+      superblock.info.freelist!=checkpointfreelist ||
+      nextfresh!=checkpointfresh) {
+    superblock.info.rootnode=checkpointroot;
+    superblock.info.freelist=checkpointfreelist;
+    nextfresh=checkpointfresh;
+    journalhead=0;
+    rc=WriteSuperblock();
+    if (rc) {
+      return rc;
+    }
+  }
+  ResetJournal();
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Rollback()
+{
+  {
+    std::lock_guard<std::mutex> g(snaplock);
+    snapshots.clear();
+    allocversion.clear();
+    copyrefs.clear();
+    reclaim.clear();
+    numsnapshots=0;
+  }
+  // A snapshot reader that started before the snapshots went may still
+  // be reading the settings Attach is about to set again.  Any that start
+  // now find no snapshot.
+  while (snapshotreaders>0) {
+    std::this_thread::yield();
+  }
+  journalfailed=false;
+  // Attach recovers, and forgets every cached leaf and filter
+  return Attach(superblock_index,false);
+}
+
+void BTreeIndex::ResetJournal()
+{
+  SIZE_T magic=BTREE_JOURNAL_MAGIC;
+  SIZE_T node=superblock.info.rootnode;
+  BTreeNode b;
+
+  journalnext=journalstart;
+  journalhead=0;
+  journaled.clear();
+  journalpage=BTreeNode(BTREE_SUPERBLOCK,0,0,buffercache->GetBlockSize());
+  memcpy(journalpage.data,&magic,sizeof(magic));
+  for (journalheight=1;
+       ReadNode(node,b)==ERROR_NOERROR && b.info.nodetype!=BTREE_LEAF_NODE && b.info.numkeys>0;
+       journalheight++) {
+    b.GetPtr(0,node);
+  }
+}
+
+ERROR_T BTreeIndex::Preload(const SIZE_T levels) const
+{
+  std::vector<SIZE_T> level(1,superblock.info.rootnode);
+  std::vector<SIZE_T> next;
+  BTreeNode b;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  for (SIZE_T l=0; l<levels && !level.empty(); l++) {
+    next.clear();
+    for (SIZE_T i=0; i<level.size(); i++) {
+      rc=ReadNode(level[i],b);
+      if (rc) { return rc; }
+      if (b.info.nodetype==BTREE_LEAF_NODE || b.info.numkeys==0) {
+	continue;
+      }
+      for (SIZE_T j=0; j<=b.info.numkeys; j++) {
+	rc=b.GetPtr(j,ptr);
+	if (rc) { return rc; }
+	next.push_back(ptr);
+      }
+    }
+    level.swap(next);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FindLeaf(const SIZE_T start,
+			     const KEY_VIEW_T &key,
+			     SIZE_T &leaf,
+			     BTreeNode &b) const
+{
+  ERROR_T rc;
+  SIZE_T ptr;
+
+  leaf=start;
+
+  while (1) {
+    BTreeTraceSpan span(this,BTREE_TRACE_DESCEND,leaf);
+
+    rc= ReadNode(leaf,b);
+
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+
+    switch (b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) {
+	// There are no keys at all on this node, so nowhere to go
+	return ERROR_NONEXISTENT;
+      }
+      // The first key that's >= our key tells us which pointer to
+      // follow; past the last key we take the last pointer
+      rc=b.GetPtr(LowerBound(b,key.data),ptr);
+      if (rc) { return rc; }
+      leaf=ptr;
+      if (LeafFilterExcludes(leaf,key.data)) {
+	return ERROR_NONEXISTENT;
+      }
+      break;
+    case BTREE_LEAF_NODE:
+      // First time we have seen this leaf since filters were turned on
+      if (filterbudget>0) {
+	BuildLeafFilter(leaf,b,false);
+      }
+      return ERROR_NOERROR;
+      break;
+    default:
+      // We can't be looking at anything other than a root, internal, or leaf
+      return ERROR_INSANE;
+      break;
+    }
+  }
+
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
+					   const BTreeOp op,
+					   const KEY_VIEW_T &key,
+					   VALUE_T &value)
+{
+  ScratchNode scratch;
+  BTreeNode &b=*scratch;
+  ERROR_T rc;
+  SIZE_T leaf;
+  SIZE_T offset;
+
+  if (HashProbe(key.data,leaf,offset)) {
+    // the leaf has not been written since the entry was made, so the key
+    // is still at offset
+    rc=ReadNode(leaf,b);
+    if (rc) { return rc; }
+  } else {
+    if (fingersearch && node==superblock.info.rootnode) {
+      rc=FingerLeaf(key,leaf,b);
+    } else {
+      rc=FindLeaf(node,key,leaf,b);
+    }
+    if (rc) { return rc; }
+
+    if (!FindKey(b,key.data,offset)) {
+      return ERROR_NONEXISTENT;
+    }
+  }
+  if (op==BTREE_OP_LOOKUP) { 
+    HashRecord(key.data,leaf,offset);
+    return GetLeafVal(b,offset,value);
+  } else { 
+    // BTREE_OP_UPDATE
+    memcpy(ValAt(b,offset),value.data,b.info.valuesize);
+    rc=WriteNode(leaf,b);
+    if (rc) { return rc; }
+    FingerWrote(leaf);
+    if ((format&BTREE_FORMAT_COMPRESS) && NeedToSplit(leaf)) {
+      return SplitUpward(key);
+    }
+    // only the value changed, so the entry can follow the new version
+    HashRecord(key.data,leaf,offset);
+    return ERROR_NOERROR;
+  }
+}
+
+
+ERROR_T BTreeIndex::PrintNode(ostream &os, SIZE_T nodenum, const BTreeNode &b, BTreeDisplayType dt) const
+{
+  const char *key;
+  const char *value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  ERROR_T rc;
+
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      if (dt==BTREE_DEPTH_DOT) { 
+      } else { 
+	os << "Interior: ";
+      }
+      for (offset=0;offset<=b.info.numkeys;offset++) { 
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	os << "*" << ptr << " ";
+	// Last pointer
+	if (offset==b.info.numkeys) break;
+	key=b.ResolveKey(offset);
+	os.write(key,b.info.keysize);
+	os << " ";
+      }
+      if (NumMessageSlots(b)>0 && NumMessages(b)>0) {
+	os << "(" << NumMessages(b) << " buffered) ";
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
+    } else {
+      os << "Leaf: ";
+    }
+    for (offset=0;offset<b.info.numkeys;offset++) { 
+      if (offset==0) { 
+	// special case for first pointer
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	if (dt!=BTREE_SORTED_KEYVAL) { 
+	  os << "*" << ptr << " ";
+	}
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << "(";
+      }
+      key=KeyAt(b,offset);
+      os.write(key,b.info.keysize);
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ",";
+      } else {
+	os << " ";
+      }
+      value=ValAt(b,offset);
+      os.write(value,b.info.valuesize);
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ")\n";
+      } else {
+	os << " ";
+      }
+    }
+    break;
+  default:
+    if (dt==BTREE_DEPTH_DOT) { 
+      os << "Unknown("<<b.info.nodetype<<")";
+    } else {
+      os << "Unsupported Node Type " << b.info.nodetype ;
+    }
+  }
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << "\" ]";
+  }
+  return ERROR_NOERROR;
+}
+  
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  BTreeTraceSpan span(this,BTREE_TRACE_LOOKUP,0);
+
+  if (key.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+  if (format&BTREE_FORMAT_BUFFERED) {
+    return BufferedLookup(key,&value);
+  }
+  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+}
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+    // WRITE ME
+    ERROR_T rc;
+    ScratchNode scratch;
+    BTreeNode &root=*scratch;
+    BTreeTraceSpan span(this,BTREE_TRACE_INSERT,0);
+
+    if (key.length!=superblock.info.keysize || value.length!=superblock.info.valuesize) {
+      return ERROR_SIZE;
+    }
+    rc=BeginUpdate();
+    if (rc) { return rc; }
+    // a run of keys each above the last is taken for appends
+    if (!lastinsert.empty() && CompareKeys(key.data,&lastinsert[0])>0) {
+      appendrun++;
+    } else {
+      appendrun=0;
+    }
+    lastinsert.assign(key.data,key.data+key.length);
+    ReadNode(superblock.info.rootnode,root);
+
+    // CASE 1: Root is empty, nothing has been inserted yet
+    if(root.info.numkeys == 0)
+    {
+      // Similar to Attach function. So we want to attach a leaf node to the root
+      // I.e. When we insert our first item, let's make a leaf node to contain it,
+      // so we don't have a tree with just a root with values.
+      BTreeNode leaf(BTREE_LEAF_NODE,
+        superblock.info.keysize,
+        superblock.info.valuesize,
+        LeafBlockSize());
+
+      // Now let us allocate two leaf nodes to get the linked list started
+      SIZE_T firstNode;
+      SIZE_T secondNode;
+      rc = AllocateNode(firstNode);
+      if(rc){return rc;}
+      rc = AllocateNode(secondNode);
+      if(rc){return rc;}
+
+      // Write the leaves to the disk
+      WriteNode(firstNode,leaf);
+      WriteNode(secondNode,leaf);
+      // increment the number of keys in the root by 1 since we are adding a Key
+      root.info.numkeys += 1;
+      // Take care of setting the first key in root to our input key, and then
+      // set the first key's value to point to the first leaf node. 
+      root.SetKey(0,key);
+      root.SetPtr(0,firstNode);
+      // Set the next pointer (in the position right after the inserted value pointer) 
+      // to point to the second leaf node.
+      root.SetPtr(1,secondNode);
+      // Now write the entire root node block to the disk
+      WriteNode(superblock.info.rootnode,root);
+
+    }
+
+    // Appends go straight to the rightmost leaf, with no descent.  Counts
+    // would have to be fixed all the way down, and buffered inserts never
+    // reach a leaf.
+    if(appendrun >= BTREE_APPEND_RUN && !(format&(BTREE_FORMAT_BUFFERED|BTREE_FORMAT_COUNTED)))
+    {
+      bool done;
+      rc = InsertRightmost(key, value, done);
+      if(rc || done){return rc;}
+    }
+    // Otherwise a finger finds the leaf without starting from the root
+    if(fingersearch && !(format&(BTREE_FORMAT_BUFFERED|BTREE_FORMAT_COUNTED)))
+    {
+      bool done;
+      rc = InsertAtFinger(key, value, done);
+      if(rc || done){return rc;}
+    }
+
+    // CASE 2: The key does not exist, so we can insert normally using SearchInternal2
+    // First, we must check that the key does not exist in the Btree already.
+    // ConstLookup does the same descent as Lookup without copying the value out.
+    if(ConstLookup(superblock.info.rootnode,key)==ERROR_NONEXISTENT)
+    {
+      if(format&BTREE_FORMAT_BUFFERED)
+      {
+        return Enqueue(BTREE_OP_INSERT, key, value);
+      }
+
+      // SUBCASE 2A: "Normal" insert. We do not have to split the root node
+      // (Make a single call here to SearchInternal2, which handles all the recursion and value-placing)
+      rc = SearchInternal2(superblock.info.rootnode, key, value, superblock.info.rootnode);
+      if(rc){return rc;}
+
+      // SUBCASE 2B: We need to split the root node (see SplitRoot)
+      if(NeedToSplit(superblock.info.rootnode))
+      {
+        rc = SplitRoot();
+        if(rc){return rc;}
+      }
+      return RecountPath(key);
+
+
+    }
+    
+    // If we reach this point, then the key must already exist in the tree. There is a conflict.
+    // Instead, Update should be used to solve this issue and change the key's value instead of
+    // Inserting a new key/value pair
+    return ERROR_CONFLICT;
+}
+
+// Checks if a node needs to be split (i.e. it is full)
+// Returns True if yes, False if no
+bool BTreeIndex::NeedToSplit(const SIZE_T node)
+{
+  // WRITE ME
+  ScratchNode scratch;
+  BTreeNode &b=*scratch;
+  if (ReadNode(node,b)) {
+    return false;
+  }
+
+  // If a node is completely full (i.e. the number keys = the number of slots in the node), return true
+  switch(b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      return (NumSlots(b) == b.info.numkeys);
+    case BTREE_LEAF_NODE:
+      if (NumSlots(b) == b.info.numkeys) {
+        return true;
+      }
+      // or it no longer compresses into its block
+      if (format&BTREE_FORMAT_COMPRESS) {
+        std::lock_guard<std::mutex> g(*cachelock);
+        return oversize.count(node)>0;
+      }
+      return false;
+  }
+  // else return false
+  return false;
+}
+
+// Splits a full root node.  The old root becomes the left interior node,
+// SplitNode gives us the right one, and a freshly allocated block becomes
+// the new root holding just the promoted key and the two pointers.
+ERROR_T BTreeIndex::SplitRoot()
+{
+  ERROR_T rc;
+  SIZE_T originalRoot = superblock.info.rootnode;
+  SIZE_T newNode;
+  KEY_T promotedKey;
+  BTreeNode interior;
+
+  rc = SplitNode(originalRoot, newNode, promotedKey);
+  if(rc){return rc;}
+
+  // Both halves are plain interior nodes now
+  rc = ReadNode(originalRoot,interior);
+  if(rc){return rc;}
+  interior.info.nodetype = BTREE_INTERIOR_NODE;
+  rc = WriteNode(originalRoot,interior);
+  if(rc){return rc;}
+  rc = ReadNode(newNode,interior);
+  if(rc){return rc;}
+  interior.info.nodetype = BTREE_INTERIOR_NODE;
+  rc = WriteNode(newNode,interior);
+  if(rc){return rc;}
+
+  // AllocateNode also writes the superblock, which records the new root
+  rc = AllocateNode(superblock.info.rootnode);
+  if(rc){return rc;}
+
+  BTreeNode root(BTREE_ROOT_NODE,
+    superblock.info.keysize,
+    superblock.info.valuesize,
+    buffercache->GetBlockSize());
+  root.info.rootnode = superblock.info.rootnode;
+  root.info.numkeys = 1;
+  if (NumMessageSlots(root) > 0) {
+    SetNumMessages(root, 0);
+  }
+  root.SetKey(0,promotedKey);
+  root.SetPtr(0,originalRoot);
+  root.SetPtr(1,newNode);
+  rc = RecountChild(root,0);
+  if(rc){return rc;}
+  rc = RecountChild(root,1);
+  if(rc){return rc;}
+  return WriteNode(superblock.info.rootnode,root);
+}
+
+// Splits a node and returns the node number for the new (second) node, 
+// as well as the key to be promoted (moved up a level) by the split
+ERROR_T BTreeIndex::SplitNode(const SIZE_T node, SIZE_T &secondNode, KEY_T &promotedKey)
+  {
+    // WRITE ME
+    ScratchNode scratchleft;
+    ScratchNode scratchright;
+    BTreeNode &left = *scratchleft; // "Old"/first node
+    SIZE_T leftKeys;
+    SIZE_T rightKeys;
+    BTreeTraceSpan span(this,BTREE_TRACE_SPLIT,node);
+    ReadNode(node,left);
+    BTreeNode &right = *scratchright; // "New"/second node
+    CopyNode(right, left);
+    ERROR_T error;
+
+    // the rightmost leaf and the keys routed to it may change
+    rightleaf = 0;
+
+    // Allocate and Serialize secondNode
+    // If they do not evaluate to 0 (ERROR_NOERROR), return error
+    if ((error = AllocateNode(secondNode)))
+    {
+      return error;
+    }
+
+    if ((error = WriteNode(secondNode,right)))
+    {
+      return error;
+    }
+
+    // If the node is a leaf node
+    if (left.info.nodetype == BTREE_LEAF_NODE)
+    {
+      // ceiling of (n+1) / 2 [since leaf nodes have extra pointer at beginning]
+      // n is the number of keys in the original node (left.info.numkeys)
+      leftKeys = (left.info.numkeys + 2) / 2;
+      // Appending: keys will only ever go to the right, so leave the left
+      // leaf full.  It holds what the leaf did before the append, so it
+      // still fits its block if compressed.
+      if (splitright)
+      {
+        leftKeys = left.info.numkeys - 1;
+      }
+      rightKeys = left.info.numkeys - leftKeys; // remaining keys
+
+      // The key to be promoted by the split, in place if promotedKey is
+      // already the size
+      if (promotedKey.length != left.info.keysize)
+      {
+        promotedKey = KEY_T(left.info.keysize);
+      }
+      memcpy(promotedKey.data, KeyAt(left, leftKeys - 1), left.info.keysize);
+
+      // copy the slots after leftKeys into the start of the new (second)
+      // node; MoveLeafSlots knows how the leaf lays them out
+      MoveLeafSlots(right, 0, left, leftKeys, rightKeys);
+    }
+
+    // If the node is an interior or root node
+    else 
+    {
+      // floor of n/2 
+      leftKeys = (left.info.numkeys / 2);
+      // appending: the right node keeps one key, and so two children
+      if (splitright && left.info.numkeys >= 3)
+      {
+        leftKeys = left.info.numkeys - 2;
+      }
+      rightKeys = left.info.numkeys - leftKeys - 1; // promote one key
+
+      // The key to be promoted by the split
+      if (promotedKey.length != left.info.keysize)
+      {
+        promotedKey = KEY_T(left.info.keysize);
+      }
+      memcpy(promotedKey.data, left.ResolveKey(leftKeys), left.info.keysize);
+      
+      // Find the location of the first key in the old (first) node to be moved
+      // into the new (second) node
+      char *oldLoc = left.ResolvePtr(leftKeys + 1);
+      char *newLoc = right.ResolvePtr(0); // first slot in new/second node
+      
+      // copy the keys from the old location into the new location
+      // The amount will be the number of right keys times the summed size of a key
+      // and a pointer, plus the last pointer
+      memcpy(newLoc, oldLoc, rightKeys * (left.info.keysize + sizeof(SIZE_T)) + sizeof(SIZE_T));
+
+      // and their counts go with the pointers
+      for (SIZE_T i = 0; NumCountSlots(left) > 0 && i <= rightKeys; i++)
+      {
+        SetChildCount(right, i, ChildCount(left, leftKeys + 1 + i));
+      }
+
+      // Buffered messages follow their keys: up to and including the
+      // promoted key stay on the left
+      if (NumMessageSlots(left) > 0)
+      {
+        SIZE_T firstRight = 0;
+        if (FindMessage(left, promotedKey.data, firstRight))
+        {
+          firstRight++;
+        }
+        std::vector<char> moved;
+        TakeMessages(left, firstRight, NumMessages(left) - firstRight, moved);
+        SetNumMessages(right, 0);
+        if (moved.size() > 0 && (error = MergeMessages(right, &moved[0], moved.size() / MessageBytes())))
+        {
+          return error;
+        }
+      }
+    }
+
+    // Update the number of keys in the old and new nodes
+    left.info.numkeys = leftKeys;
+    right.info.numkeys = rightKeys;
+
+    if ((error = WriteNode(node,left)))
+    {
+      return error;
+    }
+
+    // Write the new node into the disk
+    return WriteNode(secondNode,right);
+  }
+
+  
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  // WRITE ME
+  ScratchNode scratch;
+  BTreeNode &b=*scratch;
+  SIZE_T leaf;
+  SIZE_T offset;
+  ERROR_T rc;
+  BTreeTraceSpan span(this,BTREE_TRACE_UPDATE,0);
+
+  if (key.length!=superblock.info.keysize || value.length!=superblock.info.valuesize) {
+    return ERROR_SIZE;
+  }
+  rc=BeginUpdate();
+  if (rc) { return rc; }
+  if (format&BTREE_FORMAT_BUFFERED) {
+    rc = BufferedLookup(key, 0);
+    if(rc){return rc;}
+    return Enqueue(BTREE_OP_UPDATE, key, value);
+  }
+  rc = FindLeaf(superblock.info.rootnode, key, leaf, b);
+  if(rc){return rc;}
+  if(!FindKey(b, key.data, offset))
+  {
+    return ERROR_NONEXISTENT;
+  }
+  // write the new value straight into the leaf
+  memcpy(ValAt(b,offset), value.data, b.info.valuesize);
+  rc = WriteNode(leaf,b);
+  if(rc){return rc;}
+  // a compressed leaf can outgrow its block even though its size didn't change
+  if((format&BTREE_FORMAT_COMPRESS) && NeedToSplit(leaf))
+  {
+    return SplitUpward(key);
+  }
+  return ERROR_NOERROR;
+}
+
+
+// The same fix-ups SearchInternal2 does as it unwinds, for a leaf that
+// grew without an insert
+ERROR_T BTreeIndex::SplitUpward(const KEY_VIEW_T &key)
+{
+  std::vector<SIZE_T> path;
+  ScratchNode scratch;
+  BTreeNode &b=*scratch;
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T secondNode;
+  SIZE_T level;
+  KEY_T promotedKey;
+  ERROR_T rc;
+
+  while (1) {
+    rc = ReadNode(node,b);
+    if(rc){return rc;}
+    path.push_back(node);
+    if(b.info.nodetype == BTREE_LEAF_NODE)
+    {
+      break;
+    }
+    if(b.info.numkeys == 0)
+    {
+      return ERROR_NONEXISTENT;
+    }
+    rc = b.GetPtr(LowerBound(b,key.data),node);
+    if(rc){return rc;}
+  }
+
+  for (level=path.size()-1; level>0 && NeedToSplit(path[level]); level--) {
+    rc = SplitNode(path[level], secondNode, promotedKey);
+    if(rc){return rc;}
+    rc = AddKeyVal(path[level-1], promotedKey, VALUE_VIEW_T(), secondNode);
+    if(rc){return rc;}
+  }
+  if(level==0 && NeedToSplit(path[0]))
+  {
+    return SplitRoot();
+  }
+  return ERROR_NOERROR;
+}
+
+
+// The rightmost leaf takes every key above the last separator on the
+// way down to it, whatever is in it.  A key above everything in it adds
+// one more to the run of appends, so a split it causes keeps the left
+// nodes full.
+ERROR_T BTreeIndex::InsertRightmost(const KEY_VIEW_T &key, const VALUE_VIEW_T &value, bool &done)
+{
+  ScratchNode scratch;
+  BTreeNode &b=*scratch;
+  SIZE_T offset;
+  ERROR_T rc;
+
+  done=false;
+  if (rightleaf==0) {
+    rc=FindRightmost();
+    if (rc) { return rc; }
+  }
+  // the first two leaves are evened out before the root splits, which
+  // the descent does
+  if (rightleaf==0 || rightlone || CompareKeys(key.data,&rightlow[0])<=0) {
+    return ERROR_NOERROR;
+  }
+  rc=ReadNode(rightleaf,b);
+  if (rc) { return rc; }
+  done=true;
+  if (FindKey(b,key.data,offset)) {
+    return ERROR_CONFLICT;
+  }
+  rc=AddKeyVal(rightleaf,key,value,0);
+  if (rc) { return rc; }
+  appends++;
+  if (!NeedToSplit(rightleaf)) {
+    return ERROR_NOERROR;
+  }
+  // only nodes on the right edge can be full
+  splitright=offset==b.info.numkeys;
+  rc=SplitUpward(key);
+  splitright=false;
+  return rc;
+}
+
+ERROR_T BTreeIndex::FindRightmost()
+{
+  ScratchNode scratch;
+  BTreeNode &b=*scratch;
+  SIZE_T node=superblock.info.rootnode;
+  ERROR_T rc;
+
+  rightleaf=0;
+  while (1) {
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE) {
+      break;
+    }
+    if (b.info.numkeys==0) {
+      return ERROR_NOERROR;
+    }
+    rightlow.assign(KeyAt(b,b.info.numkeys-1),KeyAt(b,b.info.numkeys-1)+b.info.keysize);
+    rightlone=b.info.nodetype==BTREE_ROOT_NODE && b.info.numkeys==1;
+    rc=b.GetPtr(b.info.numkeys,node);
+    if (rc) { return rc; }
+  }
+  rightleaf=node;
+  return ERROR_NOERROR;
+}
+
+
+//
+// BTREE_FORMAT_BUFFERED
+//
+// Insert, Update and Delete check the key as usual (a lookup, which
+// mostly hits in the cache) but then only add a message to the root's
+// buffer.  When a buffer fills, the messages bound for the child with
+// the most of them move down together, so a leaf is rewritten once per
+// batch rather than once per update.
+//
+
+void BTreeIndex::AddSeparator(BTreeNode &b, const SIZE_T offset, const char *key, const SIZE_T newNode) const
+{
+  char *p=b.ResolveKey(offset);
+  SIZE_T pairSize=b.info.keysize+sizeof(SIZE_T);
+
+  memmove(p+pairSize,p,(b.info.numkeys-offset)*pairSize);
+  b.info.numkeys++;
+  memcpy(p,key,b.info.keysize);
+  b.SetPtr(offset+1,newNode);
+}
+
+ERROR_T BTreeIndex::SplitChild(BTreeNode &b, const SIZE_T offset)
+{
+  ERROR_T rc;
+  SIZE_T ptr;
+  SIZE_T secondNode;
+  KEY_T promotedKey;
+
+  rc=b.GetPtr(offset,ptr);
+  if (rc) { return rc; }
+  rc=SplitNode(ptr,secondNode,promotedKey);
+  if (rc) { return rc; }
+  AddSeparator(b,offset,promotedKey.data,secondNode);
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::ApplyMessages(BTreeNode &b, const std::vector<char> &msgs)
+{
+  ERROR_T rc;
+  BTreeNode leaf;
+  SIZE_T keysize=superblock.info.keysize;
+  SIZE_T valuesize=superblock.info.valuesize;
+  SIZE_T mb=MessageBytes();
+  SIZE_T count=msgs.size()/mb;
+  SIZE_T i=0;
+  SIZE_T offset;
+  SIZE_T ptr;
+  SIZE_T slot;
+  const char *hi;
+  const char *m;
+
+  while (i<count) {
+    if (b.info.numkeys==NumSlots(b)) {
+      // no room for another leaf; the rest wait for b to be split
+      return MergeMessages(b,&msgs[i*mb],count-i);
+    }
+    offset=LowerBound(b,&msgs[i*mb]);
+    rc=b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    rc=ReadNode(ptr,leaf);
+    if (rc) { return rc; }
+
+    // everything up to the separator goes to this leaf, until it fills
+    hi=(offset<b.info.numkeys) ? b.ResolveKey(offset) : 0;
+    for (; i<count && leaf.info.numkeys<NumSlots(leaf); i++) {
+      m=&msgs[i*mb];
+      if (hi && CompareKeys(m,hi)>0) {
+	break;
+      }
+      if (FindKey(leaf,m,slot)) {
+	if (m[keysize+valuesize]==BTREE_OP_DELETE) {
+	  MoveLeafSlots(leaf,slot,leaf,slot+1,leaf.info.numkeys-slot-1);
+	  leaf.info.numkeys--;
+	  continue;
+	}
+      } else {
+	if (m[keysize+valuesize]==BTREE_OP_DELETE) {
+	  continue;
+	}
+	MoveLeafSlots(leaf,slot+1,leaf,slot,leaf.info.numkeys-slot);
+	leaf.info.numkeys++;
+	memcpy(KeyAt(leaf,slot),m,keysize);
+      }
+      memcpy(ValAt(leaf,slot),m+keysize,valuesize);
+    }
+    rc=WriteNode(ptr,leaf);
+    if (rc) { return rc; }
+    if (NeedToSplit(ptr)) {
+      rc=SplitChild(b,offset);
+      if (rc) { return rc; }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::FlushBuffer(BTreeNode &b, const SIZE_T need)
+{
+  ERROR_T rc;
+  BTreeNode c;
+  std::vector<char> msgs;
+  SIZE_T offset;
+  SIZE_T first;
+  SIZE_T count;
+  SIZE_T best=0;
+  SIZE_T bestfirst=0;
+  SIZE_T bestcount;
+  SIZE_T ptr;
+
+  while (NumMessageSlots(b)-NumMessages(b)<need && b.info.numkeys<NumSlots(b)) {
+    bestcount=0;
+    for (offset=0;offset<=b.info.numkeys;offset++) {
+      ChildMessages(b,offset,first,count);
+      if (count>bestcount) {
+	best=offset;
+	bestfirst=first;
+	bestcount=count;
+      }
+    }
+    if (bestcount==0) {
+      break;
+    }
+    msgs.clear();
+    TakeMessages(b,bestfirst,bestcount,msgs);
+
+    rc=b.GetPtr(best,ptr);
+    if (rc) { return rc; }
+    rc=ReadNode(ptr,c);
+    if (rc) { return rc; }
+    if (c.info.nodetype==BTREE_LEAF_NODE) {
+      rc=ApplyMessages(b,msgs);
+      if (rc) { return rc; }
+      continue;
+    }
+
+    if (NumMessageSlots(c)-NumMessages(c)<bestcount) {
+      rc=FlushBuffer(c,bestcount);
+      if (rc) { return rc; }
+      rc=WriteNode(ptr,c);
+      if (rc) { return rc; }
+      if (c.info.numkeys==NumSlots(c)) {
+	// the batch goes back to b until c has been split
+	rc=SplitChild(b,best);
+	if (rc) { return rc; }
+	rc=MergeMessages(b,&msgs[0],bestcount);
+	if (rc) { return rc; }
+	continue;
+      }
+    }
+    rc=MergeMessages(c,&msgs[0],bestcount);
+    if (rc) { return rc; }
+    rc=WriteNode(ptr,c);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::DrainBuffers(BTreeNode &b)
+{
+  ERROR_T rc;
+  BTreeNode c;
+  SIZE_T offset=0;
+  SIZE_T ptr;
+
+  while (1) {
+    rc=FlushBuffer(b,NumMessageSlots(b));
+    if (rc) { return rc; }
+    if (b.info.numkeys==NumSlots(b) || offset>b.info.numkeys) {
+      return ERROR_NOERROR;
+    }
+    rc=b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    rc=ReadNode(ptr,c);
+    if (rc) { return rc; }
+    if (c.info.nodetype==BTREE_LEAF_NODE) {
+      // b's buffer is empty and there is nothing below it to drain
+      return ERROR_NOERROR;
+    }
+    rc=DrainBuffers(c);
+    if (rc) { return rc; }
+    rc=WriteNode(ptr,c);
+    if (rc) { return rc; }
+    if (c.info.numkeys==NumSlots(c)) {
+      // go over both halves again
+      rc=SplitChild(b,offset);
+      if (rc) { return rc; }
+    } else {
+      offset++;
+    }
+  }
+}
+
+ERROR_T BTreeIndex::Enqueue(const BTreeOp op, const KEY_VIEW_T &key, const VALUE_VIEW_T &value)
+{
+  ERROR_T rc;
+  BTreeNode root;
+  SIZE_T keysize=superblock.info.keysize;
+  SIZE_T valuesize=superblock.info.valuesize;
+  std::vector<char> msg(MessageBytes(),0);
+
+  memcpy(&msg[0],key.data,keysize);
+  if (value.length==valuesize) {
+    memcpy(&msg[keysize],value.data,valuesize);
+  }
+  msg[keysize+valuesize]=(char)op;
+
+  rc=ReadNode(superblock.info.rootnode,root);
+  if (rc) { return rc; }
+  while (NumMessages(root)==NumMessageSlots(root)) {
+    rc=FlushBuffer(root,1);
+    if (rc) { return rc; }
+    rc=WriteNode(superblock.info.rootnode,root);
+    if (rc) { return rc; }
+    if (root.info.numkeys==NumSlots(root)) {
+      rc=SplitRoot();
+      if (rc) { return rc; }
+      rc=ReadNode(superblock.info.rootnode,root);
+      if (rc) { return rc; }
+    }
+  }
+  rc=MergeMessages(root,&msg[0],1);
+  if (rc) { return rc; }
+  return WriteNode(superblock.info.rootnode,root);
+}
+
+ERROR_T BTreeIndex::BufferedLookup(const KEY_VIEW_T &key, VALUE_T *value) const
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T slot;
+  const char *m;
+
+  while (1) {
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) {
+	return ERROR_NONEXISTENT;
+      }
+      if (FindMessage(b,key.data,slot)) {
+	m=MessageAt(b,slot);
+	if (m[b.info.keysize+b.info.valuesize]==BTREE_OP_DELETE) {
+	  return ERROR_NONEXISTENT;
+	}
+	if (value) {
+	  *value=VALUE_T(b.info.valuesize);
+	  memcpy(value->data,m+b.info.keysize,b.info.valuesize);
+	}
+	return ERROR_NOERROR;
+      }
+      rc=b.GetPtr(LowerBound(b,key.data),node);
+      if (rc) { return rc; }
+      // only now is it safe to trust the filter: no buffer above the
+      // leaf has a message for key
+      if (LeafFilterExcludes(node,key.data)) {
+	return ERROR_NONEXISTENT;
+      }
+      break;
+    case BTREE_LEAF_NODE:
+      if (filterbudget>0) {
+	BuildLeafFilter(node,b,false);
+      }
+      if (!FindKey(b,key.data,slot)) {
+	return ERROR_NONEXISTENT;
+      }
+      if (value) {
+	return GetLeafVal(b,slot,*value);
+      }
+      return ERROR_NOERROR;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+}
+
+ERROR_T BTreeIndex::Flush()
+{
+  ERROR_T rc;
+  BTreeNode root;
+
+  if (!(format&BTREE_FORMAT_BUFFERED)) {
+    return ERROR_NOERROR;
+  }
+  rc=ReadNode(superblock.info.rootnode,root);
+  if (rc) { return rc; }
+  if (root.info.numkeys==0) {
+    return ERROR_NOERROR;
+  }
+  while (1) {
+    rc=DrainBuffers(root);
+    if (rc) { return rc; }
+    rc=WriteNode(superblock.info.rootnode,root);
+    if (rc) { return rc; }
+    if (root.info.numkeys<NumSlots(root)) {
+      return ERROR_NOERROR;
+    }
+    rc=SplitRoot();
+    if (rc) { return rc; }
+    rc=ReadNode(superblock.info.rootnode,root);
+    if (rc) { return rc; }
+  }
+}
+
+  
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  // kept by the thread, so a delete allocates nothing once warm
+  static thread_local std::vector<SIZE_T> path;
+  static thread_local std::vector<SIZE_T> offsets;
+  ScratchNode scratchb;
+  ScratchNode scratchparent;
+  BTreeNode &b=*scratchb;
+  BTreeNode &parent=*scratchparent;
+  ERROR_T rc;
+  SIZE_T node;
+  SIZE_T offset;
+  BTreeTraceSpan span(this,BTREE_TRACE_DELETE,0);
+  SIZE_T level;
+
+  if (key.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+  // check if the key is in the tree
+  rc = ConstLookup(superblock.info.rootnode, key);
+  if(rc) { return rc;}
+  rc=BeginUpdate();
+  if (rc) { return rc; }
+  if(format&BTREE_FORMAT_BUFFERED)
+  {
+    return Enqueue(BTREE_OP_DELETE, key, VALUE_VIEW_T());
+  }
+
+  // walk down to the leaf, remembering the way
+  path.clear();
+  offsets.clear();
+  node = superblock.info.rootnode;
+  while (1) {
+    BTreeTraceSpan step(this,BTREE_TRACE_DESCEND,node);
+    rc = ReadNode(node,b);
+    if(rc) { return rc;}
+    path.push_back(node);
+    if(b.info.nodetype == BTREE_LEAF_NODE)
+    {
+      break;
+    }
+    offset = LowerBound(b,key.data);
+    offsets.push_back(offset);
+    rc = b.GetPtr(offset,node);
+    if(rc) { return rc;}
+  }
+
+  if(!FindKey(b,key.data,offset))
+  {
+    return ERROR_NONEXISTENT;
+  }
+  MoveLeafSlots(b, offset, b, offset+1, b.info.numkeys-offset-1);
+  b.info.numkeys--;
+  rc = WriteNode(node,b);
+  if(rc) { return rc;}
+  // A compressed leaf can pack worse for losing a key, and so outgrow
+  // its block.  Split it as Update does; each half still holds enough
+  // keys to need no evening out.
+  if((format&BTREE_FORMAT_COMPRESS) && NeedToSplit(node))
+  {
+    rc = SplitUpward(key);
+    if(rc) { return rc;}
+    return RecountPath(key);
+  }
+
+  // The separators above can stay as they are: a key that is gone still
+  // bounds the keys on either side of it.  Walk back up evening out or
+  // merging nodes that are now too empty.
+  for (level=path.size()-1; level>0 && b.info.numkeys<MinKeys(b); level--) {
+    rc = ReadNode(path[level-1],parent);
+    if(rc) { return rc;}
+    rc = RebalanceChild(parent, offsets[level-1]);
+    if(rc) { return rc;}
+    rc = WriteNode(path[level-1],parent);
+    if(rc) { return rc;}
+    CopyNode(b,parent);
+  }
+
+  // A root down to one child hands its place to that child.  The child
+  // is never a leaf: RebalanceChild does not merge the two leaves under a
+  // root with a single key, and a root with no keys means the tree is
+  // empty.
+  if(b.info.nodetype == BTREE_ROOT_NODE && b.info.numkeys == 0 && path.size() > 1)
+  {
+    BTreeNode &child=parent;
+    rc = b.GetPtr(0,node);
+    if(rc) { return rc;}
+    rc = ReadNode(node,child);
+    if(rc) { return rc;}
+    if(child.info.nodetype == BTREE_LEAF_NODE)
+    {
+      return ERROR_INSANE;
+    }
+    child.info.nodetype = BTREE_ROOT_NODE;
+    child.info.rootnode = superblock.info.rootnode;
+    rc = WriteNode(superblock.info.rootnode,child);
+    if(rc) { return rc;}
+    rc = DeallocateNode(node);
+    if(rc) { return rc;}
+  }
+  return RecountPath(key);
+}
+
+// Child offset of parent has too few keys.  Merge it with a neighbour if
+// the two fit in one node, otherwise even the two out.  Leaves under a
+// root with a single key are never merged, since the root would be left
+// with one child and no keys.  The caller writes parent.
+ERROR_T BTreeIndex::RebalanceChild(BTreeNode &parent, const SIZE_T offset)
+{
+  ScratchNode scratchleft;
+  ScratchNode scratchright;
+  ScratchNode scratchphys;
+  BTreeNode &left=*scratchleft;
+  BTreeNode &right=*scratchright;
+  BTreeNode &phys=*scratchphys;
+  ERROR_T rc;
+  SIZE_T l = (offset>0) ? offset-1 : offset;
+  SIZE_T lptr;
+  SIZE_T rptr;
+  SIZE_T pairSize = parent.info.keysize + sizeof(SIZE_T);
+  SIZE_T total;
+  SIZE_T move;
+  bool merge;
+
+  if(parent.info.numkeys == 0)
+  {
+    return ERROR_NOERROR;
+  }
+  // the separator between them moves, or goes
+  rightleaf = 0;
+  rc = parent.GetPtr(l,lptr);
+  if(rc) { return rc;}
+  rc = parent.GetPtr(l+1,rptr);
+  if(rc) { return rc;}
+  rc = ReadNode(lptr,left);
+  if(rc) { return rc;}
+  rc = ReadNode(rptr,right);
+  if(rc) { return rc;}
+
+  if(left.info.nodetype == BTREE_LEAF_NODE)
+  {
+    total = left.info.numkeys + right.info.numkeys;
+    // a full node would have to split again
+    merge = total < NumSlots(left) &&
+      !(parent.info.nodetype == BTREE_ROOT_NODE && parent.info.numkeys == 1);
+    if(merge)
+    {
+      ScratchNode scratchmerged;
+      BTreeNode &merged=*scratchmerged;
+      CopyNode(merged, left);
+      MoveLeafSlots(merged, left.info.numkeys, right, 0, right.info.numkeys);
+      merged.info.numkeys = total;
+      // a compressed leaf also has to still fit its block
+      if(!(format&BTREE_FORMAT_COMPRESS) || PackLeaf(merged,phys) == ERROR_NOERROR)
+      {
+        CopyNode(left, merged);
+      }
+      else
+      {
+        merge = false;
+      }
+    }
+    if(!merge)
+    {
+      ScratchNode scratcholdleft;
+      ScratchNode scratcholdright;
+      BTreeNode &oldleft=*scratcholdleft;
+      BTreeNode &oldright=*scratcholdright;
+      bool fromleft = left.info.numkeys > right.info.numkeys;
+      move = fromleft ? (left.info.numkeys - right.info.numkeys) / 2
+                      : (right.info.numkeys - left.info.numkeys) / 2;
+      if(format&BTREE_FORMAT_COMPRESS)
+      {
+        CopyNode(oldleft, left);
+        CopyNode(oldright, right);
+      }
+      while(1)
+      {
+        if(fromleft)
+        {
+          MoveLeafSlots(right, move, right, 0, right.info.numkeys);
+          MoveLeafSlots(right, 0, left, left.info.numkeys-move, move);
+          left.info.numkeys -= move;
+          right.info.numkeys += move;
+        }
+        else
+        {
+          MoveLeafSlots(left, left.info.numkeys, right, 0, move);
+          MoveLeafSlots(right, 0, right, move, right.info.numkeys-move);
+          left.info.numkeys += move;
+          right.info.numkeys -= move;
+        }
+        if(move == 0 || !(format&BTREE_FORMAT_COMPRESS))
+        {
+          break;
+        }
+        // Compressed, the leaf that gained keys may no longer fit its
+        // block, and nothing on the way back up would split it.  Move
+        // fewer until both fit.
+        rc = PackLeaf(left,phys);
+        if(rc == ERROR_NOERROR)
+        {
+          rc = PackLeaf(right,phys);
+        }
+        if(rc == ERROR_NOERROR)
+        {
+          break;
+        }
+        if(rc != ERROR_SIZE)
+        {
+          return rc;
+        }
+        CopyNode(left, oldleft);
+        CopyNode(right, oldright);
+        move /= 2;
+      }
+      if(move == 0)
+      {
+        return ERROR_NOERROR;
+      }
+      // the separator is the largest key left on the left
+      memcpy(parent.ResolveKey(l), KeyAt(left,left.info.numkeys-1), parent.info.keysize);
+    }
+  }
+  else
+  {
+    // Lay both nodes and the separator between them out end to end,
+    // ptr key ptr ... key ptr, and cut that up again.  Both vectors are
+    // kept by the thread.
+    static thread_local std::vector<char> flat;
+    static thread_local std::vector<SIZE_T> counts;
+    char *p;
+    flat.clear();
+    counts.clear();
+    total = left.info.numkeys + 1 + right.info.numkeys;
+    p = left.ResolvePtr(0);
+    flat.insert(flat.end(), p, p + left.info.numkeys*pairSize + sizeof(SIZE_T));
+    p = parent.ResolveKey(l);
+    flat.insert(flat.end(), p, p + parent.info.keysize);
+    p = right.ResolvePtr(0);
+    flat.insert(flat.end(), p, p + right.info.numkeys*pairSize + sizeof(SIZE_T));
+    // the children's counts, if any, line up with the pointers
+    for (SIZE_T i = 0; NumCountSlots(left) > 0 && i <= left.info.numkeys; i++)
+    {
+      counts.push_back(ChildCount(left, i));
+    }
+    for (SIZE_T i = 0; NumCountSlots(right) > 0 && i <= right.info.numkeys; i++)
+    {
+      counts.push_back(ChildCount(right, i));
+    }
+
+    merge = total < NumSlots(left);
+    if(merge)
+    {
+      memcpy(left.ResolvePtr(0), &flat[0], flat.size());
+      left.info.numkeys = total;
+      for (SIZE_T i = 0; i < counts.size(); i++)
+      {
+        SetChildCount(left, i, counts[i]);
+      }
+    }
+    else
+    {
+      move = (total - 1) / 2;
+      if(move == left.info.numkeys)
+      {
+        return ERROR_NOERROR;
+      }
+      memcpy(left.ResolvePtr(0), &flat[0], move*pairSize + sizeof(SIZE_T));
+      left.info.numkeys = move;
+      memcpy(parent.ResolveKey(l), &flat[move*pairSize + sizeof(SIZE_T)], parent.info.keysize);
+      memcpy(right.ResolvePtr(0), &flat[(move+1)*pairSize], (total-move-1)*pairSize + sizeof(SIZE_T));
+      right.info.numkeys = total - move - 1;
+      for (SIZE_T i = 0; i < counts.size(); i++)
+      {
+        if(i <= move)
+        {
+          SetChildCount(left, i, counts[i]);
+        }
+        else
+        {
+          SetChildCount(right, i-move-1, counts[i]);
+        }
+      }
+    }
+  }
+
+  rc = WriteNode(lptr,left);
+  if(rc) { return rc;}
+  if(NumCountSlots(parent) > 0)
+  {
+    SetChildCount(parent, l, SubtreeCount(left));
+  }
+  if(!merge)
+  {
+    if(NumCountSlots(parent) > 0)
+    {
+      SetChildCount(parent, l+1, SubtreeCount(right));
+    }
+    return WriteNode(rptr,right);
+  }
+
+  // drop the separator and the pointer to the right node from parent
+  {
+    char *p = parent.ResolveKey(l);
+    memmove(p, p + pairSize, (parent.info.numkeys - l - 1) * pairSize);
+    for (SIZE_T i = l+1; NumCountSlots(parent) > 0 && i < parent.info.numkeys; i++)
+    {
+      SetChildCount(parent, i, ChildCount(parent, i+1));
+    }
+    parent.info.numkeys--;
+  }
+  return DeallocateNode(rptr);
+}
+
+
+
+// Handles the recursive traversal of the tree, and placing the key/value pair in the correct node
+ERROR_T BTreeIndex::SearchInternal2(SIZE_T node,
+             const KEY_VIEW_T &key,
+             const VALUE_VIEW_T &value,
+             SIZE_T /*parentNode*/)  
+{
+  ScratchNode scratch;
+  BTreeNode &b=*scratch; // the current node
+  SIZE_T secondNode; 
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr;
+  KEY_T &promotedKey=ScratchKey();
+  BTreeTraceSpan span(this,BTREE_TRACE_DESCEND,node);
+
+  rc= ReadNode(node,b);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys==0) {
+      // there are no keys on the node, so this is the first insert. Need to make a leaf node too
+      return ERROR_NONEXISTENT;
+    }
+    // recurse on the pointer before the first key that's >= our key,
+    // or on the last pointer if there is no such key
+    offset=LowerBound(b,key.data);
+    rc=b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    rc = SearchInternal2(ptr, key, value, node);
+    if(rc){return rc;}
+
+    // check if we need to split the child
+    if(NeedToSplit(ptr) && b.info.nodetype == BTREE_ROOT_NODE && b.info.numkeys == 1)
+    {
+      // The two leaves under a root with a single key may be very
+      // uneven (Delete cannot merge them, and the first insert leaves
+      // one with a single key).  Even them out first, so neither is too
+      // empty to end up further down the tree once the root splits.
+      ScratchNode scratchchild;
+      BTreeNode &child=*scratchchild;
+      rc = ReadNode(ptr, child);
+      if(rc){return rc;}
+      if(child.info.nodetype == BTREE_LEAF_NODE)
+      {
+        rc = RebalanceChild(b, offset);
+        if(rc){return rc;}
+        rc = WriteNode(node, b);
+        if(rc){return rc;}
+      }
+    }
+    if(NeedToSplit(ptr))
+    {
+      rc = SplitNode(ptr, secondNode, promotedKey);
+      if(rc){return rc;}
+      // Add the key/value (pointer) pair into an interior node
+      return AddKeyVal(node, promotedKey, VALUE_VIEW_T(), secondNode);
+    }
+    // no need to split the node
+    return rc;
+    break;
   case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-	if (op==BTREE_OP_LOOKUP) { 
-	  return b.GetVal(offset,value);
-	} else { 
-	  // BTREE_OP_UPDATE
-	  // WRITE ME
-    // b.SetVal(offset,value);
-    rc = b.SetVal(offset,value);
+    // Add a key/value pair into a leaf node
+    return AddKeyVal(node,key,value,0);
+    break;
+  default:
+    // We can't be looking at anything other than a root, internal, or leaf
+    return ERROR_INSANE;
+    break;
+  }  
+
+  return ERROR_INSANE;
+}
+
+// This adds the new key/value pair to a node
+ERROR_T BTreeIndex::AddKeyVal(const SIZE_T node, const KEY_VIEW_T &key, const VALUE_VIEW_T &value, SIZE_T newNode)
+{
+  ScratchNode scratch;
+  BTreeNode &b=*scratch;
+  SIZE_T numkeys; // the number of keys in the node before we add the new key
+  SIZE_T offset; // This is where the new key goes
+  SIZE_T pairSize; // The size of a key/value pair
+  ERROR_T rc;
+  BTreeTraceSpan span(this,BTREE_TRACE_ADDKEYVAL,node);
+
+  rc = ReadNode(node,b);
+  if(rc){return rc;}
+  numkeys = b.info.numkeys;
+
+  // Check that we have a feasible node type
+  switch(b.info.nodetype){
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      pairSize = b.info.keysize + sizeof(SIZE_T);
+      break;
+    case BTREE_LEAF_NODE:
+      pairSize = b.info.keysize + b.info.valuesize;
+      break;
+    default: // We can't be looking at anything other than a root, internal, or leaf
+      return ERROR_INSANE;
+  }
+
+  // The key goes in front of the first key that is larger than it.  Move
+  // that key and everything after it up by a position to make room.
+  offset = LowerBound(b, key.data);
+  if(b.info.nodetype == BTREE_LEAF_NODE)
+  {
+    MoveLeafSlots(b, offset+1, b, offset, numkeys-offset);
+  }
+  else
+  {
+    void *oldLoc = b.ResolveKey(offset);
+    void *newLoc = b.ResolveKey(offset+1);
+    memmove(newLoc,oldLoc,(numkeys-offset)*pairSize);
+  }
+
+  // increase the number of keys in b by one, since we are adding a key
+  b.info.numkeys++;
+
+  memcpy(KeyAt(b,offset), key.data, b.info.keysize);
+  // Do a few checks based on whether we are dealing with a root or interior node
+  if(b.info.nodetype == BTREE_LEAF_NODE)
+  {
+    memcpy(ValAt(b,offset), value.data, b.info.valuesize);
+  }
+  else // interior node: the new node is the right half of the child at offset
+  {
+    rc = b.SetPtr(offset+1,newNode);
     if(rc){return rc;}
-    return b.Serialize(buffercache, node);
+    if(NumCountSlots(b) > 0)
+    {
+      // shift the counts after the child along with its pointers, and
+      // count the two halves afresh
+      for (SIZE_T i = numkeys; i > offset; i--)
+      {
+        SetChildCount(b, i+1, ChildCount(b, i));
+      }
+      rc = RecountChild(b, offset);
+      if(rc){return rc;}
+      rc = RecountChild(b, offset+1);
+      if(rc){return rc;}
+    }
+  }
+
+  // Write the node back into the disk
+  return WriteNode(node,b);
+
+}
+
+//
+//
+// DEPTH first traversal
+// DOT is Depth + DOT format
+//
+
+ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
+				    ostream &o,
+				    BTreeDisplayType display_type) const
+{
+  KEY_T testkey;
+  SIZE_T ptr;
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+
+  rc= ReadNode(node,b);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  rc = PrintNode(o,node,b,display_type);
+  
+  if (rc) { return rc; }
+
+  if (display_type==BTREE_DEPTH_DOT) { 
+    o << ";";
+  }
+
+  if (display_type!=BTREE_SORTED_KEYVAL) {
+    o << endl;
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys>0) { 
+      for (offset=0;offset<=b.info.numkeys;offset++) { 
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	if (display_type==BTREE_DEPTH_DOT) { 
+	  o << node << " -> "<<ptr<<";\n";
 	}
+	rc=DisplayInternal(ptr,o,display_type);
+	if (rc) { return rc; }
       }
     }
-    return ERROR_NONEXISTENT;
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    return ERROR_NOERROR;
     break;
   default:
-    // We can't be looking at anything other than a root, internal, or leaf
+    if (display_type==BTREE_DEPTH_DOT) { 
+    } else {
+      o << "Unsupported Node Type " << b.info.nodetype ;
+    }
     return ERROR_INSANE;
-    break;
-  }  
+  }
 
-  return ERROR_INSANE;
+  return ERROR_NOERROR;
 }
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
+  if (display_type==BTREE_DEPTH_DOT) { 
+    o << "digraph tree { \n";
+  }
+  DisplayInternal(superblock.info.rootnode,o,display_type);
+  if (display_type==BTREE_DEPTH_DOT) { 
+    o << "}\n";
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Bulk loading
+//
+
+// Finished nodes of one level, waiting to be linked from the level
+// above: their blocks, the largest key under each and how many pairs
+// each holds
+struct BulkLevel {
+  SIZE_T              keysize;
+  std::vector<SIZE_T> blocks;
+  std::vector<char>   maxkeys;
+  std::vector<SIZE_T> counts;
+
+  BulkLevel(const SIZE_T k) : keysize(k) {}
+  SIZE_T       Size() const { return blocks.size(); }
+  const char * MaxKey(const SIZE_T i) const { return &maxkeys[i*keysize]; }
+};
+
+// Blocks next up to end are a thread's to write leaves to
+struct BulkExtent {
+  SIZE_T next;
+  SIZE_T end;
+
+  BulkExtent() : next(0), end(0) {}
+};
+
+ERROR_T BTreeIndex::AllocateBulkExtent(BulkExtent &extent)
+{
+  std::lock_guard<std::mutex> g(snaplock);
+  SIZE_T limit=journalstart ? journalstart : buffercache->GetNumBlocks();
   ERROR_T rc;
-  unsigned i;
 
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
+  if (nextfresh==0 || nextfresh>=limit) {
+    journalfailed=(format&BTREE_FORMAT_JOURNAL)!=0;
+    return ERROR_NOSPACE;
+  }
+  extent.next=nextfresh;
+  extent.end=std::min<SIZE_T>(nextfresh+BTREE_BULK_EXTENT,limit);
+  nextfresh=extent.end;
+  rc=WriteSuperblock();
+  if (rc) { return rc; }
+  // the other threads are using the cache
+  std::lock_guard<std::mutex> c(*cachelock);
+  for (SIZE_T n=extent.next;n<extent.end;n++) {
+    buffercache->NotifyAllocateBlock(n);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::FinishBulkNode(BTreeNode &b,
+				   const char *maxkey,
+				   BulkLevel &level,
+				   std::vector<SIZE_T> &written,
+				   BulkExtent *extent)
+{
+  ERROR_T rc;
+  SIZE_T block;
+  BTreeNode phys;
+
+  if ((format&BTREE_FORMAT_COMPRESS) && b.info.nodetype==BTREE_LEAF_NODE) {
+    // WriteNode would keep an oversized leaf in memory for a split that
+    // is not coming
+    rc=PackLeaf(b,phys);
+    if (rc) { return rc; }
+  }
+
+  if (!extent) {
+    rc=AllocateNode(block);
+    if (rc) { return rc; }
+    written.push_back(block);
+    b.info.rootnode=superblock.info.rootnode;
+    rc=WriteNode(block,b);
+    if (rc) { return rc; }
   } else {
+    if (extent->next==extent->end) {
+      rc=AllocateBulkExtent(*extent);
+      if (rc) { return rc; }
+    }
+    block=extent->next++;
+    written.push_back(block);
+    b.info.rootnode=superblock.info.rootnode;
+    // WriteNode, less the snapshots a parallel load never has
+    if (!blockversions.empty()) {
+      blockversions[block]++;
+    }
+    if (filterbudget>0) {
+      BuildLeafFilter(block,b);
+    }
+    rc=StoreNode(block,b);
+    if (rc) { return rc; }
   }
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (dt==BTREE_SORTED_KEYVAL) {
-    } else {
-      if (dt==BTREE_DEPTH_DOT) { 
-      } else { 
-	os << "Interior: ";
+  level.blocks.push_back(block);
+  level.counts.push_back(SubtreeCount(b));
+  if (maxkey) {
+    level.maxkeys.insert(level.maxkeys.end(),maxkey,maxkey+level.keysize);
+  } else {
+    // an empty leaf; only ever the last child, so its key is never used
+    level.maxkeys.resize(level.maxkeys.size()+level.keysize,0);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::BuildBulkLevel(const BulkLevel &children,
+				   BulkLevel &level,
+				   std::vector<SIZE_T> &written)
+{
+  ERROR_T rc;
+  BTreeNode b(BTREE_INTERIOR_NODE,
+	      superblock.info.keysize,
+	      superblock.info.valuesize,
+	      buffercache->GetBlockSize());
+  // a node with as many keys as slots has to split, so at most slots
+  // children per node
+  SIZE_T maxchildren=NumSlots(b);
+
+  if (NumMessageSlots(b)>0) {
+    SetNumMessages(b,0);
+  }
+  SIZE_T m=children.Size();
+  SIZE_T numnodes=(m+maxchildren-1)/maxchildren;
+
+  // Spread the children evenly, so every node is at least half full
+  for (SIZE_T n=0;n<numnodes;n++) {
+    SIZE_T first=n*m/numnodes;
+    SIZE_T last=(n+1)*m/numnodes;
+    for (SIZE_T i=first;i<last;i++) {
+      rc=b.SetPtr(i-first,children.blocks[i]);
+      if (rc) { return rc; }
+      if (NumCountSlots(b)>0) {
+	SetChildCount(b,i-first,children.counts[i]);
       }
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	os << "*" << ptr << " ";
-	// Last pointer
-	if (offset==b.info.numkeys) break;
-	rc=b.GetKey(offset,key);
-	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) { 
-	  os << key.data[i];
-	}
-	os << " ";
+      if (i+1<last) {
+	memcpy(b.ResolveKey(i-first),children.MaxKey(i),b.info.keysize);
       }
     }
-    break;
-  case BTREE_LEAF_NODE:
-    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
-    } else {
-      os << "Leaf: ";
+    b.info.numkeys=last-first-1;
+    rc=FinishBulkNode(b,children.MaxKey(last-1),level,written);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::BulkLoad(BTreeBulkSource &source, const SIZE_T fillpercent)
+{
+  return BulkLoadSources(std::vector<BTreeBulkSource *>(1,&source),fillpercent);
+}
+
+ERROR_T BTreeIndex::BulkLoadSources(const std::vector<BTreeBulkSource *> &sources,
+				    const SIZE_T fillpercent)
+{
+  ERROR_T rc;
+
+  if (!(format&BTREE_FORMAT_JOURNAL)) {
+    return BulkLoadInternal(sources,fillpercent);
+  }
+  // nearly every block a load writes is fresh, so journaling costs
+  // little; start from a checkpoint so a failed load can go back to it
+  rc=BeginUpdate();
+  if (rc) { return rc; }
+  rc=Checkpoint();
+  if (rc) { return rc; }
+  rc=BulkLoadInternal(sources,fillpercent);
+  if (!rc && journalfailed) {
+    rc=ERROR_NOSPACE;
+  }
+  if (rc) {
+    Rollback();
+    return rc;
+  }
+  return Checkpoint();
+}
+
+ERROR_T BTreeIndex::BuildBulkLeaves(BTreeBulkSource &source,
+				    const SIZE_T fillpercent,
+				    BulkLevel &level,
+				    std::vector<SIZE_T> &written,
+				    BulkExtent *extent)
+{
+  ERROR_T rc;
+  KEY_VIEW_T key;
+  VALUE_VIEW_T value;
+  SIZE_T keysize=superblock.info.keysize;
+  BTreeNode cur(BTREE_LEAF_NODE,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		LeafBlockSize());
+  BTreeNode prev=cur;
+  BTreeNode phys;
+  bool haveprev=false;
+  SIZE_T slots=NumSlots(cur);
+  SIZE_T minkeys=MinKeys(cur);
+  SIZE_T target=slots*fillpercent/100;
+  SIZE_T pairbytes=superblock.info.keysize+superblock.info.valuesize;
+  // a compressed leaf always has room for a block's worth of pairs
+  SIZE_T firstcheck=(slots+2)/2+1;
+  SIZE_T checkat=firstcheck;
+  unsigned header;
+
+  if (target>slots-1) { target=slots-1; }
+  if (target<minkeys) { target=minkeys; }
+  if (target==0) { target=1; }
+
+  // Finish prev and make cur the new prev
+  auto rotate=[&]() -> ERROR_T {
+    if (haveprev) {
+      ERROR_T rc=FinishBulkNode(prev,KeyAt(prev,prev.info.numkeys-1),level,written,extent);
+      if (rc) { return rc; }
     }
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      if (offset==0) { 
-	// special case for first pointer
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (dt!=BTREE_SORTED_KEYVAL) { 
-	  os << "*" << ptr << " ";
+    prev=cur;
+    haveprev=true;
+    cur.info.numkeys=0;
+    checkat=firstcheck;
+    return ERROR_NOERROR;
+  };
+
+  // Fill leaves left to right.  The previous leaf is held back so that
+  // if the last one comes up short the two can be evened out.
+  while ((rc=source.Next(key,value))==ERROR_NOERROR) {
+    if (key.length!=keysize || value.length!=superblock.info.valuesize) {
+      rc=ERROR_SIZE;
+      break;
+    }
+    if (cur.info.numkeys==target) {
+      rc=rotate();
+      if (rc) { break; }
+    }
+    const char *last=0;
+    if (cur.info.numkeys>0) {
+      last=KeyAt(cur,cur.info.numkeys-1);
+    } else if (haveprev) {
+      last=KeyAt(prev,prev.info.numkeys-1);
+    }
+    if (last && CompareKeys(last,key.data)>=0) {
+      rc=ERROR_BADCONFIG;
+      break;
+    }
+    memcpy(KeyAt(cur,cur.info.numkeys),key.data,keysize);
+    memcpy(ValAt(cur,cur.info.numkeys),value.data,superblock.info.valuesize);
+    cur.info.numkeys++;
+
+    // A compressed leaf is also full once it stops fitting in a block.
+    // Checking costs a compression, so after each check skip as many
+    // pairs as could be added to the room left even if they did not
+    // compress at all.
+    if ((format&BTREE_FORMAT_COMPRESS) && cur.info.numkeys>=checkat) {
+      rc=PackLeaf(cur,phys);
+      if (rc==ERROR_SIZE) {
+	// this pair starts the next leaf
+	cur.info.numkeys--;
+	rc=rotate();
+	if (rc) { break; }
+	MoveLeafSlots(cur,0,prev,prev.info.numkeys,1);
+	cur.info.numkeys=1;
+	continue;
+      }
+      if (rc) { break; }
+      memcpy(&header,phys.data,sizeof(header));
+      SIZE_T room=phys.info.GetNumDataBytes()-sizeof(unsigned)-TrailerBytes(phys)-(header&~BTREE_LZ_RAW);
+      // a pair can also break up a match, hence the slack
+      checkat=cur.info.numkeys+1+room/(pairbytes+8);
+    }
+  }
+
+  if (rc==ERROR_NONEXISTENT) {
+    rc=ERROR_NOERROR;
+    if (!haveprev && cur.info.numkeys==0) {
+      // nothing to load
+      return ERROR_NOERROR;
+    }
+    if (!haveprev) {
+      // The root needs at least one key and two children, so a single
+      // leaf is split in two (the second may be empty, as after the
+      // first Insert)
+      prev=cur;
+      prev.info.numkeys=(cur.info.numkeys+1)/2;
+      cur.info.numkeys-=prev.info.numkeys;
+      MoveLeafSlots(cur,0,cur,prev.info.numkeys,cur.info.numkeys);
+      haveprev=true;
+    } else if (cur.info.numkeys<minkeys) {
+      // Move keys from the end of prev so both halves are equally full
+      SIZE_T move=prev.info.numkeys-(prev.info.numkeys+cur.info.numkeys+1)/2;
+      if ((format&BTREE_FORMAT_COMPRESS) && cur.info.numkeys+move>minkeys) {
+	// prev may hold more than fits in a block uncompressed, and there
+	// is no telling how well its tail compresses; just top cur up
+	move=minkeys-cur.info.numkeys;
+      }
+      MoveLeafSlots(cur,move,cur,0,cur.info.numkeys);
+      MoveLeafSlots(cur,0,prev,prev.info.numkeys-move,move);
+      prev.info.numkeys-=move;
+      cur.info.numkeys+=move;
+    }
+    rc=FinishBulkNode(prev,KeyAt(prev,prev.info.numkeys-1),level,written,extent);
+    if (!rc) {
+      rc=FinishBulkNode(cur,cur.info.numkeys ? KeyAt(cur,cur.info.numkeys-1) : 0,level,written,extent);
+    }
+  }
+  return rc;
+}
+
+ERROR_T BTreeIndex::BulkLoadInternal(const std::vector<BTreeBulkSource *> &sources,
+				     const SIZE_T fillpercent)
+{
+  ERROR_T rc;
+  BTreeNode root;
+  SIZE_T keysize=superblock.info.keysize;
+  std::vector<SIZE_T> written;
+  BulkLevel level(keysize);
+
+  rc=ReadNode(superblock.info.rootnode,root);
+  if (rc) { return rc; }
+  if (root.info.numkeys!=0) {
+    return ERROR_BADCONFIG;
+  }
+  rightleaf=0;
+
+  if (sources.size()==1) {
+    rc=BuildBulkLeaves(*sources[0],fillpercent,level,written,0);
+  } else {
+    // Each thread fills the leaves of its run into extents of its own;
+    // the interior levels over all of them are built here afterwards
+    SIZE_T numworkers=sources.size();
+    std::vector<BulkLevel> levels(numworkers,BulkLevel(keysize));
+    std::vector<std::vector<SIZE_T> > writtens(numworkers);
+    std::vector<BulkExtent> extents(numworkers);
+    std::vector<ERROR_T> results(numworkers,ERROR_NOERROR);
+    std::vector<std::thread> workers;
+
+    for (SIZE_T w=0;w<numworkers;w++) {
+      workers.push_back(std::thread([&,w]() {
+	results[w]=BuildBulkLeaves(*sources[w],fillpercent,levels[w],writtens[w],&extents[w]);
+      }));
+    }
+    for (SIZE_T w=0;w<numworkers;w++) {
+      workers[w].join();
+    }
+    for (SIZE_T w=0;w<numworkers;w++) {
+      if (!rc) {
+	rc=results[w];
+      }
+      written.insert(written.end(),writtens[w].begin(),writtens[w].end());
+      level.blocks.insert(level.blocks.end(),levels[w].blocks.begin(),levels[w].blocks.end());
+      level.maxkeys.insert(level.maxkeys.end(),levels[w].maxkeys.begin(),levels[w].maxkeys.end());
+      level.counts.insert(level.counts.end(),levels[w].counts.begin(),levels[w].counts.end());
+    }
+
+    // Blocks handed out but not filled go on the free list, where the
+    // interior levels pick them up.  Never written, so not through
+    // FreeNode, which reads them back.
+    BTreeNode freed(BTREE_UNALLOCATED_BLOCK,
+		    superblock.info.keysize,
+		    superblock.info.valuesize,
+		    buffercache->GetBlockSize());
+    freed.info.rootnode=superblock.info.rootnode;
+    bool returned=false;
+    for (SIZE_T w=0;w<numworkers;w++) {
+      for (SIZE_T n=extents[w].next;n<extents[w].end;n++) {
+	freed.info.freelist=superblock.info.freelist;
+	ERROR_T frc=StoreNode(n,freed);
+	if (frc) {
+	  // lost until the disk is formatted again, but nothing points at it
+	  continue;
 	}
+	superblock.info.freelist=n;
+	{
+	  std::lock_guard<std::mutex> c(*cachelock);
+	  buffercache->NotifyDeallocateBlock(n);
+	}
+	returned=true;
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << "(";
+    }
+    if (returned) {
+      ERROR_T frc=WriteSuperblock();
+      if (!rc) {
+	rc=frc;
       }
-      rc=b.GetKey(offset,key);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) { 
-	os << key.data[i];
+    }
+  }
+  if (!rc && level.Size()==0) {
+    // nothing to load
+    return ERROR_NOERROR;
+  }
+
+  // Stack interior levels until everything fits under the root
+  while (!rc && level.Size()>NumSlots(root)) {
+    BulkLevel up(keysize);
+    rc=BuildBulkLevel(level,up,written);
+    level.blocks.swap(up.blocks);
+    level.maxkeys.swap(up.maxkeys);
+    level.counts.swap(up.counts);
+  }
+
+  if (!rc) {
+    for (SIZE_T i=0;i<level.Size() && !rc;i++) {
+      rc=root.SetPtr(i,level.blocks[i]);
+      if (NumCountSlots(root)>0) {
+	SetChildCount(root,i,level.counts[i]);
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ",";
-      } else {
-	os << " ";
+      if (!rc && i+1<level.Size()) {
+	memcpy(root.ResolveKey(i),level.MaxKey(i),keysize);
       }
-      rc=b.GetVal(offset,value);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) { 
-	os << value.data[i];
+    }
+    root.info.numkeys=level.Size()-1;
+    if (!rc) {
+      rc=WriteNode(superblock.info.rootnode,root);
+    }
+  }
+
+  if (rc) {
+    // Nothing points at what we wrote, so give it back
+    for (SIZE_T i=0;i<written.size();i++) {
+      DeallocateNode(written[i]);
+    }
+  }
+  return rc;
+}
+
+// Hands BulkLoad the pairs first up to last of an array of them, in the
+// order of order if there is one
+class BulkArraySource : public BTreeBulkSource {
+ public:
+  BulkArraySource(const char *p, const SIZE_T k, const SIZE_T v,
+		  const SIZE_T *o, const SIZE_T first, const SIZE_T last) :
+    pairs(p), keysize(k), pairsize(k+v), order(o), next(first), end(last) {}
+
+  ERROR_T Next(KEY_VIEW_T &key, VALUE_VIEW_T &value)
+  {
+    if (next==end) { return ERROR_NONEXISTENT; }
+    const char *pair=pairs+(order ? order[next] : next)*pairsize;
+    next++;
+    key=KEY_VIEW_T(pair,keysize);
+    value=VALUE_VIEW_T(pair+keysize,pairsize-keysize);
+    return ERROR_NOERROR;
+  }
+
+ private:
+  const char   *pairs;
+  SIZE_T        keysize;
+  SIZE_T        pairsize;
+  const SIZE_T *order;
+  SIZE_T        next;
+  SIZE_T        end;
+};
+
+ERROR_T BTreeIndex::BulkLoadParallel(const char *pairs,
+				     const SIZE_T count,
+				     const SIZE_T threads,
+				     const bool sorted,
+				     const SIZE_T fillpercent)
+{
+  SIZE_T keysize=superblock.info.keysize;
+  SIZE_T pairsize=keysize+superblock.info.valuesize;
+  BTreeNode leaf(BTREE_LEAF_NODE,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 LeafBlockSize());
+  std::vector<SIZE_T> order;
+  std::vector<BulkArraySource> parts;
+  std::vector<BTreeBulkSource *> sources;
+  SIZE_T numworkers=threads;
+
+  if (numworkers==0) {
+    numworkers=std::thread::hardware_concurrency();
+  }
+  // a run too short leaves the leaves either side of the cuts half full
+  if (numworkers>count/(4*NumSlots(leaf))) {
+    numworkers=count/(4*NumSlots(leaf));
+  }
+  if (numworkers==0) { numworkers=1; }
+
+  if (!sorted) {
+    // Sort the positions of the pairs, a run a thread, then merge the
+    // runs pairwise, each merge on a thread of its own
+    auto less=[&](const SIZE_T a, const SIZE_T b) {
+      return CompareKeys(pairs+a*pairsize,pairs+b*pairsize)<0;
+    };
+    std::vector<SIZE_T> bounds;
+    std::vector<std::thread> workers;
+
+    order.resize(count);
+    for (SIZE_T i=0;i<count;i++) {
+      order[i]=i;
+    }
+    for (SIZE_T w=0;w<=numworkers;w++) {
+      bounds.push_back(w*count/numworkers);
+    }
+    for (SIZE_T w=0;w<numworkers;w++) {
+      workers.push_back(std::thread([&,w]() {
+	std::sort(order.begin()+bounds[w],order.begin()+bounds[w+1],less);
+      }));
+    }
+    for (SIZE_T w=0;w<workers.size();w++) {
+      workers[w].join();
+    }
+    while (bounds.size()>2) {
+      std::vector<SIZE_T> merged;
+      workers.clear();
+      for (SIZE_T r=0;r+1<bounds.size();r+=2) {
+	merged.push_back(bounds[r]);
+	if (r+2<bounds.size()) {
+	  workers.push_back(std::thread([&,r]() {
+	    std::inplace_merge(order.begin()+bounds[r],order.begin()+bounds[r+1],
+			       order.begin()+bounds[r+2],less);
+	  }));
+	}
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ")\n";
-      } else {
-	os << " ";
+      merged.push_back(count);
+      for (SIZE_T w=0;w<workers.size();w++) {
+	workers[w].join();
       }
+      bounds.swap(merged);
     }
-    break;
-  default:
-    if (dt==BTREE_DEPTH_DOT) { 
-      os << "Unknown("<<b.info.nodetype<<")";
+  }
+
+  // Only fresh blocks can be handed out to threads
+  if (allocator || superblock.info.freelist!=0 || !reclaim.empty() ||
+      numsnapshots>0 || nextfresh==0) {
+    numworkers=1;
+  }
+  for (SIZE_T w=0;w<numworkers;w++) {
+    SIZE_T first=w*count/numworkers;
+    SIZE_T last=(w+1)*count/numworkers;
+    // each run checks its own order; the cuts between them are checked here
+    if (w>0) {
+      const char *before=pairs+(order.empty() ? first-1 : order[first-1])*pairsize;
+      const char *after=pairs+(order.empty() ? first : order[first])*pairsize;
+      if (CompareKeys(before,after)>=0) {
+	return ERROR_BADCONFIG;
+      }
+    }
+    parts.push_back(BulkArraySource(pairs,keysize,pairsize-keysize,
+				    order.empty() ? 0 : &order[0],first,last));
+  }
+  for (SIZE_T w=0;w<numworkers;w++) {
+    sources.push_back(&parts[w]);
+  }
+  return BulkLoadSources(sources,fillpercent);
+}
+
+
+//
+// Binary export and import
+//
+// The stream is an ExportHeader followed by chunks, each a SIZE_T pair
+// count and then that many key/value pairs back to back.  A chunk with a
+// count of zero ends the stream.
+//
+
+#define BTREE_EXPORT_MAGIC 0x42545845
+#define BTREE_EXPORT_CHUNK (1024*1024)
+
+struct ExportHeader {
+  SIZE_T magic;
+  SIZE_T keysize;
+  SIZE_T valuesize;
+  SIZE_T keycompare;
+};
+
+struct ExportWriter {
+  ostream          *o;
+  SIZE_T            pairsize;
+  SIZE_T            count;
+  std::vector<char> buf;
+
+  bool Flush()
+  {
+    if (count>0) {
+      o->write((const char *)&count,sizeof(count));
+      o->write(&buf[0],count*pairsize);
+      count=0;
+    }
+    return o->good();
+  }
+};
+
+ERROR_T BTreeIndex::ExportInternal(const SIZE_T node, ExportWriter &w) const
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T ptr;
+
+  rc=ReadNode(node,b);
+  if (rc) { return rc; }
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (NumMessageSlots(b)>0 && NumMessages(b)>0) {
+      // the leaves below are not current
+      return ERROR_BADCONFIG;
+    }
+    if (b.info.numkeys>0) {
+      for (offset=0;offset<=b.info.numkeys;offset++) {
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	rc=ExportInternal(ptr,w);
+	if (rc) { return rc; }
+      }
+    }
+    return ERROR_NOERROR;
+  case BTREE_LEAF_NODE:
+    if ((w.count+b.info.numkeys)*w.pairsize>w.buf.size()) {
+      if (!w.Flush()) { return ERROR_NOSPACE; }
+    }
+    if (format&BTREE_FORMAT_SPLITLEAF) {
+      for (offset=0;offset<b.info.numkeys;offset++) {
+	memcpy(&w.buf[(w.count+offset)*w.pairsize],KeyAt(b,offset),b.info.keysize);
+	memcpy(&w.buf[(w.count+offset)*w.pairsize+b.info.keysize],ValAt(b,offset),b.info.valuesize);
+      }
     } else {
-      os << "Unsupported Node Type " << b.info.nodetype ;
+      // the pairs in a leaf are contiguous, so copy them out in one go
+      memcpy(&w.buf[w.count*w.pairsize],b.ResolveKey(0),b.info.numkeys*w.pairsize);
+    }
+    w.count+=b.info.numkeys;
+    return ERROR_NOERROR;
+  default:
+    return ERROR_INSANE;
+  }
+}
+
+ERROR_T BTreeIndex::Export(ostream &o) const
+{
+  ERROR_T rc;
+  ExportHeader h;
+  ExportWriter w;
+  SIZE_T end=0;
+
+  h.magic=BTREE_EXPORT_MAGIC;
+  h.keysize=superblock.info.keysize;
+  h.valuesize=superblock.info.valuesize;
+  h.keycompare=keycompare;
+  o.write((const char *)&h,sizeof(h));
+
+  w.o=&o;
+  w.pairsize=h.keysize+h.valuesize;
+  w.count=0;
+  // big enough for at least one full leaf
+  w.buf.resize(BTREE_EXPORT_CHUNK>buffercache->GetBlockSize() ? BTREE_EXPORT_CHUNK : buffercache->GetBlockSize());
+
+  rc=ExportInternal(superblock.info.rootnode,w);
+  if (rc) { return rc; }
+  if (!w.Flush()) { return ERROR_NOSPACE; }
+  o.write((const char *)&end,sizeof(end));
+  o.flush();
+  return o.good() ? ERROR_NOERROR : ERROR_NOSPACE;
+}
+
+// Feeds the pairs of an exported stream to BulkLoad a buffer at a time
+class ImportSource : public BTreeBulkSource {
+ public:
+  ImportSource(istream &in, const SIZE_T k, const SIZE_T v) :
+    i(in), keysize(k), pairsize(k+v), remaining(0), pos(0), avail(0), done(false)
+  {
+    buf.resize((BTREE_EXPORT_CHUNK/pairsize+1)*pairsize);
+  }
+
+  ERROR_T Next(KEY_VIEW_T &key, VALUE_VIEW_T &value)
+  {
+    if (pos==avail) {
+      if (done) { return ERROR_NONEXISTENT; }
+      if (remaining==0) {
+	i.read((char *)&remaining,sizeof(remaining));
+	if (!i.good()) { return ERROR_BADCONFIG; }
+	if (remaining==0) {
+	  done=true;
+	  return ERROR_NONEXISTENT;
+	}
+      }
+      avail=buf.size()/pairsize;
+      if (avail>remaining) { avail=remaining; }
+      i.read(&buf[0],avail*pairsize);
+      if (!i.good()) { return ERROR_BADCONFIG; }
+      remaining-=avail;
+      pos=0;
     }
+    key=KEY_VIEW_T(&buf[pos*pairsize],keysize);
+    value=VALUE_VIEW_T(&buf[pos*pairsize+keysize],pairsize-keysize);
+    pos++;
+    return ERROR_NOERROR;
   }
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << "\" ]";
+
+ private:
+  istream          &i;
+  SIZE_T            keysize;
+  SIZE_T            pairsize;
+  SIZE_T            remaining;  // pairs of the current chunk not yet read
+  SIZE_T            pos;
+  SIZE_T            avail;
+  bool              done;
+  std::vector<char> buf;
+};
+
+ERROR_T BTreeIndex::Import(istream &i, const SIZE_T fillpercent)
+{
+  ExportHeader h;
+
+  i.read((char *)&h,sizeof(h));
+  if (!i.good() || h.magic!=BTREE_EXPORT_MAGIC) {
+    return ERROR_BADCONFIG;
   }
-  return ERROR_NOERROR;
+  if (h.keysize!=superblock.info.keysize
+      || h.valuesize!=superblock.info.valuesize
+      || h.keycompare!=keycompare) {
+    return ERROR_BADCONFIG;
+  }
+
+  ImportSource source(i,h.keysize,h.valuesize);
+  return BulkLoad(source,fillpercent);
 }
-  
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+
+
+//
+// Leaf filters
+//
+
+// FNV-1a followed by a 64 bit finalizer, so that keys differing only in
+// their low bytes (big-endian counters) still spread over the filter
+static unsigned long long HashKey(const char *key, const SIZE_T keysize)
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  unsigned long long h=0xcbf29ce484222325ULL;
+
+  for (SIZE_T i=0;i<keysize;i++) {
+    h=(h^(unsigned char)key[i])*0x100000001b3ULL;
+  }
+  h^=h>>33;
+  h*=0xff51afd7ed558ccdULL;
+  h^=h>>33;
+  h*=0xc4ceb9fe1a85ec53ULL;
+  h^=h>>33;
+  return h;
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::SetLeafFilters(const double fpr, const SIZE_T budget)
 {
-    // WRITE ME
-    ERROR_T rc;
-    BTreeNode root;
-    root.Unserialize(buffercache,superblock.info.rootnode);
+  std::lock_guard<std::mutex> g(filterlock);
+  leaffilters.clear();
+  filterbytes=0;
+  filterbudget=0;
+  if (budget==0) {
+    return ERROR_NOERROR;
+  }
+  if (!(fpr>0 && fpr<1)) {
+    return ERROR_BADCONFIG;
+  }
+  // The filters hash key bytes, so keys that compare equal must be equal
+  // byte for byte
+  if (keycompare!=BTREE_CMP_BYTES && keycompare!=BTREE_CMP_UINT64 && keycompare!=BTREE_CMP_INT64) {
+    return ERROR_BADCONFIG;
+  }
+  // the usual optimum: -ln(p)/ln(2)^2 bits and ln(2) hashes per bit per key
+  filterbitsperkey=(SIZE_T)ceil(-log(fpr)/(M_LN2*M_LN2));
+  filterhashes=(SIZE_T)floor(filterbitsperkey*M_LN2+0.5);
+  if (filterhashes<1) { filterhashes=1; }
+  filterbudget=budget;
+  return ERROR_NOERROR;
+}
 
-    // Variables to hold values in case we need to split the root node (Subcase 2B)
-    VALUE_T temp;
-    SIZE_T originalRoot = superblock.info.rootnode;
-    SIZE_T newNode;
-    KEY_T promotedKey;
+void BTreeIndex::BuildLeafFilter(const SIZE_T node, const BTreeNode &b, const bool replace) const
+{
+  std::lock_guard<std::mutex> g(filterlock);
+  std::map<SIZE_T,std::vector<unsigned long long> >::iterator f=leaffilters.find(node);
+  // sized for a full leaf so the false positive rate holds at any fill
+  SIZE_T words=(NumSlots(b)*filterbitsperkey+63)/64;
 
-    // CASE 1: Root is empty, nothing has been inserted yet
-    if(root.info.numkeys == 0)
-    {
-      // Similar to Attach function. So we want to attach a leaf node to the root
-      // I.e. When we insert our first item, let's make a leaf node to contain it,
-      // so we don't have a tree with just a root with values.
-      BTreeNode leaf(BTREE_LEAF_NODE,
-        superblock.info.keysize,
-        superblock.info.valuesize,
-        buffercache->GetBlockSize());
+  if (f!=leaffilters.end() && !replace) {
+    return;
+  }
+  if (f==leaffilters.end()) {
+    if (filterbytes+words*sizeof(unsigned long long)>filterbudget) {
+      return;
+    }
+    filterbytes+=words*sizeof(unsigned long long);
+    f=leaffilters.insert(std::make_pair(node,std::vector<unsigned long long>(words))).first;
+  } else {
+    std::fill(f->second.begin(),f->second.end(),0ULL);
+  }
 
-      // Now let us allocate two leaf nodes to get the linked list started
-      SIZE_T firstNode;
-      SIZE_T secondNode;
-      rc = AllocateNode(firstNode);
-      if(rc){return rc;}
-      rc = AllocateNode(secondNode);
-      if(rc){return rc;}
+  SIZE_T nbits=words*64;
+  for (SIZE_T i=0;i<b.info.numkeys;i++) {
+    unsigned long long h=HashKey(KeyAt(b,i),b.info.keysize);
+    unsigned long long step=(h>>32)|1;
+    for (SIZE_T j=0;j<filterhashes;j++) {
+      SIZE_T bit=h%nbits;
+      f->second[bit/64]|=1ULL<<(bit%64);
+      h+=step;
+    }
+  }
+}
 
-      // Write the leaves to the disk
-      leaf.Serialize(buffercache, firstNode);
-      leaf.Serialize(buffercache, secondNode);
-      // increment the number of keys in the root by 1 since we are adding a Key
-      root.info.numkeys += 1;
-      // Take care of setting the first key in root to our input key, and then
-      // set the first key's value to point to the first leaf node. 
-      root.SetKey(0,key);
-      root.SetPtr(0,firstNode);
-      // Set the next pointer (in the position right after the inserted value pointer) 
-      // to point to the second leaf node.
-      root.SetPtr(1,secondNode);
-      // Now write the entire root node block to the disk
-      root.Serialize(buffercache, superblock.info.rootnode);
+void BTreeIndex::DropLeafFilter(const SIZE_T node) const
+{
+  std::lock_guard<std::mutex> g(filterlock);
+  std::map<SIZE_T,std::vector<unsigned long long> >::iterator f=leaffilters.find(node);
+
+  if (f!=leaffilters.end()) {
+    filterbytes-=f->second.size()*sizeof(unsigned long long);
+    leaffilters.erase(f);
+  }
+}
+
+bool BTreeIndex::LeafFilterExcludes(const SIZE_T node, const char *key) const
+{
+  if (filterbudget==0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> g(filterlock);
+  std::map<SIZE_T,std::vector<unsigned long long> >::const_iterator f=leaffilters.find(node);
+  if (f==leaffilters.end()) {
+    return false;
+  }
 
+  SIZE_T nbits=f->second.size()*64;
+  unsigned long long h=HashKey(key,superblock.info.keysize);
+  unsigned long long step=(h>>32)|1;
+  for (SIZE_T j=0;j<filterhashes;j++) {
+    SIZE_T bit=h%nbits;
+    if (!(f->second[bit/64]&(1ULL<<(bit%64)))) {
+      filterskips++;
+      return true;
     }
+    h+=step;
+  }
+  return false;
+}
 
-    // CASE 2: The key does not exist, so we can insert normally using SearchInternal2
-    // First, we must check that the key does not exist in the Btree already, using Lookup
-    if(Lookup(key,temp)==ERROR_NONEXISTENT)
-    {
-      // SUBCASE 2A: "Normal" insert. We do not have to split the root node
-      // (Make a single call here to SearchInternal2, which handles all the recursion and value-placing)
-      rc = SearchInternal2(superblock.info.rootnode, key, value, superblock.info.rootnode);
 
-      // SUBCASE 2B: We need to split the root node 
-      // idea: We can load the original root node data into two interior nodes, and then save
-      // the two new interior nodes onto the disk, and then make a new root node, setting
-      // its first key to the promoted key, and then setting its first pointer (0) to the 
-      // left interior node of split and its second pointer (1) to the right interior node of split
-      // (Sort of a similar idea to Case 1)
-      if(NeedToSplit(superblock.info.rootnode))
-      {
-        SplitNode(originalRoot, newNode, promotedKey);
-        // Similar to Attach function. So we want to initialize an interior node type
-        // in order to hold the information previously in the root
-        BTreeNode interior(BTREE_INTERIOR_NODE, 
-          superblock.info.keysize,
-          superblock.info.valuesize,
-          buffercache->GetBlockSize());
+//
+// Adaptive hash index
+//
 
-        // Read the data from the original root (split over originalRoot and newNode from the SplitNode function)
-        // Write the two new interior nodes to the disk, using the original root data
-        interior.Unserialize(buffercache, originalRoot);
-        interior.Serialize(buffercache, originalRoot);
-        interior.Unserialize(buffercache, newNode);
-        interior.Serialize(buffercache, newNode);
+// An entry stops gaining credit here, so a key that has gone cold can be
+// displaced after a few lookups of whatever hashes to the same place
+#define BTREE_HASH_MAXHITS 8
 
+ERROR_T BTreeIndex::SetHashIndex(const SIZE_T entries)
+{
+  SIZE_T n=1;
+
+  hashkeys.clear();
+  hashleaf.clear();
+  hashslot.clear();
+  hashversion.clear();
+  hashhits.clear();
+  if (!fingersearch) {
+    blockversions.clear();
+  }
+  hashmask=0;
+  if (entries==0) {
+    return ERROR_NOERROR;
+  }
+  while (n<entries) {
+    n*=2;
+  }
+  hashkeys.resize(n*superblock.info.keysize);
+  hashleaf.resize(n);
+  hashslot.resize(n);
+  hashversion.resize(n);
+  hashhits.resize(n,0);
+  blockversions.assign(buffercache->GetNumBlocks(),0);
+  // the versions start over, so the fingers must too
+  fingerepoch=++fingerepochs;
+  hashmask=n-1;
+  return ERROR_NOERROR;
+}
 
+bool BTreeIndex::HashProbe(const char *key, SIZE_T &leaf, SIZE_T &offset)
+{
+  if (hashmask==0) {
+    return false;
+  }
+  SIZE_T e=HashKey(key,superblock.info.keysize)&hashmask;
+  std::lock_guard<std::mutex> g(hashlock);
+  if (hashhits[e]==0 || memcmp(&hashkeys[e*superblock.info.keysize],key,superblock.info.keysize)!=0) {
+    return false;
+  }
+  if (hashversion[e]!=blockversions[hashleaf[e]]) {
+    // the leaf was split, shifted or freed since; look the key up properly
+    hashhits[e]=0;
+    return false;
+  }
+  leaf=hashleaf[e];
+  offset=hashslot[e];
+  hashfound++;
+  return true;
+}
 
+void BTreeIndex::HashRecord(const char *key, const SIZE_T leaf, const SIZE_T offset)
+{
+  if (hashmask==0) {
+    return;
+  }
+  SIZE_T e=HashKey(key,superblock.info.keysize)&hashmask;
+  std::lock_guard<std::mutex> g(hashlock);
+  if (hashhits[e]>0 && memcmp(&hashkeys[e*superblock.info.keysize],key,superblock.info.keysize)!=0) {
+    // someone else's entry: wear it down rather than thrash it
+    hashhits[e]--;
+    return;
+  }
+  memcpy(&hashkeys[e*superblock.info.keysize],key,superblock.info.keysize);
+  hashleaf[e]=leaf;
+  hashslot[e]=offset;
+  hashversion[e]=blockversions[leaf];
+  if (hashhits[e]<BTREE_HASH_MAXHITS) {
+    hashhits[e]++;
+  }
+}
 
-        // We want to allocate a new empty root node
-        rc = AllocateNode(superblock.info.rootnode);
-        if(rc){return rc;}
 
-        // increment the number of keys in the root by 1 since we are adding a Key
-        // Since this is the first key in the root node, just set numkeys to 1
-        root.info.numkeys = 1;
-        // Take care of setting the first key in root to our promoted key that we found from SplitNode, 
-        // and then set the first key's value to point to the left interior node that used to be the root (originalRoot) 
-        root.SetKey(0,promotedKey);
-        root.SetPtr(0,originalRoot);
-        // Set the next pointer (in the position right after the inserted value pointer) 
-        // to point to the right interior node that used to be the root (newNode).
-        root.SetPtr(1,newNode);
-        // Now write the entire root node block to the disk
-        root.Serialize(buffercache, superblock.info.rootnode);
+//
+// Finger search
+//
+// A thread's finger is the path of its last descent into an index, with
+// the range of keys under each node on it.  Separators are never changed
+// in place: a node's range only changes when it splits, borrows or
+// merges, all of which rewrite it, or when it is freed.  So a node on the
+// finger still has the range it had, and the same block number, for as
+// long as its version is the one the finger took.
+//
 
-      }
-      return rc;
+void BTreeIndex::SetFingerSearch(const bool on)
+{
+  fingersearch=on;
+  if (on) {
+    if (blockversions.empty()) {
+      blockversions.assign(buffercache->GetNumBlocks(),0);
+    }
+  } else if (hashmask==0) {
+    blockversions.clear();
+  }
+  fingerepoch=++fingerepochs;
+}
 
+BTreeFinger & BTreeIndex::ThreadFinger() const
+{
+  static thread_local std::map<SIZE_T,BTreeFinger> fingers;
+  std::map<SIZE_T,BTreeFinger>::iterator f=fingers.find(fingerepoch);
 
+  if (f==fingers.end()) {
+    // fingers for indexes since detached are never found again
+    if (fingers.size()>=BTREE_MAX_FINGERS) {
+      fingers.clear();
     }
-    
-    // If we reach this point, then the key must already exist in the tree. There is a conflict.
-    // Instead, Update should be used to solve this issue and change the key's value instead of
-    // Inserting a new key/value pair
-    return ERROR_CONFLICT;
+    f=fingers.insert(std::make_pair(fingerepoch,BTreeFinger())).first;
+  }
+  return f->second;
 }
 
-// Checks if a node needs to be split (i.e. it is full)
-// Returns True if yes, False if no
-bool BTreeIndex::NeedToSplit(const SIZE_T node)
+ERROR_T BTreeIndex::FingerLeaf(const KEY_VIEW_T &key,
+			       SIZE_T &leaf,
+			       BTreeNode &b,
+			       const bool filtered) const
 {
-  // WRITE ME
-  BTreeNode b;
-  b.Unserialize(buffercache, node);
+  BTreeFinger &f=ThreadFinger();
+  SIZE_T keysize=superblock.info.keysize;
+  SIZE_T level=f.nodes.size();
+  SIZE_T offset;
+  SIZE_T ptr;
+  ERROR_T rc;
 
-  // If a node is completely full (i.e. the number keys = the number of slots in the node), return true
-  switch(b.info.nodetype) {
+  // climb to the lowest node still covering key; the root covers all
+  while (level>1 &&
+	 (blockversions[f.nodes[level-1]]!=f.versions[level-1] ||
+	  (f.haslo[level-1] && CompareKeys(key.data,&f.lo[(level-1)*keysize])<=0) ||
+	  (f.hashi[level-1] && CompareKeys(key.data,&f.hi[(level-1)*keysize])>0))) {
+    level--;
+  }
+  if (level>1) {
+    fingerhits.fetch_add(1,std::memory_order_relaxed);
+  } else {
+    level=1;
+    f.nodes.assign(1,superblock.info.rootnode);
+    f.versions.assign(1,blockversions[superblock.info.rootnode]);
+    f.lo.assign(keysize,0);
+    f.hi.assign(keysize,0);
+    f.haslo.assign(1,false);
+    f.hashi.assign(1,false);
+  }
+  f.nodes.resize(level);
+  f.versions.resize(level);
+  f.lo.resize(level*keysize);
+  f.hi.resize(level*keysize);
+  f.haslo.resize(level);
+  f.hashi.resize(level);
+
+  leaf=f.nodes[level-1];
+  while (1) {
+    BTreeTraceSpan span(this,BTREE_TRACE_DESCEND,leaf);
+
+    rc=ReadNode(leaf,b);
+    if (rc) { return rc; }
+    switch (b.info.nodetype) {
     case BTREE_ROOT_NODE:
     case BTREE_INTERIOR_NODE:
-      return (b.info.GetNumSlotsAsInterior() == b.info.numkeys);
+      if (b.info.numkeys==0) {
+	return ERROR_NONEXISTENT;
+      }
+      offset=LowerBound(b,key.data);
+      rc=b.GetPtr(offset,ptr);
+      if (rc) { return rc; }
+      // the child's range is between the separators either side of it,
+      // or the parent's own bound at either end
+      f.nodes.push_back(ptr);
+      f.versions.push_back(blockversions[ptr]);
+      f.haslo.push_back(offset>0 || f.haslo.back());
+      f.hashi.push_back(offset<b.info.numkeys || f.hashi.back());
+      f.lo.resize(level*keysize+keysize);
+      f.hi.resize(level*keysize+keysize);
+      memcpy(&f.lo[level*keysize],offset>0 ? KeyAt(b,offset-1) : &f.lo[(level-1)*keysize],keysize);
+      memcpy(&f.hi[level*keysize],offset<b.info.numkeys ? KeyAt(b,offset) : &f.hi[(level-1)*keysize],keysize);
+      level++;
+      leaf=ptr;
+      if (filtered && LeafFilterExcludes(leaf,key.data)) {
+	return ERROR_NONEXISTENT;
+      }
+      break;
     case BTREE_LEAF_NODE:
-      return (b.info.GetNumSlotsAsLeaf() == b.info.numkeys);
+      if (filterbudget>0) {
+	BuildLeafFilter(leaf,b,false);
+      }
+      return ERROR_NOERROR;
+    default:
+      return ERROR_INSANE;
+    }
   }
-  // else return false
-  return false;
+  return ERROR_INSANE;
 }
 
-// Splits a node and returns the node number for the new (second) node, 
-// as well as the key to be promoted (moved up a level) by the split
-ERROR_T BTreeIndex::SplitNode(const SIZE_T node, SIZE_T &secondNode, KEY_T &promotedKey)
-  {
-    // WRITE ME
-    BTreeNode left; // "Old"/first node
-    SIZE_T leftKeys;
-    SIZE_T rightKeys;
-    left.Unserialize(buffercache, node);
-    BTreeNode right = left; // "New"/second node
-    ERROR_T error;
+ERROR_T BTreeIndex::InsertAtFinger(const KEY_VIEW_T &key, const VALUE_VIEW_T &value, bool &done)
+{
+  ScratchNode scratch;
+  BTreeNode &b=*scratch;
+  SIZE_T leaf;
+  SIZE_T offset;
+  ERROR_T rc;
 
-    // Allocate and Serialize secondNode
-    // If they do not evaluate to 0 (ERROR_NOERROR), return error
-    if ((error = AllocateNode(secondNode)))
-    {
-      return error;
-    }
+  done=false;
+  rc=FingerLeaf(key,leaf,b,false);
+  if (rc) { return rc; }
+  // SplitUpward does not even out the two leaves under a new root first,
+  // as the descent from the root does
+  if (ThreadFinger().nodes.size()<=2) {
+    return ERROR_NOERROR;
+  }
+  done=true;
+  if (FindKey(b,key.data,offset)) {
+    return ERROR_CONFLICT;
+  }
+  rc=AddKeyVal(leaf,key,value,0);
+  if (rc) { return rc; }
+  FingerWrote(leaf);
+  if (NeedToSplit(leaf)) {
+    return SplitUpward(key);
+  }
+  return ERROR_NOERROR;
+}
 
-    if ((error = right.Serialize(buffercache,secondNode)))
-    {
-      return error;
-    }
+void BTreeIndex::FingerWrote(const SIZE_T leaf) const
+{
+  if (!fingersearch) {
+    return;
+  }
+  BTreeFinger &f=ThreadFinger();
+  if (!f.nodes.empty() && f.nodes.back()==leaf) {
+    f.versions.back()=blockversions[leaf];
+  }
+}
 
-    // If the node is a leaf node
-    if (left.info.nodetype == BTREE_LEAF_NODE)
-    {
-      // ceiling of (n+1) / 2 [since leaf nodes have extra pointer at beginning]
-      // n is the number of keys in the original node (left.info.numkeys)
-      leftKeys = (left.info.numkeys + 2) / 2;
-      rightKeys = left.info.numkeys - leftKeys; // remaining keys
 
-      // The key to be promoted by the split
-      left.GetKey(leftKeys - 1, promotedKey);
+//
+// Snapshots
+//
 
-      // Find the location of the first key in the old (first) node to be moved
-      // into the new (second) node
-      char *oldLoc = left.ResolveKeyVal(leftKeys);
-      char *newLoc = right.ResolveKeyVal(0); // first slot in new/second node
-    
-      // copy the keys from the old location into the new location
-      // The amount will be the number of right keys times the summed size of a key and a value
-      memcpy(newLoc, oldLoc, rightKeys * (left.info.keysize + left.info.valuesize));
+ERROR_T BTreeIndex::PreserveForSnapshots(const SIZE_T node)
+{
+  ERROR_T rc;
+  BTreeNode b;
+  SIZE_T copy;
+  std::vector<BTreeSnapshot *> need;
+  std::map<SIZE_T,SIZE_T>::const_iterator born=allocversion.find(node);
+
+  if (copyrefs.count(node)) {
+    return ERROR_NOERROR;
+  }
+  for (std::map<SIZE_T,BTreeSnapshot>::iterator i=snapshots.begin();i!=snapshots.end();++i) {
+    if (born!=allocversion.end() && born->second>=i->second.version) {
+      continue;
+    }
+    if (i->second.preserved.count(node)==0) {
+      need.push_back(&i->second);
     }
+  }
+  if (need.empty()) {
+    return ERROR_NOERROR;
+  }
 
-    // If the node is an interior or root node
-    else 
-    {
-      // floor of n/2 
-      leftKeys = (left.info.numkeys / 2);
-      rightKeys = left.info.numkeys - leftKeys - 1; // promote one key
+  // One copy serves every snapshot taken since the block last changed
+  rc=ReadNode(node,b);
+  if (rc) { return rc; }
+  rc=AllocateNodeLocked(copy);
+  if (rc) { return rc; }
+  rc=StoreNode(copy,b);
+  if (rc) { return rc; }
+  // the copy was just allocated, so no later snapshot will copy it again
+  copyrefs[copy]=need.size();
+  for (SIZE_T i=0;i<need.size();i++) {
+    need[i]->preserved[node]=copy;
+  }
+  return ERROR_NOERROR;
+}
 
-      // The key to be promoted by the split
-      left.GetKey(leftKeys, promotedKey);
-      
-      // Find the location of the first key in the old (first) node to be moved
-      // into the new (second) node
-      char *oldLoc = left.ResolvePtr(leftKeys + 1);
-      char *newLoc = right.ResolvePtr(0); // first slot in new/second node
-      
-      // copy the keys from the old location into the new location
-      // The amount will be the number of right keys times the summed size of a key
-      // plus two times the size of SIZE_T on the machine
-      memcpy(newLoc, oldLoc, rightKeys * (left.info.keysize + sizeof(SIZE_T) + sizeof(SIZE_T)));
-    }
 
-    // Update the number of keys in the old and new nodes
-    left.info.numkeys = leftKeys;
-    right.info.numkeys = rightKeys;
+ERROR_T BTreeIndex::CreateSnapshot(SIZE_T &snapshot)
+{
+  // snapshots only read leaves, so they have to be up to date
+  ERROR_T rc=Flush();
+  if (rc) { return rc; }
 
-    if ((error = left.Serialize(buffercache,node)))
-    {
-      return error;
+  std::lock_guard<std::mutex> g(snaplock);
+
+  version++;
+  snapshot=version;
+  snapshots[snapshot].version=version;
+  snapshots[snapshot].root=superblock.info.rootnode;
+  numsnapshots=snapshots.size();
+
+  WriteSuperblockData(superblock);
+  return StoreNode(superblock_index,superblock);
+}
+
+
+ERROR_T BTreeIndex::ReleaseSnapshot(const SIZE_T snapshot)
+{
+  std::lock_guard<std::mutex> g(snaplock);
+  std::map<SIZE_T,BTreeSnapshot>::iterator s=snapshots.find(snapshot);
+
+  if (s==snapshots.end()) {
+    return ERROR_NONEXISTENT;
+  }
+  for (std::map<SIZE_T,SIZE_T>::const_iterator i=s->second.preserved.begin();
+       i!=s->second.preserved.end();
+       ++i) {
+    if (--copyrefs[i->second]==0) {
+      copyrefs.erase(i->second);
+      reclaim.push_back(i->second);
     }
+  }
+  snapshots.erase(s);
+  numsnapshots=snapshots.size();
+  if (snapshots.empty()) {
+    allocversion.clear();
+  }
+  return ERROR_NOERROR;
+}
 
-    // Write the new node into the disk
-    return right.Serialize(buffercache,secondNode);
+
+// Counts a LookupSnapshot or ScanSnapshot as under way while it lasts
+struct SnapshotReader {
+  std::atomic<SIZE_T> &readers;
+
+  SnapshotReader(std::atomic<SIZE_T> &r) : readers(r) { readers++; }
+  ~SnapshotReader() { readers--; }
+};
+
+ERROR_T BTreeIndex::ReadSnapshotNode(const SIZE_T snapshot, const SIZE_T node, BTreeNode &b) const
+{
+  std::lock_guard<std::mutex> g(snaplock);
+  std::map<SIZE_T,BTreeSnapshot>::const_iterator s=snapshots.find(snapshot);
+
+  if (s==snapshots.end()) {
+    return ERROR_NONEXISTENT;
   }
+  std::map<SIZE_T,SIZE_T>::const_iterator copy=s->second.preserved.find(node);
+  return ReadNode(copy==s->second.preserved.end() ? node : copy->second,b);
+}
 
-  
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+
+ERROR_T BTreeIndex::SnapshotRoot(const SIZE_T snapshot, SIZE_T &root) const
 {
-  // WRITE ME
-  VALUE_T updateValue = value;
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, updateValue);
+  std::lock_guard<std::mutex> g(snaplock);
+  std::map<SIZE_T,BTreeSnapshot>::const_iterator s=snapshots.find(snapshot);
+
+  if (s==snapshots.end()) {
+    return ERROR_NONEXISTENT;
+  }
+  root=s->second.root;
+  return ERROR_NOERROR;
 }
 
-  
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+
+ERROR_T BTreeIndex::LookupSnapshot(const SIZE_T snapshot, const KEY_T &key, VALUE_T &value) const
 {
+  SnapshotReader reader(snapshotreaders);
   BTreeNode b;
   ERROR_T rc;
+  SIZE_T node;
   SIZE_T offset;
-  KEY_T testkey1;
-  SIZE_T ptr;
-  VALUE_T value;
-  KEY_T promotedKey;
-
-  // check if the key is in the tree
-  rc = Lookup(key, value);
-  if(rc) { return rc;}
-
-  // start at the root node
-  rc = b.Unserialize(buffercache, b.info.rootnode);
-  if(rc) { return rc;}
 
-  for (offset=0;offset<b.info.numkeys;offset++) { 
-    rc = b.GetKey(offset, testkey1);
-    if (rc) {  return rc; }
-    if(testkey1 == key) // will need to update from the child
-    {
-      rc = b.GetPtr(offset, ptr);
-      if(rc) { return rc;}
-      rc = DeleteRecurse(key, ptr, promotedKey);
-      if(rc) { return rc;}
-      rc = b.SetKey(offset, promotedKey);
-      if(rc) { return rc;}
-      rc = b.SetPtr(offset, ptr);
-      if(rc) { return rc;}
-      return ERROR_NOERROR;
-    }
-    if(key < testkey1)  // just delete from descendants
-    {
-      rc = b.GetPtr(offset, ptr);
-      if(rc) { return rc;}
-      return DeleteRecurse(key, ptr, promotedKey);
+  rc=SnapshotRoot(snapshot,node);
+  if (rc) { return rc; }
+  while (1) {
+    rc=ReadSnapshotNode(snapshot,node,b);
+    if (rc) { return rc; }
+    // from the node, which is our own copy, not the superblock, which
+    // an update may be rewriting
+    if (key.length!=b.info.keysize) {
+      return ERROR_SIZE;
     }
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) {
+	return ERROR_NONEXISTENT;
+      }
+      rc=b.GetPtr(LowerBound(b,key.data),node);
+      if (rc) { return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      if (!FindKey(b,key.data,offset)) {
+	return ERROR_NONEXISTENT;
+      }
+      return GetLeafVal(b,offset,value);
+    default:
+      return ERROR_INSANE;
     }
-    
-  return ERROR_NONEXISTENT;
+  }
 }
 
-ERROR_T BTreeIndex::DeleteRecurse(const KEY_T &key, const SIZE_T node, KEY_T &promotedKey)
+
+ERROR_T BTreeIndex::ScanSnapshotInternal(const SIZE_T snapshot,
+					 const SIZE_T node,
+					 BTreeScanVisitor &visitor) const
 {
   BTreeNode b;
   ERROR_T rc;
   SIZE_T offset;
-  KEY_T testkey1;
   SIZE_T ptr;
 
-  rc = b.Unserialize(buffercache, node);
-  if(rc) { return rc;}
+  rc=ReadSnapshotNode(snapshot,node,b);
+  if (rc) { return rc; }
 
-  switch(b.info.nodetype){
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-      for (offset=0;offset<b.info.numkeys;offset++) { 
-        rc = b.GetKey(offset, testkey1);
-        if (rc) {  return rc; }
-        if(testkey1 == key) // will need to update from the child node
-        {
-          rc = b.GetPtr(offset, ptr);
-          if(rc) { return rc;}
-          rc = DeleteRecurse(key, ptr, promotedKey);
-          if(rc) { return rc;}
-          rc = b.SetKey(offset, promotedKey);
-          if(rc) { return rc;}
-          rc = b.SetPtr(offset, ptr);
-          if(rc) { return rc;}
-          return ERROR_NOERROR;
-        }
-        
-        if(key < testkey1)  // just delete from descendants
-        {
-          rc = b.GetPtr(offset, ptr);
-          if(rc) { return rc;}
-          return DeleteRecurse(key, ptr, promotedKey);
-        }
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys>0) {
+      for (offset=0;offset<=b.info.numkeys;offset++) {
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	rc=ScanSnapshotInternal(snapshot,ptr,visitor);
+	if (rc) { return rc; }
       }
-      // if we got here, we need to go to the next pointer, if it exists
-      if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return DeleteRecurse(key,ptr, promotedKey);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
     }
-      break;
-    case BTREE_LEAF_NODE:
-      for (offset=0;offset<b.info.numkeys;offset++) { 
-        rc = b.GetKey(offset, testkey1);
-        if (rc) {  return rc; }
-        if(testkey1 == key) 
-        {
-          if(offset == b.info.numkeys - 1)
-          {
-            rc = b.GetKey(offset - 1, promotedKey);
-            if(rc) { return rc;} 
-            return DeleteAndShift(node, key);
-          }
-          return DeleteAndShift(node, key);          
-        }
-      }
-      return ERROR_NONEXISTENT;
-      break;
-    default:
-      return ERROR_INSANE;
-      break;
+    return ERROR_NOERROR;
+  case BTREE_LEAF_NODE:
+    for (offset=0;offset<b.info.numkeys;offset++) {
+      rc=visitor.Visit(KEY_VIEW_T(KeyAt(b,offset),b.info.keysize),
+		       VALUE_VIEW_T(ValAt(b,offset),b.info.valuesize));
+      if (rc) { return rc; }
     }
+    return ERROR_NOERROR;
+  default:
     return ERROR_INSANE;
+  }
+}
+
+
+ERROR_T BTreeIndex::ScanSnapshot(const SIZE_T snapshot, BTreeScanVisitor &visitor) const
+{
+  SnapshotReader reader(snapshotreaders);
+  ERROR_T rc;
+  SIZE_T root;
+
+  rc=SnapshotRoot(snapshot,root);
+  if (rc) { return rc; }
+  return ScanSnapshotInternal(snapshot,root,visitor);
 }
 
-ERROR_T BTreeIndex::DeleteAndShift(const SIZE_T node, const KEY_T &key)
+
+ERROR_T BTreeIndex::ScanRangeInternal(const SIZE_T node,
+				      const KEY_VIEW_T &lo,
+				      const KEY_VIEW_T &hi,
+				      BTreeScanVisitor &visitor) const
 {
   BTreeNode b;
   ERROR_T rc;
   SIZE_T offset;
-  KEY_T testkey1;
+  SIZE_T last;
+  SIZE_T ptr;
 
-  rc = b.Unserialize(buffercache, node);
-  if(rc) { return rc;}
-  
-  switch (b.info.nodetype) { 
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-      for (offset=0;offset<b.info.numkeys;offset++) { 
-        rc = b.GetKey(offset, testkey1);
-        if (rc) {  return rc; }
-        if(testkey1 == key) 
-        {
-            char *oldLoc = b.ResolvePtr(b.info.numkeys);
-            char *newLoc = b.ResolvePtr(offset);
-            memcpy(newLoc, oldLoc, (b.info.GetNumSlotsAsInterior() - offset) * (b.info.keysize + b.info.valuesize));
-            return ERROR_NOERROR;
-          }
+  rc=ReadNode(node,b);
+  if (rc) { return rc; }
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys==0) {
+      return ERROR_NOERROR;
+    }
+    if (NumMessageSlots(b)>0 && NumMessages(b)>0) {
+      // the leaves below are not the whole story until this is flushed
+      return ERROR_BADCONFIG;
+    }
+    // child i holds the keys above separator i-1 up to separator i, so
+    // the children that can hold [lo,hi) run from the first separator
+    // >= lo to the first separator >= hi
+    offset=lo.length ? LowerBound(b,lo.data) : 0;
+    last=hi.length ? LowerBound(b,hi.data) : b.info.numkeys;
+    for (;offset<=last;offset++) {
+      rc=b.GetPtr(offset,ptr);
+      if (rc) { return rc; }
+      rc=ScanRangeInternal(ptr,lo,hi,visitor);
+      if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+  case BTREE_LEAF_NODE:
+    offset=lo.length ? LowerBound(b,lo.data) : 0;
+    for (;offset<b.info.numkeys;offset++) {
+      if (hi.length && CompareKeys(KeyAt(b,offset),hi.data)>=0) {
+	break;
       }
-      return ERROR_NONEXISTENT;
-      break;
-    case BTREE_LEAF_NODE:
-      for (offset=0;offset<b.info.numkeys;offset++) { 
-        rc = b.GetKey(offset, testkey1);
-        if (rc) {  return rc; }
-        if(testkey1 == key) 
-        {
-            char *oldLoc = b.ResolveVal(offset++);
-            char *newLoc = b.ResolveVal(offset);
-            memcpy(newLoc, oldLoc, (b.info.GetNumSlotsAsLeaf() - offset) * (b.info.keysize + b.info.valuesize));
-            return ERROR_NOERROR;
-          }
-        }
-      return ERROR_NONEXISTENT;
-      break;
-    default:
-      return ERROR_INSANE;
-      break;
+      rc=visitor.Visit(KEY_VIEW_T(KeyAt(b,offset),b.info.keysize),
+		       VALUE_VIEW_T(ValAt(b,offset),b.info.valuesize));
+      if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+  default:
+    return ERROR_INSANE;
   }
+}
 
-  return ERROR_INSANE;
 
+ERROR_T BTreeIndex::ScanRange(const KEY_VIEW_T &lo, const KEY_VIEW_T &hi, BTreeScanVisitor &visitor) const
+{
+  if ((lo.length && lo.length!=superblock.info.keysize) ||
+      (hi.length && hi.length!=superblock.info.keysize)) {
+    return ERROR_SIZE;
+  }
+  return ScanRangeInternal(superblock.info.rootnode,lo,hi,visitor);
 }
 
 
+//
+// Parallel range scans
+//
 
-// Handles the recursive traversal of the tree, and placing the key/value pair in the correct node
-ERROR_T BTreeIndex::SearchInternal2(SIZE_T node,
-             const KEY_T &key,
-             const VALUE_T &value,
-             SIZE_T parentNode)  
+// A scan thread's read-ahead: the children it has read, one window per
+// level of the tree.  A deque, so a deeper level can be added without
+// moving the windows above, which the thread is part way through.
+struct ScanAhead {
+  std::deque<std::vector<BTreeNode> > windows;
+  std::vector<SIZE_T>                 ptrs;
+};
+
+// Holds the pairs of one sub-range, packed key then value, until those
+// before it have been handed over
+struct ScanBuffer : public BTreeScanVisitor {
+  std::vector<char> pairs;
+  SIZE_T            count;
+
+  ScanBuffer() : count(0) {}
+
+  ERROR_T Visit(const KEY_VIEW_T &key, const VALUE_VIEW_T &value)
+  {
+    pairs.insert(pairs.end(),key.data,key.data+key.length);
+    pairs.insert(pairs.end(),value.data,value.data+value.length);
+    count++;
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T Replay(const SIZE_T keysize, const SIZE_T valuesize, BTreeScanVisitor &visitor) const
+  {
+    ERROR_T rc;
+    for (SIZE_T i=0;i<count;i++) {
+      const char *p=&pairs[i*(keysize+valuesize)];
+      rc=visitor.Visit(KEY_VIEW_T(p,keysize),VALUE_VIEW_T(p+keysize,valuesize));
+      if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+  }
+};
+
+// Passes pairs on to the caller's visitor until some thread has stopped
+// the scan
+struct ScanForwarder : public BTreeScanVisitor {
+  BTreeScanVisitor        &visitor;
+  const std::atomic<bool> &stop;
+  bool                     stopped;
+
+  ScanForwarder(BTreeScanVisitor &v, const std::atomic<bool> &s) :
+    visitor(v), stop(s), stopped(false) {}
+
+  ERROR_T Visit(const KEY_VIEW_T &key, const VALUE_VIEW_T &value)
+  {
+    if (stop) {
+      stopped=true;
+      return ERROR_INSANE;
+    }
+    return visitor.Visit(key,value);
+  }
+};
+
+
+ERROR_T BTreeIndex::ReadNodes(const SIZE_T *nodes,
+			      const SIZE_T n,
+			      std::vector<BTreeNode> &out) const
 {
-  BTreeNode b; // the current node
-  SIZE_T secondNode; 
+  SIZE_T order[BTREE_SCAN_READAHEAD];
+  unsigned stored;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
-  KEY_T promotedKey;
 
-  rc= b.Unserialize(buffercache,node);
+  if (out.size()<n) {
+    out.resize(n);
+  }
+  if ((format&BTREE_FORMAT_COMPRESS) || n>BTREE_SCAN_READAHEAD) {
+    // leaves come through the leaf cache, one at a time
+    for (SIZE_T i=0;i<n;i++) {
+      rc=ReadNode(nodes[i],out[i]);
+      if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+  }
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
+  // In block order, so what the cache does not have comes off the disk
+  // in one sweep
+  for (SIZE_T i=0;i<n;i++) {
+    order[i]=i;
+  }
+  std::sort(order,order+n,[&](const SIZE_T a, const SIZE_T b) { return nodes[a]<nodes[b]; });
+  {
+    std::lock_guard<std::mutex> g(*cachelock);
+    for (SIZE_T i=0;i<n;i++) {
+      BTreeTraceSpan span(this,BTREE_TRACE_READ,nodes[order[i]]);
+      SIZE_T diskreads=span.On() ? buffercache->GetNumDiskReads() : 0;
+      rc=ReadInto(buffercache,nodes[order[i]],out[order[i]]);
+      if (rc) { return rc; }
+      if (span.On()) {
+	span.SetMiss(buffercache->GetNumDiskReads()!=diskreads);
+      }
+    }
+  }
+  if (format&BTREE_FORMAT_CHECKSUM) {
+    for (SIZE_T i=0;i<n;i++) {
+      if (!IsTreeNode(out[i])) {
+	continue;
+      }
+      memcpy(&stored,out[i].data+out[i].info.GetNumDataBytes()-sizeof(unsigned),sizeof(unsigned));
+      if (stored!=NodeChecksum(out[i])) {
+	return ERROR_INSANE;
+      }
+    }
   }
+  return ERROR_NOERROR;
+}
 
-  switch (b.info.nodetype) { 
+
+ERROR_T BTreeIndex::ScanRangeAhead(const BTreeNode &b,
+				   const KEY_VIEW_T &lo,
+				   const KEY_VIEW_T &hi,
+				   BTreeScanVisitor &visitor,
+				   ScanAhead &ahead,
+				   const SIZE_T depth) const
+{
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T last;
+  SIZE_T n;
+
+  switch (b.info.nodetype) {
   case BTREE_ROOT_NODE:
   case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key == testkey) {
-  // OK, so we now have the first key that's larger
-  // so we need to recurse on the ptr immediately previous to 
-  // this one, if it exists
-      rc=b.GetPtr(offset,ptr);
+    if (b.info.numkeys==0) {
+      return ERROR_NOERROR;
+    }
+    if (NumMessageSlots(b)>0 && NumMessages(b)>0) {
+      return ERROR_BADCONFIG;
+    }
+    if (ahead.windows.size()<=depth) {
+      ahead.windows.resize(depth+1);
+    }
+    // the same children as ScanRangeInternal, a window at a time
+    offset=lo.length ? LowerBound(b,lo.data) : 0;
+    last=hi.length ? LowerBound(b,hi.data) : b.info.numkeys;
+    for (;offset<=last;offset+=n) {
+      n=std::min<SIZE_T>(BTREE_SCAN_READAHEAD,last-offset+1);
+      ahead.ptrs.resize(n);
+      for (SIZE_T i=0;i<n;i++) {
+	rc=b.GetPtr(offset+i,ahead.ptrs[i]);
+	if (rc) { return rc; }
+      }
+      rc=ReadNodes(&ahead.ptrs[0],n,ahead.windows[depth]);
       if (rc) { return rc; }
-      // check if a key needs to be promoted from leaf
-      rc = SearchInternal2(ptr, key, value, node);
-      
-      if(rc){return rc;}
-      // if there is a key to be promoted, split the node if necessary and insert the promoted key
-      
-        // check if we need to split the node
-        if(NeedToSplit(ptr))
-        {
-          rc = SplitNode(ptr, secondNode, promotedKey);
-          if(rc){return rc;}
-          // Add the key/value (pointer) pair into an interior node
-          return AddKeyVal(node, promotedKey, VALUE_T(), secondNode);
-
-          
-          
-        }
-        else // no need to split the node, just insert
-        {
-          return rc;
-        }
-        
+      for (SIZE_T i=0;i<n;i++) {
+	rc=ScanRangeAhead(ahead.windows[depth][i],lo,hi,visitor,ahead,depth+1);
+	if (rc) { return rc; }
       }
     }
-  
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
+    return ERROR_NOERROR;
+  case BTREE_LEAF_NODE:
+    offset=lo.length ? LowerBound(b,lo.data) : 0;
+    for (;offset<b.info.numkeys;offset++) {
+      if (hi.length && CompareKeys(KeyAt(b,offset),hi.data)>=0) {
+	break;
+      }
+      rc=visitor.Visit(KEY_VIEW_T(KeyAt(b,offset),b.info.keysize),
+		       VALUE_VIEW_T(ValAt(b,offset),b.info.valuesize));
       if (rc) { return rc; }
-      rc = SearchInternal2(ptr,key,value, node);
-      if (rc) {return rc;}
-      if (NeedToSplit(ptr)){
-        rc = SplitNode(ptr, secondNode, promotedKey);
-        if (rc){return rc;}
-        // Add the key/value (pointer) pair into an interior node
-        return AddKeyVal(node, promotedKey, VALUE_T(), secondNode);
-      } 
-      else 
-        {
-          return rc;
-        }
-    } 
-    else {
-      // there are no keys on the node, so this is the first insert. Need to make a leaf node too
-     return ERROR_NONEXISTENT;
     }
-    break;
-  case BTREE_LEAF_NODE:
-    // Add a key/value pair into a leaf node
-    return AddKeyVal(node,key,value,0);
-    break;
+    return ERROR_NOERROR;
   default:
-    // We can't be looking at anything other than a root, internal, or leaf
     return ERROR_INSANE;
-    break;
-  }  
-
-  return ERROR_INSANE;
+  }
 }
 
-// This adds the new key/value pair to a node
-ERROR_T BTreeIndex::AddKeyVal(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newNode)
+
+ERROR_T BTreeIndex::ScanCuts(const KEY_VIEW_T &lo,
+			     const KEY_VIEW_T &hi,
+			     const SIZE_T parts,
+			     std::vector<char> &cuts) const
 {
+  SIZE_T keysize=superblock.info.keysize;
+  std::vector<SIZE_T> level(1,superblock.info.rootnode);
+  std::vector<SIZE_T> next;
+  std::vector<char> seps;
   BTreeNode b;
-  b.Unserialize(buffercache, node);
-  KEY_T testkey; // This will keep track of the key our current position in the loop
-  SIZE_T numkeys = b.info.numkeys; // the number of keys in the node before we add the new key
-  SIZE_T numToMove; // the number of keys we will need to move over to place our key
-  SIZE_T offset; // This is our current position in the block
-  SIZE_T pairSize; // The size of a key/value pair
+  SIZE_T offset;
+  SIZE_T last;
+  SIZE_T ptr;
   ERROR_T rc;
 
-  // Check that we have a feasible node type
-  switch(b.info.nodetype){
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-      pairSize = b.info.keysize + sizeof(SIZE_T);
-      break;
-    case BTREE_LEAF_NODE:
-      pairSize = b.info.keysize + b.info.valuesize;
-      break;
-    default: // We can't be looking at anything other than a root, internal, or leaf
-      return ERROR_INSANE;
+  cuts.clear();
+  // Level by level, as Preload, keeping only the nodes under [lo,hi).
+  // Children of one node are between half full and full, so cutting at
+  // evenly spaced separators of one level evens out the sub-ranges.
+  while (!level.empty() && cuts.size()/keysize+1<parts) {
+    next.clear();
+    seps.clear();
+    for (SIZE_T i=0;i<level.size();i++) {
+      rc=ReadNode(level[i],b);
+      if (rc) { return rc; }
+      if (b.info.nodetype==BTREE_LEAF_NODE || b.info.numkeys==0) {
+	// no level below the last one has separators
+	next.clear();
+	seps.clear();
+	break;
+      }
+      if (NumMessageSlots(b)>0 && NumMessages(b)>0) {
+	return ERROR_BADCONFIG;
+      }
+      offset=lo.length ? LowerBound(b,lo.data) : 0;
+      last=hi.length ? LowerBound(b,hi.data) : b.info.numkeys;
+      for (;offset<=last;offset++) {
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	next.push_back(ptr);
+	// those below hi; one equal to lo cuts nothing off
+	if (offset<last && (!lo.length || CompareKeys(b.ResolveKey(offset),lo.data)>0)) {
+	  seps.insert(seps.end(),b.ResolveKey(offset),b.ResolveKey(offset)+keysize);
+	}
+      }
+    }
+    if (seps.size()>cuts.size()) {
+      cuts.swap(seps);
+    }
+    level.swap(next);
+  }
+
+  SIZE_T count=cuts.size()/keysize;
+  if (count+1>parts) {
+    // parts-1 of them, spread evenly over the count+1 children
+    for (SIZE_T j=1;j<parts;j++) {
+      SIZE_T i=j*(count+1)/parts-1;
+      memmove(&cuts[(j-1)*keysize],&cuts[i*keysize],keysize);
+    }
+    cuts.resize((parts-1)*keysize);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ScanRangeParallel(const KEY_VIEW_T &lo,
+				      const KEY_VIEW_T &hi,
+				      BTreeScanVisitor &visitor,
+				      const bool ordered,
+				      const SIZE_T threads) const
+{
+  SIZE_T keysize=superblock.info.keysize;
+  SIZE_T numworkers=threads;
+  std::vector<char> cuts;
+  ERROR_T rc;
+
+  if ((lo.length && lo.length!=keysize) || (hi.length && hi.length!=keysize)) {
+    return ERROR_SIZE;
+  }
+  if (numworkers==0) {
+    numworkers=std::thread::hardware_concurrency();
+  }
+  if (numworkers==0) { numworkers=1; }
+  rc=ScanCuts(lo,hi,numworkers*BTREE_SCAN_PARTS,cuts);
+  if (rc) { return rc; }
+  SIZE_T numparts=cuts.size()/keysize+1;
+  if (numworkers>numparts) {
+    numworkers=numparts;
+  }
+
+  // Sub-range p runs from cut p-1 up to cut p.  Threads take them in
+  // order; when ordered, at most a window of them ahead of the one
+  // being handed over, which bounds what is held in memory.
+  std::mutex lock;
+  std::condition_variable cond;
+  std::atomic<bool> stop(false);
+  SIZE_T nextpart=0;
+  SIZE_T delivered=0;
+  SIZE_T window=ordered ? 2*numworkers : numparts;
+  std::vector<ScanBuffer> bufs(ordered ? numparts : 0);
+  std::vector<char> done(numparts,0);
+  std::vector<ERROR_T> results(numparts,ERROR_NOERROR);
+  ERROR_T first=ERROR_NOERROR;
+  std::vector<std::thread> workers;
+
+  for (SIZE_T w=0;w<numworkers;w++) {
+    workers.push_back(std::thread([&]() {
+      ScanAhead ahead;
+      BTreeNode root;
+      SIZE_T p;
+      ERROR_T r;
+
+      while (1) {
+	{
+	  std::unique_lock<std::mutex> l(lock);
+	  cond.wait(l,[&]() { return stop || nextpart>=numparts || nextpart<delivered+window; });
+	  if (stop || nextpart>=numparts) {
+	    return;
+	  }
+	  p=nextpart++;
+	}
+	KEY_VIEW_T plo=p>0 ? KEY_VIEW_T(&cuts[(p-1)*keysize],keysize) : lo;
+	KEY_VIEW_T phi=p+1<numparts ? KEY_VIEW_T(&cuts[p*keysize],keysize) : hi;
+	ScanForwarder forward(visitor,stop);
+	r=ReadNode(superblock.info.rootnode,root);
+	if (!r) {
+	  if (ordered) {
+	    r=ScanRangeAhead(root,plo,phi,bufs[p],ahead,0);
+	  } else {
+	    r=ScanRangeAhead(root,plo,phi,forward,ahead,0);
+	  }
+	}
+	{
+	  std::lock_guard<std::mutex> l(lock);
+	  results[p]=r;
+	  done[p]=1;
+	  if (r && !ordered && !forward.stopped) {
+	    // the first real error stops the other threads
+	    if (!first) {
+	      first=r;
+	    }
+	    stop=true;
+	  }
+	}
+	cond.notify_all();
+      }
+    }));
   }
 
-  // increase the number of keys in b by one, since we are adding a key
-  b.info.numkeys++;
-
-  // if the node already has keys in it
-  if(numkeys > 0)
-  {
-    for (offset=0, numToMove = numkeys; offset < numkeys; offset++, numToMove--)
-    {
-      rc = b.GetKey(offset,testkey);
-      if(rc)
+  if (ordered) {
+    for (SIZE_T p=0;p<numparts && !first;p++) {
       {
-        return rc;
+	std::unique_lock<std::mutex> l(lock);
+	cond.wait(l,[&]() { return done[p]!=0; });
+	first=results[p];
       }
-      // If the key we want to add is less than the current key (testkey),
-      // move the keys > key up by a position to make room for key. 
-      // Place key into the current position
-      if(key < testkey)
-      {
-        void *oldLoc = b.ResolveKey(offset);
-        void *newLoc = b.ResolveKey(offset+1);
-        memmove(newLoc,oldLoc,numToMove*pairSize);
-        // if we have problems setting the key, return an error
-        rc = b.SetKey(offset, key);
-        if(rc){return rc;}
-        // Do a few checks based on whether we are dealing with a root or interior node
-        if(b.info.nodetype == BTREE_LEAF_NODE)
-        {
-          rc = b.SetVal(offset,value);
-          if(rc){return rc;}
-        }
-        else // interior node
-        {
-          rc = b.SetPtr(offset+1,newNode);
-          if(rc){return rc;}
-        }
-        break;
+      if (!first) {
+	first=bufs[p].Replay(keysize,superblock.info.valuesize,visitor);
       }
-      // If we get here, we have reached the final slot in the node
-      // Therefore, key becomes the final key in the node
-      if(offset == numkeys - 1)
+      // let go of what has been handed over
+      std::vector<char>().swap(bufs[p].pairs);
       {
-        rc = b.SetKey(numkeys, key);
-        if(rc){return rc;}
-        // Do a few checks based on whether we are dealing with a root or interior node
-        if(b.info.nodetype == BTREE_LEAF_NODE)
-        {
-          rc = b.SetVal(numkeys,value);
-          if(rc){return rc;}
-        }
-        else // interior node
-        {
-          rc = b.SetPtr(numkeys+1,newNode);
-          if(rc){return rc;}
-        }
-        break;
+	std::lock_guard<std::mutex> l(lock);
+	delivered=p+1;
+	if (first) {
+	  stop=true;
+	}
       }
+      cond.notify_all();
     }
   }
-  else // numkeys == 0, so node is currently empty
-  {
-    rc = b.SetKey(0,key);
-    if(rc){return rc;}
-    rc = b.SetVal(0,value);
-    if(rc){return rc;}
+  for (SIZE_T w=0;w<numworkers;w++) {
+    workers[w].join();
   }
-
-  // Write the node back into the disk
-  return b.Serialize(buffercache, node);
-
+  return first;
 }
 
-//
-//
-// DEPTH first traversal
-// DOT is Depth + DOT format
-//
 
-ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
-				    ostream &o,
-				    BTreeDisplayType display_type) const
+ERROR_T BTreeIndex::Rank(const KEY_VIEW_T &key, SIZE_T &rank) const
 {
-  KEY_T testkey;
-  SIZE_T ptr;
   BTreeNode b;
-  ERROR_T rc;
+  SIZE_T node=superblock.info.rootnode;
   SIZE_T offset;
+  ERROR_T rc;
 
-  rc= b.Unserialize(buffercache,node);
-
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
-
-  rc = PrintNode(o,node,b,display_type);
-  
-  if (rc) { return rc; }
-
-  if (display_type==BTREE_DEPTH_DOT) { 
-    o << ";";
+  if (!(format&BTREE_FORMAT_COUNTED)) {
+    return ERROR_BADCONFIG;
   }
-
-  if (display_type!=BTREE_SORTED_KEYVAL) {
-    o << endl;
+  if (key.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
   }
-
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (b.info.numkeys>0) { 
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (display_type==BTREE_DEPTH_DOT) { 
-	  o << node << " -> "<<ptr<<";\n";
-	}
-	rc=DisplayInternal(ptr,o,display_type);
-	if (rc) { return rc; }
-      }
+  rank=0;
+  while (1) {
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE) {
+      rank+=LowerBound(b,key.data);
+      return ERROR_NOERROR;
     }
-    return ERROR_NOERROR;
-    break;
-  case BTREE_LEAF_NODE:
-    return ERROR_NOERROR;
-    break;
-  default:
-    if (display_type==BTREE_DEPTH_DOT) { 
-    } else {
-      o << "Unsupported Node Type " << b.info.nodetype ;
+    if (b.info.numkeys==0) {
+      return ERROR_NOERROR;
     }
-    return ERROR_INSANE;
+    // every child left of the one key would go to is entirely below it
+    offset=LowerBound(b,key.data);
+    for (SIZE_T i=0;i<offset;i++) {
+      rank+=ChildCount(b,i);
+    }
+    rc=b.GetPtr(offset,node);
+    if (rc) { return rc; }
   }
+}
+
+ERROR_T BTreeIndex::CountRange(const KEY_VIEW_T &lo, const KEY_VIEW_T &hi, SIZE_T &count) const
+{
+  BTreeNode b;
+  SIZE_T below=0;
+  SIZE_T upto;
+  ERROR_T rc;
 
+  if (!(format&BTREE_FORMAT_COUNTED)) {
+    return ERROR_BADCONFIG;
+  }
+  if (lo.length) {
+    rc=Rank(lo,below);
+    if (rc) { return rc; }
+  }
+  if (hi.length) {
+    rc=Rank(hi,upto);
+    if (rc) { return rc; }
+  } else {
+    rc=ReadNode(superblock.info.rootnode,b);
+    if (rc) { return rc; }
+    upto=SubtreeCount(b);
+  }
+  count=upto>below ? upto-below : 0;
   return ERROR_NOERROR;
 }
 
-
-ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
+ERROR_T BTreeIndex::Select(const SIZE_T k, KEY_T &key, VALUE_T &value) const
 {
+  BTreeNode b;
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T left=k;
+  SIZE_T offset;
   ERROR_T rc;
-  if (display_type==BTREE_DEPTH_DOT) { 
-    o << "digraph tree { \n";
+
+  if (!(format&BTREE_FORMAT_COUNTED)) {
+    return ERROR_BADCONFIG;
   }
-  rc=DisplayInternal(superblock.info.rootnode,o,display_type);
-  if (display_type==BTREE_DEPTH_DOT) { 
-    o << "}\n";
+  while (1) {
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE) {
+      if (left>=b.info.numkeys) {
+	return ERROR_NONEXISTENT;
+      }
+      key=KEY_T(b.info.keysize);
+      memcpy(key.data,KeyAt(b,left),b.info.keysize);
+      return GetLeafVal(b,left,value);
+    }
+    if (b.info.numkeys==0) {
+      return ERROR_NONEXISTENT;
+    }
+    // skip whole children until the one holding rank k
+    for (offset=0;offset<b.info.numkeys && left>=ChildCount(b,offset);offset++) {
+      left-=ChildCount(b,offset);
+    }
+    if (left>=ChildCount(b,offset)) {
+      return ERROR_NONEXISTENT;
+    }
+    rc=b.GetPtr(offset,node);
+    if (rc) { return rc; }
   }
-  return ERROR_NOERROR;
 }
 
 
+// Shared by the subtree checks SanityCheck runs in parallel
+struct SanityState {
+  SIZE_T                                     numblocks;
+  std::unique_ptr<std::atomic<unsigned char>[]> visited;
+};
+
 ERROR_T BTreeIndex::SanityCheck() const
 {
-  // WRITE ME
   // values in leaf nodes are increasing
-  // every pointer in interior nodes can be traced to a value in a leaf node
-  // every pointer in a leaf node is in the data file (change if implement delete?) 
+  // every key lies within the bounds its ancestors' separators give it
+  // every block is reachable only once (it is a tree)
   // check that it is balanced
-  // check valid use ratio of leaf - 1/2 full? 2/3?
+  // check valid use ratio: every node below the root's children is at
+  // least as full as a split leaves it
   BTreeNode b;
   ERROR_T rc;
   SIZE_T offset;
-  KEY_T testkey1;
-  KEY_T testkey2;
-  SIZE_T ptr;
-  VALUE_T value;
-  int count = 0;
-  int comp_count;
+  SanityState state;
 
-
-  rc = b.Unserialize(buffercache, superblock.info.rootnode);  // start at the root
+  rc = ReadNode(superblock.info.rootnode,b);  // start at the root
   if (rc) {  return rc; }
 
+  if (b.info.nodetype != BTREE_ROOT_NODE)
+  {
+    return ERROR_INSANE;
+  }
   if(b.info.numkeys == 0) // if the tree is empty, it is fine
   {
     return ERROR_NOERROR;
   }
+  if(b.info.numkeys > NumSlots(b))
+  {
+    return ERROR_BADCONFIG;
+  }
+  for (offset=1;offset<b.info.numkeys;offset++) {
+    if(CompareKeys(KeyAt(b,offset-1), KeyAt(b,offset)) >= 0) // check that the keys are increasing and unique
+    {
+      return ERROR_BADCONFIG;
+    }
+  }
+  if(!MessagesInOrder(b, 0, 0))
+  {
+    return ERROR_BADCONFIG;
+  }
 
-  rc = b.GetKey(0, testkey1);  // the first key in the root
-  if (rc) {  return rc; }
-
-  for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetPtr(offset,ptr);    // will return error if the pairs are not key-ptr
-      if (rc) {  return rc; }
-      rc = b.GetKey(offset, testkey2);
-      if (rc) {  return rc; }
-      if((!(offset == 0)) && ((testkey1 == testkey2) || !(testkey1 < testkey2))) // check that the keys are increasing and unique
-      {
-        return ERROR_BADCONFIG;
+  state.numblocks = buffercache->GetNumBlocks();
+  state.visited.reset(new std::atomic<unsigned char>[state.numblocks]);
+  for (SIZE_T i=0;i<state.numblocks;i++) {
+    state.visited[i] = 0;
+  }
+  state.visited[superblock.info.rootnode] = 1;
+
+  // Hand the root's children out round-robin to the workers.  Child
+  // offset's keys must lie in (key[offset-1], key[offset]].
+  SIZE_T numchildren = b.info.numkeys + 1;
+  SIZE_T numworkers = std::thread::hardware_concurrency();
+  if (numworkers == 0) { numworkers = 1; }
+  if (numworkers > numchildren) { numworkers = numchildren; }
+
+  std::vector<ERROR_T> results(numworkers, ERROR_NOERROR);
+  std::vector<SIZE_T> leafdepths(numworkers, 0);
+  std::vector<std::thread> workers;
+
+  for (SIZE_T w=0;w<numworkers;w++) {
+    workers.push_back(std::thread([&,w]() {
+      for (SIZE_T child=w;child<numchildren && !results[w];child+=numworkers) {
+        SIZE_T ptr=0;
+        SIZE_T count;
+        results[w] = b.GetPtr(child, ptr);
+        if (results[w]) { break; }
+        results[w] = SanityCheckRecurse(ptr,
+                                        child>0 ? b.ResolveKey(child-1) : 0,
+                                        child<b.info.numkeys ? b.ResolveKey(child) : 0,
+                                        1,
+                                        leafdepths[w],
+                                        false,
+                                        state,
+                                        count);
+        if (!results[w] && NumCountSlots(b) > 0 && ChildCount(b, child) != count) {
+          results[w] = ERROR_BADCONFIG;
+        }
       }
-      rc = b.GetKey(offset, testkey1);
-      if (rc) {  return rc; }
-
-      // check that the key exists with a value in a leaf
-      rc = ConstLookup(ptr, testkey1);
-      if (rc) {  return rc; }
+    }));
+  }
+  for (SIZE_T w=0;w<numworkers;w++) {
+    workers[w].join();
+  }
 
-      // check for errors on each of the children
-      rc = SanityCheckRecurse(ptr, testkey1, count, false);
-      if (rc) {  return rc; }
-      
-      // check that the tree is balanced
-      if(offset == 0)
-      {
-        comp_count = count;
-      }
-      else if(!(comp_count == count))
-      {
-        return ERROR_BADCONFIG;
-      }
-    }
+  for (SIZE_T w=0;w<numworkers;w++) {
+    if (results[w]) { return results[w]; }
+    // check that the tree is balanced
+    if (leafdepths[w] != leafdepths[0]) { return ERROR_BADCONFIG; }
+  }
   // if it made it this far there are no errors
   return ERROR_NOERROR;
 }
-  
-ERROR_T BTreeIndex::SanityCheckRecurse(const SIZE_T node, const KEY_T key, int &count, const bool split) const
+
+// Buffered messages are increasing and belong in (lo, hi]
+bool BTreeIndex::MessagesInOrder(const BTreeNode &b, const char *lo, const char *hi) const
+{
+  SIZE_T offset;
+
+  if(NumMessageSlots(b) == 0)
+  {
+    return true;
+  }
+  if(NumMessages(b) > NumMessageSlots(b))
+  {
+    return false;
+  }
+  for (offset=0;offset<NumMessages(b);offset++) {
+    const char *testkey = MessageAt(b,offset);
+    if((offset > 0) && (CompareKeys(MessageAt(b,offset-1), testkey) >= 0))
+    {
+      return false;
+    }
+    if((lo && CompareKeys(testkey, lo) <= 0) || (hi && CompareKeys(testkey, hi) > 0))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks the subtree at node, whose keys must all be > lo and <= hi (a
+// null bound is open).  leafdepth is the depth of the first leaf found,
+// which every other leaf must match.
+ERROR_T BTreeIndex::SanityCheckRecurse(const SIZE_T node,
+				       const char *lo,
+				       const char *hi,
+				       const SIZE_T depth,
+				       SIZE_T &leafdepth,
+				       const bool checkfill,
+				       SanityState &state,
+				       SIZE_T &count) const
 {
   BTreeNode b;
   ERROR_T rc;
   SIZE_T offset;
-  KEY_T testkey1;
-  KEY_T testkey2;
   SIZE_T ptr;
-  VALUE_T value;
-  SIZE_T slots;
-
-  rc = b.Unserialize(buffercache, node);
-  if (rc) {  return rc; }
+  SIZE_T childcount;
 
-  rc = b.GetKey(0, testkey1);
-  if (rc) {  return rc; }
+  count = 0;
 
-  // the root node pointed to this node so there should be at least one key in it, and the first key should be the one from the parent
-  if(b.info.numkeys == 0 || (key < testkey1))
+  // a block reached twice means the structure is not a tree
+  if(node >= state.numblocks || state.visited[node].exchange(1))
   {
     return ERROR_BADCONFIG;
   }
 
+  rc = ReadNode(node,b);
+  if (rc) {  return rc; }
+
   switch(b.info.nodetype){
+    case BTREE_INTERIOR_NODE:
+    case BTREE_LEAF_NODE:
+      break;
     case BTREE_ROOT_NODE:
-    // can't have two roots
+      // can't have two roots
       return ERROR_BADCONFIG;
-    case BTREE_INTERIOR_NODE:
-      slots = b.info.GetNumSlotsAsInterior();
-      if(b.info.numkeys < (slots/2))
-      {
-        return ERROR_BADCONFIG;
-      }
-      for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetPtr(offset,ptr);    // will return error if the pairs are not key-ptr
-      if (rc) {  return rc; }
-      
-      rc = b.GetKey(offset, testkey2);
-      if (rc) {  return rc; }
-      
-      if((!(offset == 0)) && ((testkey1 == testkey2) || !(testkey1 < testkey2))) // check that the keys are increasing and unique
-      {
-        return ERROR_BADCONFIG;
-      }
-      
-      rc = b.GetKey(offset, testkey1);  // update the comparison key
-      if (rc) {  return rc; }
-
-      // check that the key exists with a value in a leaf
-      rc = ConstLookup(ptr, testkey1);
-      if (rc) {  return rc; }
+    default:
+      // can only be a root, interior, or leaf node
+      return ERROR_INSANE;
+  }
 
-      // check for errors on each of the children
-      count = count + 1;
-      rc = SanityCheckRecurse(ptr, testkey1, count, true);
-      if (rc) {  return rc; }
-    }
+  if(b.info.numkeys > NumSlots(b))
+  {
+    return ERROR_BADCONFIG;
+  }
+  // deletes that reach the leaves in batches leave nodes as they find
+  // them, so a buffered index makes no promise about fill; and an append
+  // split leaves the rightmost node on a level, the one with no hi, short
+  if(checkfill && hi && b.info.numkeys < MinKeys(b) && !(format&BTREE_FORMAT_BUFFERED))
+  {
+    return ERROR_BADCONFIG;
+  }
 
-    // check that the parent key is the largest key (the last key) in the node
-    if(!(testkey1 == key))
+  for (offset=0;offset<b.info.numkeys;offset++) { 
+    const char *testkey = KeyAt(b,offset);
+    if((offset > 0) && (CompareKeys(KeyAt(b,offset-1), testkey) >= 0)) // check that the keys are increasing and unique
     {
       return ERROR_BADCONFIG;
     }
-    //if it got here there are no errors
-    return ERROR_NOERROR;
-    break;
-    
-    case BTREE_LEAF_NODE:
-      slots = b.info.GetNumSlotsAsLeaf();
-      if((split == true) && (b.info.numkeys < (slots + 2)/2))
-      {
-        return ERROR_BADCONFIG;
-      }
-      for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetVal(offset,value);    // will return error if the pairs are not key-value
-      if (rc) {  return rc; }
-      
-      rc = b.GetKey(offset, testkey2);
-      if (rc) {  return rc; }
-      
-      if((!(offset == 0)) && ((testkey1 == testkey2) || !(testkey1 < testkey2)))  // check that the keys are increasing and unique
-      {
-        return ERROR_BADCONFIG;
-      }
-      rc = b.GetKey(offset, testkey1);  // update the comparison key
-      if (rc) {  return rc; }
+    if((lo && CompareKeys(testkey, lo) <= 0) || (hi && CompareKeys(testkey, hi) > 0))
+    {
+      return ERROR_BADCONFIG;
     }
+  }
 
-    //check that the parent key is the largest key (the last key) in the node
-    if(!(testkey1 == key))
+  if(b.info.nodetype == BTREE_LEAF_NODE)
+  {
+    if(leafdepth == 0)
+    {
+      leafdepth = depth;
+    }
+    else if(leafdepth != depth)
     {
       return ERROR_BADCONFIG;
     }
-    
-    //if it got here there are no errors
+    count = b.info.numkeys;
     return ERROR_NOERROR;
-    break;
-    
-    default:
-    // can only be a root, interior, or leaf node
-    return ERROR_INSANE;
-    break;
   }
-  return ERROR_INSANE;
+
+  // an interior node with no keys would have just one child
+  if(b.info.numkeys == 0)
+  {
+    return ERROR_BADCONFIG;
+  }
+  if(!MessagesInOrder(b, lo, hi))
+  {
+    return ERROR_BADCONFIG;
+  }
+  for (offset=0;offset<=b.info.numkeys;offset++) { 
+    rc = b.GetPtr(offset,ptr);
+    if (rc) {  return rc; }
+    rc = SanityCheckRecurse(ptr,
+                            offset>0 ? b.ResolveKey(offset-1) : lo,
+                            offset<b.info.numkeys ? b.ResolveKey(offset) : hi,
+                            depth+1,
+                            leafdepth,
+                            true,
+                            state,
+                            childcount);
+    if (rc) {  return rc; }
+    if (NumCountSlots(b) > 0 && ChildCount(b, offset) != childcount) {
+      return ERROR_BADCONFIG;
+    }
+    count += childcount;
+  }
+  //if it got here there are no errors
+  return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::ConstLookup(const SIZE_T node, const KEY_T key) const
+ERROR_T BTreeIndex::ConstLookup(const SIZE_T node, const KEY_VIEW_T &key) const
 {
-  BTreeNode b;
+  ScratchNode scratch;
+  BTreeNode &b=*scratch;
   ERROR_T rc;
+  SIZE_T leaf;
   SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
-
-  rc= b.Unserialize(buffercache,node);
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
+  if (format&BTREE_FORMAT_BUFFERED) {
+    return BufferedLookup(key,0);
+  }
+  if (fingersearch && node==superblock.info.rootnode) {
+    rc=FingerLeaf(key,leaf,b);
+  } else {
+    rc=FindLeaf(node,key,leaf,b);
   }
-
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) {
-  // OK, so we now have the first key that's larger
-  // so we need to recurse on the ptr immediately previous to 
-  // this one, if it exists
-  rc=b.GetPtr(offset,ptr);
   if (rc) { return rc; }
-  return ConstLookup(ptr, key);
-      }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return ConstLookup(ptr,key);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-        return ERROR_NOERROR;
-      } 
-      }
-    
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }  
 
-  return ERROR_INSANE;
+  if (FindKey(b,key.data,offset)) { 
+    return ERROR_NOERROR;
+  }
+  return ERROR_NONEXISTENT;
 }
 
 
@@ -1,8 +1,15 @@
 #ifndef _btree
 #define _btree
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <list>
+#include <map>
 #include <string>
+#include <utility>
+#include <mutex>
+#include <vector>
 
 #include "global.h"
 #include "block.h"
@@ -25,6 +32,28 @@ typedef Buffer KeyOrValue;
 typedef KeyOrValue KEY_T;
 typedef KeyOrValue VALUE_T;
 
+// A key or value we only need to look at, usually bytes sitting inside a
+// node.  It does not own the bytes, so it is only good for as long as
+// whatever it points into.
+struct BufferView {
+  const char *data;
+  SIZE_T      length;
+
+  BufferView() : data(0), length(0) {}
+  BufferView(const char *d, const SIZE_T l) : data(d), length(l) {}
+  BufferView(const Buffer &b) : data(b.data), length(b.length) {}
+};
+
+typedef BufferView KEY_VIEW_T;
+typedef BufferView VALUE_VIEW_T;
+
+// Exchange the contents of two buffers without copying the bytes
+inline void SwapBuffers(Buffer &lhs, Buffer &rhs)
+{
+  std::swap(lhs.data,rhs.data);
+  std::swap(lhs.length,rhs.length);
+}
+
 struct KeyValuePair {
   KEY_T key;
   VALUE_T value;
@@ -32,35 +61,661 @@ struct KeyValuePair {
   KeyValuePair();
   KeyValuePair(const KEY_T &key, const VALUE_T &value);
   KeyValuePair(const KeyValuePair &rhs);
+  KeyValuePair(KeyValuePair &&rhs);
   virtual ~KeyValuePair();
   KeyValuePair & operator=(const KeyValuePair &rhs);
+  KeyValuePair & operator=(KeyValuePair &&rhs);
+
+};
+
+// How keys are ordered.  The choice is recorded in the superblock when
+// the index is created and picked up again by Attach.  The integer and
+// double orders read the key as an 8 byte native-endian number.
+enum BTreeKeyCompare {
+  BTREE_CMP_BYTES=0,       // memcmp order of the raw key bytes
+  BTREE_CMP_UINT64=1,
+  BTREE_CMP_INT64=2,
+  BTREE_CMP_DOUBLE=3,
+  BTREE_CMP_CUSTOM=16      // first id available to RegisterKeyCompare
+};
+
+#define BTREE_MAX_CUSTOM_CMP 16
+
+// How LowerBound looks for a key within a node.  Interpolation guesses
+// the slot from where the key falls between the node's first and last
+// keys and gallops out from the guess, so on evenly spread keys it
+// takes a handful of compares whatever the fanout.  Numeric orders only.
+enum BTreeSearchMode {
+  BTREE_SEARCH_BINARY=0,
+  BTREE_SEARCH_INTERPOLATE=1
+};
+
+// Returns <0, 0, >0 like memcmp
+typedef int (*BTreeKeyCompareFn)(const char *lhs, const char *rhs, const SIZE_T keysize);
+
+// Index settings kept in the data area of the superblock, which the tree
+// does not otherwise use.  An image without the magic number gets the
+// defaults.
+#define BTREE_SUPERBLOCK_MAGIC 0x42545231
+
+// Optional on-disk format features, chosen when the index is created
+#define BTREE_FORMAT_CHECKSUM 0x1   // CRC32 in the last bytes of every tree node
+#define BTREE_FORMAT_SPLITLEAF 0x2  // leaf keys stored together, ahead of the values
+#define BTREE_FORMAT_COMPRESS  0x4  // leaves LZ compressed on disk, see ReadNode
+#define BTREE_FORMAT_BUFFERED  0x8  // interior nodes buffer updates, see Flush
+#define BTREE_FORMAT_COUNTED   0x10 // interior nodes count the pairs under each child, see Rank
+#define BTREE_FORMAT_JOURNAL   0x20 // undo journal back to the last checkpoint, see Checkpoint
+
+#define BTREE_DEFAULT_LEAFCACHE 256
+
+#define BTREE_JOURNAL_MAGIC    0x42544a31
+#define BTREE_MIN_JOURNAL      64    // blocks
+
+#define BTREE_APPEND_RUN       4     // inserts in a row, each above the last, that make appends
+
+#define BTREE_MAX_FINGERS      16    // indexes a thread keeps a finger into
+#define BTREE_BULK_EXTENT      256   // blocks a parallel bulk load hands a thread at a time
+#define BTREE_SCAN_READAHEAD   16    // children a parallel scan reads at a time
+#define BTREE_SCAN_PARTS       4     // sub-ranges a parallel scan makes per thread
+
+struct SuperblockData {
+  SIZE_T magic;
+  SIZE_T keycompare;
+  SIZE_T format;
+  SIZE_T version;     // bumped each time a snapshot is taken
+  SIZE_T nextfresh;   // blocks from here up have never been used; 0 if none
+  // BTREE_FORMAT_JOURNAL only: the journal takes the blocks from
+  // journalstart up, journal is its newest block, and the rest is the
+  // state of the superblock at the last checkpoint
+  SIZE_T journalstart;
+  SIZE_T journal;
+  SIZE_T checkpointroot;
+  SIZE_T checkpointfreelist;
+  SIZE_T checkpointfresh;
+};
+
+// A read-only view of the tree as it was when the snapshot was taken.
+// The live tree is still updated in place; the first time a block is
+// rewritten or freed after the snapshot, its old contents are copied to
+// a new block first, and the snapshot reads the copy from then on.
+struct BTreeSnapshot {
+  SIZE_T                  version;
+  SIZE_T                  root;        // SplitRoot moves the live root
+  std::map<SIZE_T,SIZE_T> preserved;   // block -> copy of it as of version
+};
 
+// The way a thread last went down an index, see SetFingerSearch.  Level
+// i, root first, is a node, its block version when it was read, and the
+// keys under it: those above lo, if haslo, and up to hi, if hashi.
+struct BTreeFinger {
+  std::vector<SIZE_T> nodes;
+  std::vector<SIZE_T> versions;
+  std::vector<char>   lo;        // keysize bytes a level
+  std::vector<char>   hi;
+  std::vector<bool>   haslo;
+  std::vector<bool>   hashi;
 };
 
+// What a span of the trace, see SetTracing, timed
+enum BTreeTraceKind {
+  BTREE_TRACE_INSERT=0,
+  BTREE_TRACE_LOOKUP=1,
+  BTREE_TRACE_UPDATE=2,
+  BTREE_TRACE_DELETE=3,
+  BTREE_TRACE_DESCEND=4,    // one node on the way down, and what is under it
+  BTREE_TRACE_READ=5,       // ReadNode: Unserialize, and unpacking a leaf
+  BTREE_TRACE_WRITE=6,      // StoreNode: packing a leaf, and Serialize
+  BTREE_TRACE_SPLIT=7,
+  BTREE_TRACE_ADDKEYVAL=8,
+  BTREE_TRACE_ALLOCATE=9
+};
+
+// One span of the trace.  Times are in nanoseconds since SetTracing.
+struct BTreeTraceEvent {
+  SIZE_T             kind;
+  SIZE_T             block;      // 0 for a whole operation
+  bool               miss;       // a read the buffer cache went to disk for
+  SIZE_T             thread;     // numbered from 1 in the order threads first trace
+  unsigned long long start;
+  unsigned long long duration;
+};
+
+// Receives key/value pairs in key order from a scan.  Returning anything
+// but ERROR_NOERROR stops the scan, which then returns that code.
+class BTreeScanVisitor {
+ public:
+  virtual ~BTreeScanVisitor() {}
+  virtual ERROR_T Visit(const KEY_VIEW_T &key, const VALUE_VIEW_T &value)=0;
+};
+
+struct SanityState;
+
 enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP};
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+// Supplies key/value pairs to BulkLoad in strictly increasing key order.
+// The views Next hands back only need to stay valid until the next call.
+class BTreeBulkSource {
+ public:
+  virtual ~BTreeBulkSource() {}
+  // ERROR_NONEXISTENT once there are no more pairs
+  virtual ERROR_T Next(KEY_VIEW_T &key, VALUE_VIEW_T &value)=0;
+};
+
+// Hands out and takes back blocks for indexes sharing one disk, in
+// place of the free list in each superblock; see BTreeCatalog
+class BTreeBlockAllocator {
+ public:
+  virtual ~BTreeBlockAllocator() {}
+  // ERROR_NOSPACE once there are no free blocks
+  virtual ERROR_T AllocateBlock(SIZE_T &n)=0;
+  virtual ERROR_T FreeBlock(const SIZE_T n)=0;
+};
+
+struct BulkLevel;
+struct BulkExtent;
+struct ExportWriter;
+struct ScanAhead;
+class BTreeTraceSpan;
+
 class BTreeIndex {
- private:
+ protected:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
 
- protected:
+  SIZE_T            keycompare;
+  BTreeKeyCompareFn keycomparefn;
+  SIZE_T            format;
+  SIZE_T            searchmode;
+  // added to by every node search, concurrent readers included
+  mutable std::atomic<SIZE_T> searchcompares;
+
+  // The buffer cache is not thread safe; every read and write of a block
+  // goes through ReadNode/WriteNode, which hold cachelock.  It is ownlock
+  // unless the index is in a BTreeCatalog, whose indexes share a cache
+  // and so one lock.
+  mutable std::mutex ownlock;
+  std::mutex        *cachelock;
+
+  // Where an index in a catalog gets its blocks; 0 for one with the
+  // disk to itself
+  BTreeBlockAllocator *allocator;
+
+  friend class BTreeAsyncIO;
+  friend class BTreeDelta;
+  friend class BTreeShardedIndex;
+  friend class BTreeCatalog;
+  friend class BTreeTraceSpan;
+  friend class BTreeStress;
+
+  // BTREE_FORMAT_COMPRESS leaves as they are in memory, unpacked, most
+  // recently used at the front of leafcachelru, so hot leaves are not
+  // decompressed on every read.  oversize holds leaves an insert or
+  // update has grown past what compresses into a block, until the split
+  // that follows puts them back on disk.  Both under cachelock.
+  mutable std::list<SIZE_T>      leafcachelru;
+  mutable std::map<SIZE_T,std::pair<BTreeNode,std::list<SIZE_T>::iterator> > leafcache;
+  std::map<SIZE_T,BTreeNode>     oversize;
+  SIZE_T                         leafcachesize;
+
+  // Snapshot bookkeeping, all under snaplock.  allocversion has the
+  // version current when a block was allocated; a snapshot never needs
+  // a copy of a block allocated at or after its own version.  copyrefs
+  // counts the snapshots using each copy, and copies no snapshot uses
+  // any more wait in reclaim for AllocateNode to hand them out again.
+  mutable std::mutex             snaplock;
+  SIZE_T                         version;
+  std::map<SIZE_T,BTreeSnapshot> snapshots;
+  std::map<SIZE_T,SIZE_T>        allocversion;
+  std::map<SIZE_T,SIZE_T>        copyrefs;
+  std::vector<SIZE_T>            reclaim;
+  std::atomic<SIZE_T>            numsnapshots;
+  // LookupSnapshot and ScanSnapshot calls under way.  Those read only
+  // nodes, under snaplock, and settings fixed at Attach; Rollback waits
+  // for them to finish before it attaches again.
+  mutable std::atomic<SIZE_T>    snapshotreaders;
+
+  // Blocks from nextfresh up to the journal, or the end of the disk, have
+  // never been handed out, so Attach(...,true) need not write them
+  SIZE_T                         nextfresh;
+
+  // BTREE_FORMAT_JOURNAL undo journal, see Checkpoint.  The first time a
+  // block the last checkpoint knew is rewritten, its old contents are
+  // copied to the next free block of the journal and listed in the
+  // newest journal block, journalhead.  journaled has the blocks already
+  // copied, so each is copied once per checkpoint.
+  SIZE_T                         journalstart;   // 0 if no journal
+  SIZE_T                         journalnext;
+  SIZE_T                         journalhead;
+  BTreeNode                      journalpage;    // contents of journalhead
+  std::map<SIZE_T,SIZE_T>        journaled;      // block -> its copy
+  SIZE_T                         journalheight;  // of the tree, for the reserve
+  bool                           journalfailed;  // an update stopped part way
+  SIZE_T                         checkpointroot;
+  SIZE_T                         checkpointfreelist;
+  SIZE_T                         checkpointfresh;
+  SIZE_T                         journalblocks;  // for Attach(...,true)
+  SIZE_T                         checkpoints;
+  SIZE_T                         recovered;
+  SIZE_T                         warmlevels;
+
+  // Per-leaf Bloom filters, see SetLeafFilters.  A block has a filter
+  // only while it holds a leaf, so finding one also tells a descent that
+  // the child it is about to read is a leaf.  Readers build them too, so
+  // the filters and their counts are under filterlock.
+  mutable std::mutex             filterlock;
+  mutable std::map<SIZE_T,std::vector<unsigned long long> > leaffilters;
+  SIZE_T                         filterbitsperkey;
+  SIZE_T                         filterhashes;
+  SIZE_T                         filterbudget;   // bytes, 0 if off
+  mutable SIZE_T                 filterbytes;
+  mutable SIZE_T                 filterskips;
+
+  // Adaptive hash index, see SetHashIndex.  A direct-mapped table from
+  // key to the leaf and slot it was last found at, stamped with the
+  // leaf's version; WriteNode bumps a block's version, so an entry is
+  // only trusted while its leaf is unchanged.  On a collision the
+  // resident's hit count is worn down before it is replaced, so keys that
+  // keep coming back hold their place.  Lookups on several threads probe
+  // and record at once, so the entries and hashfound are under hashlock.
+  std::vector<SIZE_T>            blockversions;
+  std::vector<char>              hashkeys;
+  std::vector<SIZE_T>            hashleaf;
+  std::vector<SIZE_T>            hashslot;
+  std::vector<SIZE_T>            hashversion;
+  std::vector<SIZE_T>            hashhits;      // 0 if the entry is empty
+  SIZE_T                         hashmask;
+  SIZE_T                         hashfound;
+  std::mutex                     hashlock;
+
+  // Finger search, see SetFingerSearch.  The fingers themselves are per
+  // thread; fingerepoch names this attachment of the index among them,
+  // so a finger left from before the last Attach is never used.  Needs
+  // blockversions, like the hash index.
+  bool                           fingersearch;
+  SIZE_T                         fingerepoch;
+  mutable std::atomic<SIZE_T>    fingerhits;    // readers on every thread add to it
+
+  // Appends, see InsertRightmost.  rightleaf is the rightmost leaf, 0 if
+  // not known, and every key above rightlow belongs in it; a split or
+  // merge anywhere forgets it.  appendrun counts the inserts in a row
+  // each above the one before.
+  SIZE_T                         rightleaf;
+  std::vector<char>              rightlow;
+  bool                           rightlone;     // its parent is a root with one key
+  std::vector<char>              lastinsert;
+  SIZE_T                         appendrun;
+  bool                           splitright;    // SplitNode leaves the right node all but empty
+  SIZE_T                         appends;
+
+  // Tracing, see SetTracing.  trace is a ring of the last spans, with
+  // the next one going at tracenext, under tracelock.  tracing is read
+  // without the lock, so a span costs one load while it is off.
+  std::atomic<bool>              tracing;
+  mutable std::mutex             tracelock;
+  mutable std::vector<BTreeTraceEvent> trace;
+  mutable SIZE_T                 tracenext;
+  mutable SIZE_T                 tracecount;
+  std::chrono::steady_clock::time_point tracestart;
+
+  ERROR_T      ReadSuperblockData();
+
+  // Write an empty index: the superblock at superblock_index and an
+  // empty root at root.  Blocks from fresh up are the index's to hand
+  // out; 0 if they come from an allocator.
+  ERROR_T      WriteEmptyIndex(const SIZE_T root, const SIZE_T fresh);
+
+  // The superblock, with the settings in its data area
+  ERROR_T      WriteSuperblock();
+
+  // Copy node to the journal if the last checkpoint knew it and it has
+  // not been copied since.  StoreNode calls this before every write.
+  ERROR_T      JournalBlock(const SIZE_T node);
+
+  // Blocks an update might need in the journal, from the height of the tree
+  SIZE_T       JournalReserve() const;
+
+  // Called before each update of a BTREE_FORMAT_JOURNAL index: goes back
+  // to the last checkpoint if an update failed part way, and takes a
+  // checkpoint if the journal is nearly full
+  ERROR_T      BeginUpdate();
+
+  // Copy every journaled block back and return the superblock to the
+  // last checkpoint.  Attach does this after an unclean shutdown.
+  ERROR_T      Recover();
+
+  // Recover, and drop what was in memory about the blocks since
+  ERROR_T      Rollback();
+
+  // Start a new, empty journal
+  void         ResetJournal();
+
+  // BulkLoad of the pairs of each source in turn, which together must be
+  // in increasing order, with checkpoints around it for a journal
+  ERROR_T      BulkLoadSources(const std::vector<BTreeBulkSource *> &sources,
+			       const SIZE_T fillpercent);
+
+  // BulkLoadSources without the checkpoints.  With more than one source,
+  // each builds its own leaves on a thread of its own.
+  ERROR_T      BulkLoadInternal(const std::vector<BTreeBulkSource *> &sources,
+				const SIZE_T fillpercent);
+
+  void         WriteSuperblockData(BTreeNode &sb) const;
+
+  int          CompareKeys(const char *lhs, const char *rhs) const
+  { return (*keycomparefn)(lhs,rhs,superblock.info.keysize); }
+
+  // Where slot offset's key and value live in b.  Interior nodes and
+  // ordinary leaves alternate them; a BTREE_FORMAT_SPLITLEAF leaf keeps
+  // every key ahead of every value, so searching it only touches keys.
+  char *       KeyAt(const BTreeNode &b, const SIZE_T offset) const
+  {
+    if ((format&BTREE_FORMAT_SPLITLEAF) && b.info.nodetype==BTREE_LEAF_NODE) {
+      return b.ResolveKey(0)+offset*b.info.keysize;
+    }
+    return b.ResolveKey(offset);
+  }
+
+  char *       ValAt(const BTreeNode &b, const SIZE_T offset) const
+  {
+    if (format&BTREE_FORMAT_SPLITLEAF) {
+      return b.ResolveKey(0)+NumSlots(b)*b.info.keysize+offset*b.info.valuesize;
+    }
+    return b.ResolveVal(offset);
+  }
+
+  // Bytes from one key in b to the next
+  SIZE_T       KeyStride(const BTreeNode &b) const;
+
+  ERROR_T      GetLeafVal(const BTreeNode &b, const SIZE_T offset, VALUE_T &value) const;
+
+  // memmove count leaf slots from src at srcoff to dst at dstoff; src
+  // and dst may be the same node
+  void         MoveLeafSlots(BTreeNode &dst,
+			     const SIZE_T dstoff,
+			     const BTreeNode &src,
+			     const SIZE_T srcoff,
+			     const SIZE_T count) const;
+
+  ERROR_T      PrintNode(ostream &os, SIZE_T nodenum, const BTreeNode &b, BTreeDisplayType dt) const;
+
+  // First key slot in b whose key is >= key, or numkeys if none is.
+  // In an interior node this is the pointer to follow.
+  SIZE_T       LowerBound(const BTreeNode &b, const char *key) const;
+
+  bool         FindKey(const BTreeNode &b, const char *key, SIZE_T &offset) const;
+
+  // All block I/O for the index.  ReadNode verifies and WriteNode fills
+  // in the node checksum when the format has one.
+  ERROR_T      ReadNode(const SIZE_T node, BTreeNode &b) const;
+
+  ERROR_T      WriteNode(const SIZE_T node, BTreeNode &b);
+
+  // WriteNode without the snapshot copy
+  ERROR_T      StoreNode(const SIZE_T node, BTreeNode &b);
+
+  // Copy node's current contents for every snapshot that still needs
+  // them.  Caller holds snaplock.
+  ERROR_T      PreserveForSnapshots(const SIZE_T node);
+
+  // (Re)build the filter for leaf node from its keys, if the budget
+  // allows; unless replace, a filter node already has is kept
+  void         BuildLeafFilter(const SIZE_T node, const BTreeNode &b, const bool replace=true) const;
+
+  void         DropLeafFilter(const SIZE_T node) const;
+
+  // True if node has a filter and it rules key out
+  bool         LeafFilterExcludes(const SIZE_T node, const char *key) const;
+
+  // Leaf and slot the hash index has for key, if still valid
+  bool         HashProbe(const char *key, SIZE_T &leaf, SIZE_T &offset);
+
+  void         HashRecord(const char *key, const SIZE_T leaf, const SIZE_T offset);
+
+  ERROR_T      SnapshotRoot(const SIZE_T snapshot, SIZE_T &root) const;
+
+  // Reads node as snapshot sees it
+  ERROR_T      ReadSnapshotNode(const SIZE_T snapshot, const SIZE_T node, BTreeNode &b) const;
+
+  ERROR_T      ScanSnapshotInternal(const SIZE_T snapshot,
+				    const SIZE_T node,
+				    BTreeScanVisitor &visitor) const;
+
+  ERROR_T      ScanRangeInternal(const SIZE_T node,
+				 const KEY_VIEW_T &lo,
+				 const KEY_VIEW_T &hi,
+				 BTreeScanVisitor &visitor) const;
+
+  // ScanRangeInternal below b, already read, reading the children of
+  // each node BTREE_SCAN_READAHEAD at a time into ahead
+  ERROR_T      ScanRangeAhead(const BTreeNode &b,
+			      const KEY_VIEW_T &lo,
+			      const KEY_VIEW_T &hi,
+			      BTreeScanVisitor &visitor,
+			      ScanAhead &ahead,
+			      const SIZE_T depth) const;
+
+  // ReadNode of n nodes into out.  Uncompressed blocks are all read
+  // under one hold of cachelock, in block order.
+  ERROR_T      ReadNodes(const SIZE_T *nodes,
+			 const SIZE_T n,
+			 std::vector<BTreeNode> &out) const;
+
+  // Separator keys strictly inside (lo,hi) that cut it into up to parts
+  // sub-ranges of about the same size, from the highest level that has
+  // enough of them, in increasing order
+  ERROR_T      ScanCuts(const KEY_VIEW_T &lo,
+			const KEY_VIEW_T &hi,
+			const SIZE_T parts,
+			std::vector<char> &cuts) const;
+
+  // Bytes at the end of a node's data area that are not slots
+  SIZE_T       TrailerBytes(const BTreeNode &b) const;
+
+  // The message buffer of a BTREE_FORMAT_BUFFERED interior node sits in
+  // its trailer: a count, then that many messages sorted by key, each
+  // the key, the value and a BTreeOp byte.  At most one per key; a
+  // message in a node is newer than any for the same key below it.
+  SIZE_T       MessageBytes() const
+  { return superblock.info.keysize+superblock.info.valuesize+1; }
+
+  // 0 for nodes without a buffer
+  SIZE_T       NumMessageSlots(const BTreeNode &b) const;
+
+  char *       MessageBuffer(const BTreeNode &b) const;
+
+  SIZE_T       NumMessages(const BTreeNode &b) const;
+
+  void         SetNumMessages(BTreeNode &b, const SIZE_T n) const;
+
+  char *       MessageAt(const BTreeNode &b, const SIZE_T slot) const
+  { return MessageBuffer(b)+sizeof(SIZE_T)+slot*MessageBytes(); }
+
+  bool         FindMessage(const BTreeNode &b, const char *key, SIZE_T &slot) const;
+
+  // The run of messages in b bound for child offset
+  void         ChildMessages(const BTreeNode &b,
+			     const SIZE_T offset,
+			     SIZE_T &first,
+			     SIZE_T &count) const;
+
+  // Remove count messages from b starting at first, appending them to msgs
+  void         TakeMessages(BTreeNode &b,
+			    const SIZE_T first,
+			    const SIZE_T count,
+			    std::vector<char> &msgs) const;
+
+  // Merge count sorted messages into b's buffer, replacing any older
+  // ones for the same keys.  ERROR_NOSPACE if they do not fit.
+  ERROR_T      MergeMessages(BTreeNode &b, const char *msgs, const SIZE_T count) const;
+
+  // Put key and newNode into interior node b (in memory) as AddKeyVal does
+  void         AddSeparator(BTreeNode &b, const SIZE_T offset, const char *key, const SIZE_T newNode) const;
+
+  // Split child offset of b (in memory), adding the separator to b
+  ERROR_T      SplitChild(BTreeNode &b, const SIZE_T offset);
+
+  // Push messages from b down to its children, biggest batch first,
+  // until its buffer has room for need more.  A child that fills up is
+  // split into b; stops early if that fills b, which the caller then
+  // has to split.  The caller writes b.
+  ERROR_T      FlushBuffer(BTreeNode &b, const SIZE_T need);
+
+  // Apply msgs to the leaves under b, splitting leaves that fill up
+  // into b.  What is left over once b fills goes back in its buffer.
+  ERROR_T      ApplyMessages(BTreeNode &b, const std::vector<char> &msgs);
+
+  // FlushBuffer all the way down, so no message is left in b or below
+  // it, unless b fills up first as for FlushBuffer
+  ERROR_T      DrainBuffers(BTreeNode &b);
+
+  // Add a message for key to the root's buffer, flushing to make room
+  ERROR_T      Enqueue(const BTreeOp op, const KEY_VIEW_T &key, const VALUE_VIEW_T &value);
+
+  // Lookup for a BTREE_FORMAT_BUFFERED index: the first message for key
+  // on the way down is the newest and overrides the leaf.  value may be
+  // 0 to just check the key is there.
+  ERROR_T      BufferedLookup(const KEY_VIEW_T &key, VALUE_T *value) const;
+
+  // A BTREE_FORMAT_COUNTED interior node keeps the number of pairs under
+  // each of its children in its trailer, one SIZE_T per pointer slot.
+  // 0 for nodes without counts.
+  SIZE_T       NumCountSlots(const BTreeNode &b) const;
+
+  SIZE_T       ChildCount(const BTreeNode &b, const SIZE_T offset) const;
+
+  void         SetChildCount(BTreeNode &b, const SIZE_T offset, const SIZE_T n) const;
+
+  // Pairs under b: its keys for a leaf, its children's counts otherwise
+  SIZE_T       SubtreeCount(const BTreeNode &b) const;
+
+  // Set b's count for child offset from the child itself
+  ERROR_T      RecountChild(BTreeNode &b, const SIZE_T offset) const;
+
+  // Bring the counts on the path to key up to date, bottom up.  Insert
+  // and Delete only change counts on that path, and leave it to this.
+  ERROR_T      RecountPath(const KEY_VIEW_T &key);
+
+  // Key slots available in b, allowing for the trailer
+  SIZE_T       NumSlots(const BTreeNode &b) const;
+
+  // Fewest keys a node other than the root and its children may have
+  SIZE_T       MinKeys(const BTreeNode &b) const;
+
+  // Block size to build a new leaf with; compressed leaves hold more
+  // than a block's worth when unpacked
+  SIZE_T       LeafBlockSize() const;
+
+  // Compress leaf b into the on-disk node phys.  ERROR_SIZE if it does
+  // not fit in a block.
+  ERROR_T      PackLeaf(const BTreeNode &b, BTreeNode &phys) const;
+
+  ERROR_T      UnpackLeaf(const BTreeNode &phys, BTreeNode &b) const;
+
+  // Remember b as the current contents of leaf node.  Caller holds
+  // cachelock.
+  void         CacheLeaf(const SIZE_T node, const BTreeNode &b) const;
+
+  void         UncacheLeaf(const SIZE_T node) const;
+
+  // Split the nodes on the path to key that have outgrown their block,
+  // as Insert does on its way back up
+  ERROR_T      SplitUpward(const KEY_VIEW_T &key);
+
+  // Insert into rightleaf without a descent, if key belongs there.  done
+  // says whether it was inserted, or found, there.
+  ERROR_T      InsertRightmost(const KEY_VIEW_T &key, const VALUE_VIEW_T &value, bool &done);
+
+  // Walk down the right edge of the tree to set rightleaf and rightlow
+  ERROR_T      FindRightmost();
+
+  // The calling thread's finger into this index
+  BTreeFinger & ThreadFinger() const;
+
+  // FindLeaf from the root, but starting as low on this thread's finger
+  // as still covers key, and leaving the way down in the finger.  An
+  // insert needs the leaf whatever its filter says, so it passes
+  // filtered=false.
+  ERROR_T      FingerLeaf(const KEY_VIEW_T &key,
+			  SIZE_T &leaf,
+			  BTreeNode &b,
+			  const bool filtered=true) const;
+
+  // Insert into the leaf FingerLeaf finds.  done is false if the tree is
+  // too shallow, and Insert should go from the root.
+  ERROR_T      InsertAtFinger(const KEY_VIEW_T &key, const VALUE_VIEW_T &value, bool &done);
+
+  // The finger's leaf was just rewritten in place, with the same keys
+  // under it; keep trusting it
+  void         FingerWrote(const SIZE_T leaf) const;
+
+  // Nanoseconds since SetTracing
+  unsigned long long TraceClock() const;
+
+  // Add a finished span to the ring
+  void         RecordTrace(const BTreeTraceEvent &e) const;
+
+  unsigned     NodeChecksum(const BTreeNode &b) const;
+
+  // Writes a node built by BulkLoad to a newly allocated block and
+  // records it, with the largest key under it, in level.  The block
+  // comes from extent, if there is one, or from AllocateNode.
+  ERROR_T      FinishBulkNode(BTreeNode &b,
+			      const char *maxkey,
+			      BulkLevel &level,
+			      std::vector<SIZE_T> &written,
+			      BulkExtent *extent=0);
+
+  // Fill leaves with the pairs of source, recording them in level.  The
+  // last two are evened out, so every leaf is at least half full.
+  ERROR_T      BuildBulkLeaves(BTreeBulkSource &source,
+			       const SIZE_T fillpercent,
+			       BulkLevel &level,
+			       std::vector<SIZE_T> &written,
+			       BulkExtent *extent);
+
+  // Up to BTREE_BULK_EXTENT blocks from the never used part of the disk
+  // for one thread of a parallel bulk load
+  ERROR_T      AllocateBulkExtent(BulkExtent &extent);
+
+  // Builds one level of interior nodes over children
+  ERROR_T      BuildBulkLevel(const BulkLevel &children,
+			      BulkLevel &level,
+			      std::vector<SIZE_T> &written);
+
+  ERROR_T      ExportInternal(const SIZE_T node, ExportWriter &w) const;
+
 
   ERROR_T      AllocateNode(SIZE_T &node);
 
+  // AllocateNode with snaplock already held
+  ERROR_T      AllocateNodeLocked(SIZE_T &node);
+
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
+  // Puts node back on the free list without preserving it
+  ERROR_T      FreeNode(const SIZE_T node);
+
   ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
 				      const BTreeOp op, 
-				      const KEY_T &key,
+				      const KEY_VIEW_T &key,
 				      VALUE_T &val);
 
+  // Walks down from start to the leaf that would hold key, leaving that
+  // leaf in b and its block number in leaf.  Returns ERROR_NONEXISTENT
+  // without reading the leaf if its filter says key is not there.
+  ERROR_T      FindLeaf(const SIZE_T start,
+			const KEY_VIEW_T &key,
+			SIZE_T &leaf,
+			BTreeNode &b) const;
+
   bool         NeedToSplit(const SIZE_T node);
 
   ERROR_T      SplitNode(const SIZE_T node, SIZE_T &secondNode, KEY_T &promotedKey);
+
+  ERROR_T      SplitRoot();
   
   ERROR_T      SearchInternal(const SIZE_T &node,
              const KEY_T &key,
@@ -68,8 +723,8 @@ class BTreeIndex {
              KEY_T &promotedKey);
 
   ERROR_T      SearchInternal2(SIZE_T node,
-             const KEY_T &key,
-             const VALUE_T &value,
+             const KEY_VIEW_T &key,
+             const VALUE_VIEW_T &value,
              SIZE_T parentNode);  
 
 
@@ -77,15 +732,22 @@ class BTreeIndex {
 			       ostream &o, 
 			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
 
-  ERROR_T      AddKeyVal(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newNode);
+  ERROR_T      AddKeyVal(const SIZE_T node, const KEY_VIEW_T &key, const VALUE_VIEW_T &value, SIZE_T newNode);
 
-  ERROR_T     SanityCheckRecurse(const SIZE_T node, const KEY_T key, int &count, const bool split) const;
+  ERROR_T     SanityCheckRecurse(const SIZE_T node,
+				 const char *lo,
+				 const char *hi,
+				 const SIZE_T depth,
+				 SIZE_T &leafdepth,
+				 const bool checkfill,
+				 SanityState &state,
+				 SIZE_T &count) const;
 
-  ERROR_T     ConstLookup(const SIZE_T node, const KEY_T key) const;
+  bool        MessagesInOrder(const BTreeNode &b, const char *lo, const char *hi) const;
 
-  ERROR_T     DeleteRecurse(const KEY_T &key, const SIZE_T node, KEY_T &promotedKey);
+  ERROR_T     ConstLookup(const SIZE_T node, const KEY_VIEW_T &key) const;
 
-  ERROR_T     DeleteAndShift(const SIZE_T node, const KEY_T &key);
+  ERROR_T     RebalanceChild(BTreeNode &parent, const SIZE_T offset);
 
 public:
   //
@@ -97,11 +759,12 @@ public:
   // and actually write the data in the superblock.
   // otherwise, the expectation is that keysize and valuesize
   // will be zero and will be read when Attach(initialblock,false) is 
-  // invoked
+  // invoked.  keycompare works the same way.
   BTreeIndex(SIZE_T keysize, 
 	     SIZE_T valuesize,
 	     BufferCache *cache,
-	     bool unique=true);   // true if a  key maps to a single value
+	     bool unique=true,   // true if a  key maps to a single value
+	     SIZE_T keycompare=BTREE_CMP_BYTES);
 
 
   BTreeIndex();
@@ -111,7 +774,8 @@ public:
   
 
   // This is called before any inserts, updates, or deletes happen
-  // If create=true, then initblock is meaningless
+  // If create=true, the index takes every block from initblock on, with
+  // its superblock at initblock (see BTreeCatalog for sharing a disk)
   // If create=false, than the index already exists and we are telling you
   // the block that the last detach returned
   // This should be your superblock, which contains the information 
@@ -124,6 +788,57 @@ public:
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
   ERROR_T Detach(SIZE_T &initblock);
+
+  // BTREE_FORMAT_JOURNAL: make the index as it is now the state Attach
+  // goes back to after an unclean shutdown.  Only the superblock is
+  // written; every block since the last checkpoint is already on disk,
+  // with a copy of what it held before in the journal.  Updates take a
+  // checkpoint themselves whenever the journal is nearly full, and
+  // Detach takes one last.  Attach copies back only the blocks in the
+  // journal, so recovering takes time in proportion to the updates since
+  // the checkpoint.  This assumes the BufferCache writes blocks back in
+  // the order they are written.  Snapshots do not survive a recovery,
+  // and the blocks their copies held at the checkpoint are lost.
+  // return ERROR_BADCONFIG for an index without a journal
+  ERROR_T Checkpoint();
+
+  // Blocks at the end of the disk BTREE_FORMAT_JOURNAL keeps for the
+  // journal, for an index about to be created.  0, the default, takes a
+  // sixteenth of the disk, but at least BTREE_MIN_JOURNAL blocks.
+  void    SetJournalBlocks(const SIZE_T blocks) { journalblocks=blocks; }
+
+  SIZE_T  GetNumCheckpoints() const { return checkpoints; }
+
+  // Inserts that went straight to the rightmost leaf.  Once BTREE_APPEND_RUN
+  // inserts in a row have each had a larger key than the one before,
+  // Insert keeps the rightmost leaf at hand, and a split on the right
+  // edge of the tree leaves the left node full rather than half full.
+  // Not for BTREE_FORMAT_BUFFERED or BTREE_FORMAT_COUNTED indexes.
+  SIZE_T  GetNumAppends() const { return appends; }
+
+  // Blocks copied back from the journal by the last Attach
+  SIZE_T  GetNumRecovered() const { return recovered; }
+
+  // Have Attach(...,false) read the top levels of the tree, so they are
+  // in the buffer cache before the first lookup.  0 turns it off.
+  void    SetWarmStart(const SIZE_T levels) { warmlevels=levels; }
+
+  // Read every node in the top levels of the tree, root first
+  ERROR_T Preload(const SIZE_T levels) const;
+
+  // Make fn available as key order id (BTREE_CMP_CUSTOM and up) to every
+  // index in the process.  It has to be registered before an index
+  // using it is created or attached.
+  static ERROR_T RegisterKeyCompare(const SIZE_T id, BTreeKeyCompareFn fn);
+
+  SIZE_T GetKeyCompare() const { return keycompare; }
+
+  // BTREE_FORMAT_* flags for an index about to be created with
+  // Attach(initblock,true).  An existing index uses the flags it was
+  // created with.
+  void   SetFormat(const SIZE_T flags) { format=flags; }
+
+  SIZE_T GetFormat() const { return format; }
   
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
@@ -148,6 +863,9 @@ public:
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
+  // Each block is read once; subtrees of the root are checked in
+  // parallel.  Returns ERROR_BADCONFIG for a structural problem and
+  // ERROR_INSANE for a bad node type or checksum.
   ERROR_T SanityCheck() const;
 
   // Display tree
@@ -161,6 +879,168 @@ public:
   // per line.  This will be the keys and values in the tree
   // sorted in order of keys.
   ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
+
+  // Build the tree bottom-up from source, which must produce keys in
+  // strictly increasing order.  The index must be empty.  Leaves are
+  // filled to fillpercent of their capacity, but always keep room for
+  // one more insert.
+  // return ERROR_BADCONFIG if the index is not empty or the keys are out
+  // of order, ERROR_SIZE for a wrongly sized key or value
+  ERROR_T BulkLoad(BTreeBulkSource &source, const SIZE_T fillpercent=100);
+
+  // BulkLoad from count pairs in memory, each a key followed by its
+  // value, back to back, on up to threads threads (0 for one a core).
+  // Unless sorted, the pairs are first put in key order, also in
+  // parallel; pairs itself is left as it is.  The ordered pairs are cut
+  // into one run a thread, each building its leaves into blocks of its
+  // own, and the interior levels are built over all of them at the end.
+  // The threads take their blocks from the part of the disk never used;
+  // an index with blocks on its free list, in a catalog or with
+  // snapshots builds on one thread.
+  // return as BulkLoad; ERROR_BADCONFIG also for a key given twice
+  ERROR_T BulkLoadParallel(const char *pairs,
+			   const SIZE_T count,
+			   const SIZE_T threads=0,
+			   const bool sorted=true,
+			   const SIZE_T fillpercent=100);
+
+  // Write all key/value pairs, in key order, as a binary stream.  The
+  // leaves are copied out in large buffered writes.
+  // return ERROR_NOSPACE if the stream fails, ERROR_BADCONFIG if a
+  // BTREE_FORMAT_BUFFERED index has updates that have not been flushed
+  ERROR_T Export(ostream &o) const;
+
+  // Load a stream written by Export into this (empty) index, which must
+  // have the same key size, value size and key order
+  // return ERROR_BADCONFIG if the stream is malformed or does not match
+  ERROR_T Import(istream &i, const SIZE_T fillpercent=100);
+
+  // Take a snapshot of the tree as it is now.  Like Insert and friends,
+  // this must not run at the same time as an update, but once taken,
+  // LookupSnapshot and ScanSnapshot can run alongside updates.
+  // Snapshots last until released or until the index is detached.
+  // return ERROR_NOSPACE if a later update cannot get a block to keep
+  // the snapshot's copy in
+  ERROR_T CreateSnapshot(SIZE_T &snapshot);
+
+  // Blocks kept only for this snapshot are reused by later allocations.
+  // Safe to call alongside updates.
+  // return ERROR_NONEXISTENT if there is no such snapshot
+  ERROR_T ReleaseSnapshot(const SIZE_T snapshot);
+
+  // Same as Lookup, but sees the tree as of the snapshot
+  ERROR_T LookupSnapshot(const SIZE_T snapshot, const KEY_T &key, VALUE_T &value) const;
+
+  // Hands every pair in the snapshot to visitor in key order
+  ERROR_T ScanSnapshot(const SIZE_T snapshot, BTreeScanVisitor &visitor) const;
+
+  // Hands the pairs of the live tree with lo <= key < hi to visitor in
+  // key order.  An empty lo or hi leaves that end open.  Must not run
+  // at the same time as an update.
+  // return ERROR_SIZE for a wrongly sized bound, ERROR_BADCONFIG if a
+  // BTREE_FORMAT_BUFFERED index has updates that have not been flushed
+  ERROR_T ScanRange(const KEY_VIEW_T &lo, const KEY_VIEW_T &hi, BTreeScanVisitor &visitor) const;
+
+  // ScanRange on up to threads threads (0 for one a core).  [lo,hi) is
+  // cut at separator keys from the interior levels into about
+  // BTREE_SCAN_PARTS sub-ranges a thread, which the threads take in
+  // turn.  If ordered, visitor gets the pairs in key order on the
+  // calling thread; a sub-range is held in memory until those before it
+  // have been handed over.  Otherwise the threads call visitor as they
+  // go, at the same time and in no particular order, so it must be
+  // thread safe.  Must not run at the same time as an update.
+  // return as ScanRange
+  ERROR_T ScanRangeParallel(const KEY_VIEW_T &lo,
+			    const KEY_VIEW_T &hi,
+			    BTreeScanVisitor &visitor,
+			    const bool ordered=true,
+			    const SIZE_T threads=0) const;
+
+  // Keep an in-memory Bloom filter for each leaf, sized for a full leaf
+  // at false positive rate fpr, so Lookup, Update and the conflict check
+  // in Insert can skip reading leaves that cannot hold the key.  At most
+  // budget bytes go to filters; leaves past that go without.  A budget
+  // of 0 turns filters off.
+  // return ERROR_BADCONFIG if fpr is not between 0 and 1, or the key
+  // order has equal keys with different bytes (double, custom)
+  ERROR_T SetLeafFilters(const double fpr, const SIZE_T budget);
+
+  // Leaf reads the filters have saved so far
+  SIZE_T  GetNumFilterSkips() const { return filterskips; }
+
+  // Number of unpacked leaves a BTREE_FORMAT_COMPRESS index keeps in
+  // memory
+  void    SetLeafCacheSize(const SIZE_T leaves) { leafcachesize=leaves; }
+
+  // Remember where recently looked up keys live, in a table of entries
+  // slots (rounded up to a power of two), so repeated Lookups and Updates
+  // of hot keys read only their leaf.  0 turns it off.  Not used by a
+  // BTREE_FORMAT_BUFFERED index, whose lookups have to check the buffers
+  // on the way down anyway.
+  ERROR_T SetHashIndex(const SIZE_T entries);
+
+  // Lookups and updates the hash index has sent straight to the leaf
+  SIZE_T  GetNumHashHits() const { return hashfound; }
+
+  // Start Lookup, Update and Insert from the last leaf this thread used
+  // rather than from the root.  A key that leaf does not cover climbs
+  // only as far as the lowest node on the way down to it that does.  A
+  // node's keys change only when it is rewritten, so block versions tell
+  // which are still good.  Each thread has its own finger, for the
+  // indexes it used last.  Not for BTREE_FORMAT_BUFFERED indexes, whose
+  // lookups have to check the buffers on the way down, and Insert goes
+  // from the root in a BTREE_FORMAT_COUNTED one.
+  void    SetFingerSearch(const bool on);
+
+  // Descents that started below the root
+  SIZE_T  GetNumFingerHits() const { return fingerhits.load(std::memory_order_relaxed); }
+
+  // Time each operation, each node on the way down, each block read and
+  // write, split, AddKeyVal and allocation, keeping the last events of
+  // these spans; reads also say whether the buffer cache had the block.
+  // 0 turns it off and drops the spans.  Set it between operations.
+  void    SetTracing(const SIZE_T events);
+
+  // The spans kept, oldest first, as Chrome trace event JSON, for
+  // chrome://tracing or Perfetto
+  ERROR_T DumpTrace(ostream &o) const;
+
+  // Spans since SetTracing, including those the ring no longer holds
+  SIZE_T  GetNumTraceEvents() const;
+
+  // return ERROR_BADCONFIG for interpolation on a non-numeric key order
+  ERROR_T SetSearchMode(const SIZE_T mode);
+
+  SIZE_T  GetSearchMode() const { return searchmode; }
+
+  // Key comparisons made by node searches, for weighing search modes
+  // against each other on a given workload
+  SIZE_T  GetNumSearchCompares() const { return searchcompares.load(std::memory_order_relaxed); }
+
+  void    ResetSearchCompares() { searchcompares.store(0,std::memory_order_relaxed); }
+
+  // Push every update a BTREE_FORMAT_BUFFERED index is holding in its
+  // interior nodes down to the leaves.  Detach and CreateSnapshot do
+  // this, and Export needs it done first.
+  ERROR_T Flush();
+
+  // Order statistics for a BTREE_FORMAT_COUNTED index, each reading one
+  // block per level.  All return ERROR_BADCONFIG for an index without
+  // counts and ERROR_SIZE for a wrongly sized key.
+
+  // Number of keys < key
+  ERROR_T Rank(const KEY_VIEW_T &key, SIZE_T &rank) const;
+
+  // Number of keys with lo <= key < hi.  An empty lo or hi leaves that
+  // end open, so two empty bounds count the whole index.
+  ERROR_T CountRange(const KEY_VIEW_T &lo, const KEY_VIEW_T &hi, SIZE_T &count) const;
+
+  // The pair with rank k, counting from 0
+  // return ERROR_NONEXISTENT if there are k or fewer keys
+  ERROR_T Select(const SIZE_T k, KEY_T &key, VALUE_T &value) const;
+
+  // Number of snapshots ever taken of this index
+  SIZE_T  GetVersion() const { return version; }
   
   ostream & Print(ostream &os) const;
   
@@ -0,0 +1,253 @@
+#include <string.h>
+#include "btree_async.h"
+
+BTreeAsyncIO::BTreeAsyncIO() :
+  running(false), inflight(0)
+{}
+
+BTreeAsyncIO::~BTreeAsyncIO()
+{
+  Stop();
+}
+
+BTreeAsyncIO::FetchAwaiter BTreeAsyncIO::Fetch(const BTreeIndex &index, const SIZE_T blocknum, BTreeNode &node)
+{
+  FetchAwaiter a;
+  a.io=this;
+  a.req.index=&index;
+  a.req.blocknum=blocknum;
+  a.req.node=&node;
+  a.req.rc=ERROR_NOERROR;
+  return a;
+}
+
+void BTreeAsyncIO::Submit(Request *req)
+{
+  std::lock_guard<std::mutex> g(qlock);
+  inflight++;
+  pending.push_back(req);
+  qcond.notify_one();
+}
+
+void BTreeAsyncIO::Service(Request *req)
+{
+  std::lock_guard<std::mutex> g(cachelock);
+  req->rc=req->index->ReadNode(req->blocknum,*req->node);
+}
+
+void BTreeAsyncIO::IOThread()
+{
+  std::unique_lock<std::mutex> g(qlock);
+  while (running) {
+    if (pending.empty()) {
+      qcond.wait(g);
+      continue;
+    }
+    Request *req=pending.front();
+    pending.pop_front();
+    g.unlock();
+    Service(req);
+    g.lock();
+    completed.push_back(req);
+  }
+}
+
+void BTreeAsyncIO::Start()
+{
+  std::lock_guard<std::mutex> g(qlock);
+  if (running) { return; }
+  running=true;
+  iothread=std::thread(&BTreeAsyncIO::IOThread,this);
+}
+
+void BTreeAsyncIO::Stop()
+{
+  {
+    std::lock_guard<std::mutex> g(qlock);
+    if (!running) { return; }
+    running=false;
+    qcond.notify_all();
+  }
+  iothread.join();
+}
+
+SIZE_T BTreeAsyncIO::Poll()
+{
+  std::deque<Request *> ready;
+  {
+    std::unique_lock<std::mutex> g(qlock);
+    if (!running) {
+      // No I/O thread, so do the reads that are queued right now.  Reads
+      // submitted by the coroutines we resume wait for the next Poll().
+      std::deque<Request *> batch;
+      batch.swap(pending);
+      g.unlock();
+      for (SIZE_T i=0;i<batch.size();i++) {
+	Service(batch[i]);
+      }
+      g.lock();
+      completed.insert(completed.end(),batch.begin(),batch.end());
+    }
+    ready.swap(completed);
+    inflight-=ready.size();
+  }
+  for (SIZE_T i=0;i<ready.size();i++) {
+    ready[i]->waiter.resume();
+  }
+  return ready.size();
+}
+
+void BTreeAsyncIO::Drain()
+{
+  while (GetNumPending()>0) {
+    if (Poll()==0) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+SIZE_T BTreeAsyncIO::GetNumPending() const
+{
+  std::lock_guard<std::mutex> g(qlock);
+  return inflight;
+}
+
+
+BTreeAsyncIndex::BTreeAsyncIndex(SIZE_T keysize,
+				 SIZE_T valuesize,
+				 BufferCache *cache,
+				 BTreeAsyncIO *asyncio,
+				 bool unique) :
+  BTreeIndex(keysize,valuesize,cache,unique), io(asyncio), epoch(0)
+{}
+
+BTreeAsyncIndex::~BTreeAsyncIndex()
+{}
+
+
+BTreeTask BTreeAsyncIndex::LookupAsync(const KEY_T key, VALUE_T &value)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T node;
+  SIZE_T offset;
+  SIZE_T start;
+  const char *m;
+
+  if (key.length!=superblock.info.keysize) {
+    co_return ERROR_SIZE;
+  }
+
+ restart:
+  start=epoch;
+  node=superblock.info.rootnode;
+
+  while (1) {
+    rc=co_await io->Fetch(*this,node,b);
+    // An async insert, update or delete that ran while we waited may
+    // have split, merged or freed the nodes on our way down, so node may
+    // no longer hold the keys we came for, or anything at all.  Only a
+    // path with no mutation since the start can be trusted, error and
+    // all.
+    if (epoch!=start) {
+      goto restart;
+    }
+    if (rc) { co_return rc; }
+
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) {
+	co_return ERROR_NONEXISTENT;
+      }
+      // a buffered update for key is newer than the leaf
+      if (FindMessage(b,key.data,offset)) {
+	m=MessageAt(b,offset);
+	if (m[b.info.keysize+b.info.valuesize]==BTREE_OP_DELETE) {
+	  co_return ERROR_NONEXISTENT;
+	}
+	value=VALUE_T(b.info.valuesize);
+	memcpy(value.data,m+b.info.keysize,b.info.valuesize);
+	co_return ERROR_NOERROR;
+      }
+      rc=b.GetPtr(LowerBound(b,key.data),node);
+      if (rc) { co_return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      if (FindKey(b,key.data,offset)) {
+	co_return GetLeafVal(b,offset,value);
+      }
+      co_return ERROR_NONEXISTENT;
+    default:
+      co_return ERROR_INSANE;
+    }
+  }
+}
+
+
+BTreeTask BTreeAsyncIndex::PrefetchPathAsync(const KEY_T key)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T node;
+
+  if (key.length!=superblock.info.keysize) {
+    co_return ERROR_SIZE;
+  }
+  node=superblock.info.rootnode;
+
+  while (1) {
+    rc=co_await io->Fetch(*this,node,b);
+    if (rc) { co_return rc; }
+    if (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) {
+      co_return ERROR_NOERROR;
+    }
+    if (b.info.numkeys==0) {
+      // empty tree, nothing below the root to fault in
+      co_return ERROR_NOERROR;
+    }
+    rc=b.GetPtr(LowerBound(b,key.data),node);
+    if (rc) { co_return rc; }
+  }
+}
+
+
+BTreeTask BTreeAsyncIndex::InsertAsync(const KEY_T key, const VALUE_T value)
+{
+  ERROR_T rc;
+
+  rc=co_await PrefetchPathAsync(key);
+  if (rc) { co_return rc; }
+
+  std::lock_guard<std::mutex> g(io->GetCacheLock());
+  epoch++;
+  co_return Insert(key,value);
+}
+
+
+BTreeTask BTreeAsyncIndex::UpdateAsync(const KEY_T key, const VALUE_T value)
+{
+  ERROR_T rc;
+
+  rc=co_await PrefetchPathAsync(key);
+  if (rc) { co_return rc; }
+
+  std::lock_guard<std::mutex> g(io->GetCacheLock());
+  // a compressed leaf can split, and a buffered update flush messages
+  // down, under a lookup in flight
+  epoch++;
+  co_return Update(key,value);
+}
+
+
+BTreeTask BTreeAsyncIndex::DeleteAsync(const KEY_T key)
+{
+  ERROR_T rc;
+
+  rc=co_await PrefetchPathAsync(key);
+  if (rc) { co_return rc; }
+
+  std::lock_guard<std::mutex> g(io->GetCacheLock());
+  epoch++;
+  co_return Delete(key);
+}
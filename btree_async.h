@@ -0,0 +1,158 @@
+#ifndef _btree_async
+#define _btree_async
+
+// C++20 coroutine front end for BTreeIndex.
+//
+// Every node fetch made by an async operation is handed to a
+// BTreeAsyncIO queue and the coroutine suspends until the block has
+// been read.  The event loop calls Poll() to resume coroutines whose
+// reads have completed, so one thread can keep many index operations
+// in flight.  If Start() is called, the reads themselves are done on a
+// separate I/O thread; otherwise Poll() does them in batches.
+//
+// Requires -std=c++20.  The rest of the index does not.
+
+#include <coroutine>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+
+#include "btree.h"
+
+// The result of an async index operation.  The coroutine starts running
+// immediately and runs until its first node fetch.  It can be awaited
+// from another coroutine, or polled from ordinary code via Done()/Result().
+class BTreeTask {
+ public:
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> handle_type;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(handle_type h) noexcept {
+      std::coroutine_handle<> c=h.promise().continuation;
+      if (c) { return c; }
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  struct promise_type {
+    ERROR_T                 result=ERROR_NOERROR;
+    std::coroutine_handle<> continuation;
+
+    BTreeTask get_return_object() { return BTreeTask(handle_type::from_promise(*this)); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_value(ERROR_T rc) { result=rc; }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  BTreeTask(BTreeTask &&rhs) : h(rhs.h) { rhs.h=nullptr; }
+  BTreeTask(const BTreeTask &rhs) = delete;
+  BTreeTask & operator=(const BTreeTask &rhs) = delete;
+  ~BTreeTask() { if (h) { h.destroy(); } }
+
+  bool    Done() const { return h.done(); }
+  ERROR_T Result() const { return h.promise().result; }
+
+  // awaitable from another coroutine
+  bool    await_ready() const { return h.done(); }
+  void    await_suspend(std::coroutine_handle<> c) { h.promise().continuation=c; }
+  ERROR_T await_resume() const { return h.promise().result; }
+
+ private:
+  explicit BTreeTask(handle_type handle) : h(handle) {}
+  handle_type h;
+};
+
+
+// Queue of outstanding node reads.  Reads go through the index's
+// ReadNode, so checksums are verified as usual.  cachelock keeps each
+// read from interleaving with the synchronous updates done by
+// InsertAsync and friends.
+class BTreeAsyncIO {
+ public:
+  struct Request {
+    const BTreeIndex       *index;
+    SIZE_T                  blocknum;
+    BTreeNode              *node;
+    ERROR_T                 rc;
+    std::coroutine_handle<> waiter;
+  };
+
+  struct FetchAwaiter {
+    BTreeAsyncIO *io;
+    Request       req;
+
+    bool    await_ready() const { return false; }
+    void    await_suspend(std::coroutine_handle<> h) { req.waiter=h; io->Submit(&req); }
+    ERROR_T await_resume() const { return req.rc; }
+  };
+
+  BTreeAsyncIO();
+  virtual ~BTreeAsyncIO();
+
+  // Read blocknum of index into node, suspending the calling coroutine
+  FetchAwaiter Fetch(const BTreeIndex &index, const SIZE_T blocknum, BTreeNode &node);
+
+  // Move reads onto a dedicated I/O thread.  Without this, Poll() does them.
+  void   Start();
+  void   Stop();
+
+  // Resume coroutines whose reads are done.  Returns how many were resumed.
+  SIZE_T Poll();
+
+  // Poll until no reads are outstanding
+  void   Drain();
+
+  SIZE_T GetNumPending() const;
+
+  std::mutex & GetCacheLock() { return cachelock; }
+
+ protected:
+  void   Submit(Request *req);
+  void   Service(Request *req);
+  void   IOThread();
+
+  std::mutex                   cachelock;
+  mutable std::mutex           qlock;
+  std::condition_variable      qcond;
+  std::deque<Request *>        pending;
+  std::deque<Request *>        completed;
+  std::thread                  iothread;
+  bool                         running;
+  SIZE_T                       inflight;   // submitted but not yet resumed
+};
+
+
+class BTreeAsyncIndex : public BTreeIndex {
+ public:
+  BTreeAsyncIndex(SIZE_T keysize,
+		  SIZE_T valuesize,
+		  BufferCache *cache,
+		  BTreeAsyncIO *io,
+		  bool unique=true);
+  virtual ~BTreeAsyncIndex();
+
+  // Same return codes as the synchronous versions.  The key is copied into
+  // the coroutine frame; value must stay alive until the task is done.
+  BTreeTask LookupAsync(const KEY_T key, VALUE_T &value);
+  BTreeTask InsertAsync(const KEY_T key, const VALUE_T value);
+  BTreeTask UpdateAsync(const KEY_T key, const VALUE_T value);
+  BTreeTask DeleteAsync(const KEY_T key);
+
+ protected:
+  // Fault the root-to-leaf path for key into the cache without blocking,
+  // so the synchronous mutation that follows does not miss on the way down
+  BTreeTask PrefetchPathAsync(const KEY_T key);
+
+  BTreeAsyncIO *io;
+  // bumped by every async mutation, so a lookup that raced one can tell
+  // that the nodes it has read may be stale and start again
+  SIZE_T        epoch;
+};
+
+#endif
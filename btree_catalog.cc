@@ -0,0 +1,366 @@
+#include <assert.h>
+#include <string.h>
+#include "btree_catalog.h"
+
+BTreeCatalog::BTreeCatalog(BufferCache *cache) :
+  buffercache(cache), numfree(0), nextfresh(0)
+{
+}
+
+BTreeCatalog::~BTreeCatalog()
+{
+  Detach();
+}
+
+
+ERROR_T BTreeCatalog::WriteHeader()
+{
+  CatalogData d;
+  SIZE_T maxslots=(header.info.GetNumDataBytes()-sizeof(d))/sizeof(SIZE_T);
+
+  assert(superblocks.size()<=maxslots);
+  d.magic=BTREE_CATALOG_MAGIC;
+  d.numfree=numfree;
+  d.numslots=superblocks.size();
+  d.nextfresh=nextfresh;
+  memcpy(header.data,&d,sizeof(d));
+  if (!superblocks.empty()) {
+    memcpy(header.data+sizeof(d),&superblocks[0],superblocks.size()*sizeof(SIZE_T));
+  }
+  std::lock_guard<std::mutex> g(cachelock);
+  return header.Serialize(buffercache,0);
+}
+
+ERROR_T BTreeCatalog::Create()
+{
+  std::lock_guard<std::mutex> g(lock);
+  std::lock_guard<std::mutex> a(alloclock);
+  SIZE_T numblocks=buffercache->GetNumBlocks();
+
+  if (!open.empty()) {
+    return ERROR_BADCONFIG;
+  }
+  header=BTreeNode(BTREE_SUPERBLOCK,0,0,buffercache->GetBlockSize());
+  if (header.info.GetNumDataBytes()<sizeof(CatalogData)+sizeof(SIZE_T)) {
+    return ERROR_BADCONFIG;
+  }
+  header.info.rootnode=0;
+  header.info.freelist=0;
+  header.info.numkeys=0;
+  superblocks.clear();
+  numfree=numblocks>1 ? numblocks-1 : 0;
+  // the rest of the disk is handed out as it is needed, so it is not
+  // written here
+  nextfresh=numblocks>1 ? 1 : 0;
+
+  {
+    std::lock_guard<std::mutex> c(cachelock);
+    buffercache->NotifyAllocateBlock(0);
+  }
+
+  return WriteHeader();
+}
+
+ERROR_T BTreeCatalog::Attach()
+{
+  std::lock_guard<std::mutex> g(lock);
+  std::lock_guard<std::mutex> a(alloclock);
+  BTreeNode b;
+  CatalogData d;
+  ERROR_T rc;
+
+  if (!open.empty()) {
+    return ERROR_BADCONFIG;
+  }
+  // read into b, so a failed attach leaves nothing for Detach to write
+  {
+    std::lock_guard<std::mutex> c(cachelock);
+    rc=b.Unserialize(buffercache,0);
+  }
+  if (rc) {
+    return rc;
+  }
+  if (b.info.nodetype!=BTREE_SUPERBLOCK ||
+      b.info.GetNumDataBytes()<sizeof(d)) {
+    return ERROR_NOTANINDEX;
+  }
+  memcpy(&d,b.data,sizeof(d));
+  if (d.magic!=BTREE_CATALOG_MAGIC ||
+      sizeof(d)+d.numslots*sizeof(SIZE_T)>b.info.GetNumDataBytes()) {
+    return ERROR_NOTANINDEX;
+  }
+  header=b;
+  numfree=d.numfree;
+  nextfresh=d.nextfresh;
+  superblocks.resize(d.numslots);
+  if (d.numslots>0) {
+    memcpy(&superblocks[0],header.data+sizeof(d),d.numslots*sizeof(SIZE_T));
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeCatalog::Detach()
+{
+  std::lock_guard<std::mutex> g(lock);
+  ERROR_T rc=ERROR_NOERROR;
+  ERROR_T r;
+  SIZE_T sb;
+
+  // keep going past a failure, so nothing is left open
+  for (std::map<SIZE_T,BTreeIndex *>::iterator i=open.begin();i!=open.end();++i) {
+    r=i->second->Detach(sb);
+    if (r && !rc) { rc=r; }
+    delete i->second;
+  }
+  open.clear();
+  if (header.data) {
+    std::lock_guard<std::mutex> a(alloclock);
+    r=WriteHeader();
+    if (r && !rc) { rc=r; }
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeCatalog::AllocateBlock(SIZE_T &n)
+{
+  std::lock_guard<std::mutex> a(alloclock);
+  BTreeNode node;
+  ERROR_T rc;
+
+  n=header.info.freelist;
+
+  if (n==0) {
+    // nothing freed to reuse; take a block never used before
+    if (nextfresh==0 || nextfresh>=buffercache->GetNumBlocks()) {
+      return ERROR_NOSPACE;
+    }
+    n=nextfresh++;
+    numfree--;
+    rc=WriteHeader();
+    if (rc) {
+      return rc;
+    }
+    {
+      std::lock_guard<std::mutex> c(cachelock);
+      buffercache->NotifyAllocateBlock(n);
+    }
+    return ERROR_NOERROR;
+  }
+  {
+    std::lock_guard<std::mutex> c(cachelock);
+    rc=node.Unserialize(buffercache,n);
+  }
+  if (rc) {
+    return rc;
+  }
+
+  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+
+  header.info.freelist=node.info.freelist;
+  numfree--;
+  rc=WriteHeader();
+  if (rc) {
+    return rc;
+  }
+  {
+    std::lock_guard<std::mutex> c(cachelock);
+    buffercache->NotifyAllocateBlock(n);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeCatalog::FreeBlock(const SIZE_T n)
+{
+  std::lock_guard<std::mutex> a(alloclock);
+  BTreeNode freed(BTREE_UNALLOCATED_BLOCK,0,0,buffercache->GetBlockSize());
+  ERROR_T rc;
+
+  freed.info.freelist=header.info.freelist;
+  {
+    std::lock_guard<std::mutex> c(cachelock);
+    rc=freed.Serialize(buffercache,n);
+  }
+  if (rc) {
+    return rc;
+  }
+  header.info.freelist=n;
+  numfree++;
+  rc=WriteHeader();
+  if (rc) {
+    return rc;
+  }
+  {
+    std::lock_guard<std::mutex> c(cachelock);
+    buffercache->NotifyDeallocateBlock(n);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeCatalog::FreeTree(BTreeIndex *index, const SIZE_T node)
+{
+  BTreeNode b;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  rc=index->ReadNode(node,b);
+  if (rc) { return rc; }
+  if (b.info.nodetype==BTREE_ROOT_NODE || b.info.nodetype==BTREE_INTERIOR_NODE) {
+    // an empty root has no children at all
+    for (SIZE_T i=0; b.info.numkeys>0 && i<=b.info.numkeys; i++) {
+      rc=b.GetPtr(i,ptr);
+      if (rc) { return rc; }
+      rc=FreeTree(index,ptr);
+      if (rc) { return rc; }
+    }
+  }
+  return FreeBlock(node);
+}
+
+
+BTreeIndex * BTreeCatalog::NewIndex(const SIZE_T keysize,
+				    const SIZE_T valuesize,
+				    const SIZE_T keycompare)
+{
+  BTreeIndex *index=new BTreeIndex(keysize,valuesize,buffercache,true,keycompare);
+
+  index->allocator=this;
+  index->cachelock=&cachelock;
+  return index;
+}
+
+ERROR_T BTreeCatalog::CreateIndex(const SIZE_T keysize,
+				  const SIZE_T valuesize,
+				  SIZE_T &id,
+				  const SIZE_T keycompare,
+				  const SIZE_T format)
+{
+  std::lock_guard<std::mutex> g(lock);
+  SIZE_T sb;
+  SIZE_T root;
+  ERROR_T rc;
+
+  if (!header.data) {
+    return ERROR_BADCONFIG;
+  }
+  for (id=0; id<superblocks.size() && superblocks[id]!=0; id++) {
+  }
+  if (id>=(header.info.GetNumDataBytes()-sizeof(CatalogData))/sizeof(SIZE_T)) {
+    return ERROR_NOSPACE;
+  }
+  rc=AllocateBlock(sb);
+  if (rc) { return rc; }
+  rc=AllocateBlock(root);
+  if (rc) {
+    FreeBlock(sb);
+    return rc;
+  }
+
+  BTreeIndex *index=NewIndex(keysize,valuesize,keycompare);
+  index->SetFormat(format);
+  index->superblock_index=sb;
+  rc=index->WriteEmptyIndex(root,0);
+  if (!rc) {
+    rc=index->Attach(sb,false);
+  }
+  if (rc) {
+    delete index;
+    FreeBlock(root);
+    FreeBlock(sb);
+    return rc;
+  }
+
+  std::lock_guard<std::mutex> a(alloclock);
+  if (id==superblocks.size()) {
+    superblocks.push_back(sb);
+  } else {
+    superblocks[id]=sb;
+  }
+  open[id]=index;
+  return WriteHeader();
+}
+
+ERROR_T BTreeCatalog::OpenIndex(const SIZE_T id, BTreeIndex *&index)
+{
+  std::lock_guard<std::mutex> g(lock);
+  return OpenLocked(id,index);
+}
+
+ERROR_T BTreeCatalog::OpenLocked(const SIZE_T id, BTreeIndex *&index)
+{
+  std::map<SIZE_T,BTreeIndex *>::const_iterator i=open.find(id);
+  BTreeNode sb;
+  ERROR_T rc;
+
+  if (i!=open.end()) {
+    index=i->second;
+    return ERROR_NOERROR;
+  }
+  if (id>=superblocks.size() || superblocks[id]==0) {
+    return ERROR_NONEXISTENT;
+  }
+  // the superblock has the sizes; Attach reads everything else
+  {
+    std::lock_guard<std::mutex> c(cachelock);
+    rc=sb.Unserialize(buffercache,superblocks[id]);
+  }
+  if (rc) {
+    return rc;
+  }
+  if (sb.info.nodetype!=BTREE_SUPERBLOCK) {
+    return ERROR_NOTANINDEX;
+  }
+  index=NewIndex(sb.info.keysize,sb.info.valuesize,BTREE_CMP_BYTES);
+  rc=index->Attach(superblocks[id],false);
+  if (rc) {
+    delete index;
+    return rc;
+  }
+  open[id]=index;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeCatalog::DropIndex(const SIZE_T id)
+{
+  std::lock_guard<std::mutex> g(lock);
+  BTreeIndex *index;
+  SIZE_T sb;
+  ERROR_T rc;
+
+  rc=OpenLocked(id,index);
+  if (rc) { return rc; }
+  // Detach gives back the blocks its snapshots were holding
+  rc=index->Detach(sb);
+  if (rc) { return rc; }
+  open.erase(id);
+  rc=FreeTree(index,index->superblock.info.rootnode);
+  delete index;
+  if (rc) { return rc; }
+  rc=FreeBlock(sb);
+  if (rc) { return rc; }
+
+  std::lock_guard<std::mutex> a(alloclock);
+  superblocks[id]=0;
+  while (!superblocks.empty() && superblocks.back()==0) {
+    superblocks.pop_back();
+  }
+  return WriteHeader();
+}
+
+void BTreeCatalog::GetIndexes(std::vector<SIZE_T> &ids) const
+{
+  std::lock_guard<std::mutex> g(lock);
+
+  ids.clear();
+  for (SIZE_T i=0; i<superblocks.size(); i++) {
+    if (superblocks[i]!=0) {
+      ids.push_back(i);
+    }
+  }
+}
+
+SIZE_T BTreeCatalog::GetNumFreeBlocks() const
+{
+  std::lock_guard<std::mutex> a(alloclock);
+  return numfree;
+}
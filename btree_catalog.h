@@ -0,0 +1,108 @@
+#ifndef _btree_catalog
+#define _btree_catalog
+
+// Many indexes in one disk image, sharing its blocks and its BufferCache.
+//
+// Block 0 holds the catalog: the head of one free list that every index
+// allocates from, falling back to blocks never used, and the superblock
+// of each index by id.  An index
+// opened through the catalog is an ordinary BTreeIndex, except that its
+// AllocateNode and FreeNode come here rather than to a free list of its
+// own, so free blocks, and the cache memory over them, go to whichever
+// index is growing.  The cache is not thread safe, so all the indexes
+// take one lock for block I/O; different indexes may be used from
+// different threads, though each is no more thread safe than before.
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "btree.h"
+
+#define BTREE_CATALOG_MAGIC 0x42544331
+
+// Kept at the start of the catalog block's data, followed by numslots
+// superblock numbers, 0 for an id not in use
+struct CatalogData {
+  SIZE_T magic;
+  SIZE_T numfree;
+  SIZE_T numslots;
+  SIZE_T nextfresh;   // blocks from here up have never been used; 0 if none
+};
+
+class BTreeCatalog : public BTreeBlockAllocator {
+ public:
+  BTreeCatalog(BufferCache *cache);
+  // Detaches any indexes still open
+  virtual ~BTreeCatalog();
+
+  // Make the whole disk an empty catalog
+  ERROR_T Create();
+
+  // Read the catalog of a disk made by Create
+  // return ERROR_NOTANINDEX if block 0 is not a catalog
+  ERROR_T Attach();
+
+  // Detach every open index and write the catalog out
+  ERROR_T Detach();
+
+  // Make a new, empty index and return the id OpenIndex takes for it.
+  // keycompare and format are as for BTreeIndex.  Ids of dropped indexes
+  // are handed out again.
+  // return ERROR_NOSPACE if the disk or the catalog block is full, and
+  // ERROR_BADCONFIG for a format the index rejects
+  ERROR_T CreateIndex(const SIZE_T keysize,
+		      const SIZE_T valuesize,
+		      SIZE_T &id,
+		      const SIZE_T keycompare=BTREE_CMP_BYTES,
+		      const SIZE_T format=0);
+
+  // The index with id, attached on first use.  The catalog owns it, and
+  // it stays valid until DropIndex or Detach.  Detach the catalog, not
+  // the index.
+  // return ERROR_NONEXISTENT if there is no such index
+  ERROR_T OpenIndex(const SIZE_T id, BTreeIndex *&index);
+
+  // Delete index id, giving all its blocks back.  Snapshots of it go too.
+  ERROR_T DropIndex(const SIZE_T id);
+
+  // Ids of the indexes in the catalog
+  void    GetIndexes(std::vector<SIZE_T> &ids) const;
+
+  SIZE_T  GetNumFreeBlocks() const;
+
+ protected:
+  // For the indexes in the catalog.  The caller must not hold cachelock.
+  ERROR_T AllocateBlock(SIZE_T &n);
+  ERROR_T FreeBlock(const SIZE_T n);
+
+  // OpenIndex.  Caller holds lock.
+  ERROR_T OpenLocked(const SIZE_T id, BTreeIndex *&index);
+
+  // Free every block of the tree under node
+  ERROR_T FreeTree(BTreeIndex *index, const SIZE_T node);
+
+  // Write the catalog block.  Caller holds alloclock.
+  ERROR_T WriteHeader();
+
+  // An index on the catalog's cache, allocator and lock, not yet attached
+  BTreeIndex * NewIndex(const SIZE_T keysize,
+			const SIZE_T valuesize,
+			const SIZE_T keycompare);
+
+  BufferCache *buffercache;
+
+  // lock covers the ids and open indexes.  alloclock covers the free
+  // list and the catalog block, and is taken inside lock and the
+  // indexes' own locks.  cachelock is the indexes' block I/O lock.
+  mutable std::mutex           lock;
+  mutable std::mutex           alloclock;
+  std::mutex                   cachelock;
+  BTreeNode                    header;
+  SIZE_T                       numfree;
+  SIZE_T                       nextfresh;
+  std::vector<SIZE_T>          superblocks;   // by id, 0 if not in use
+  std::map<SIZE_T,BTreeIndex *> open;
+};
+
+#endif
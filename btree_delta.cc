@@ -0,0 +1,321 @@
+#include <string.h>
+#include "btree_delta.h"
+
+// What one entry is charged against the memory budget, map node included
+static SIZE_T EntryBytes(const std::string &key, const SIZE_T valuesize)
+{
+  return key.size()+valuesize+64;
+}
+
+BTreeDelta::BTreeDelta(BTreeIndex *idx, const SIZE_T bytes, const SIZE_T batchsize) :
+  index(idx), maxbytes(bytes), batch(batchsize),
+  active(KeyOrder{idx}), frozen(KeyOrder{idx}),
+  activebytes(0), merging(false), running(false),
+  mergeerror(ERROR_NOERROR), stalls(0)
+{
+  if (batch==0) {
+    batch=1;
+  }
+}
+
+BTreeDelta::~BTreeDelta()
+{
+  Stop();
+  Sync();
+}
+
+
+bool BTreeDelta::FindEntry(const std::string &key, Entry &e) const
+{
+  Table::const_iterator i=active.find(key);
+
+  if (i!=active.end()) {
+    e=i->second;
+    return true;
+  }
+  i=frozen.find(key);
+  if (i!=frozen.end()) {
+    e=i->second;
+    // by the time anything in active is merged, frozen will be in the tree
+    e.intree=!e.deleted;
+    return true;
+  }
+  return false;
+}
+
+ERROR_T BTreeDelta::Exists(const std::string &key, const KEY_T &k, bool &intree)
+{
+  Entry e;
+  ERROR_T rc;
+
+  if (FindEntry(key,e)) {
+    intree=e.intree;
+    return e.deleted ? ERROR_NONEXISTENT : ERROR_NOERROR;
+  }
+  std::lock_guard<std::mutex> t(treelock);
+  rc=index->ConstLookup(index->superblock.info.rootnode,k);
+  intree=(rc==ERROR_NOERROR);
+  return rc;
+}
+
+
+ERROR_T BTreeDelta::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  std::unique_lock<std::mutex> g(lock);
+  std::string k(key.data,key.length);
+  Entry e;
+  ERROR_T rc;
+
+  if (key.length!=index->superblock.info.keysize ||
+      value.length!=index->superblock.info.valuesize) {
+    return ERROR_SIZE;
+  }
+  rc=Exists(k,key,e.intree);
+  if (rc==ERROR_NOERROR) {
+    return ERROR_CONFLICT;
+  }
+  if (rc!=ERROR_NONEXISTENT) {
+    return rc;
+  }
+  e.deleted=false;
+  e.value=value;
+  return Put(g,k,e);
+}
+
+ERROR_T BTreeDelta::Update(const KEY_T &key, const VALUE_T &value)
+{
+  std::unique_lock<std::mutex> g(lock);
+  std::string k(key.data,key.length);
+  Entry e;
+  ERROR_T rc;
+
+  if (key.length!=index->superblock.info.keysize ||
+      value.length!=index->superblock.info.valuesize) {
+    return ERROR_SIZE;
+  }
+  rc=Exists(k,key,e.intree);
+  if (rc) {
+    return rc;
+  }
+  e.deleted=false;
+  e.value=value;
+  return Put(g,k,e);
+}
+
+ERROR_T BTreeDelta::Delete(const KEY_T &key)
+{
+  std::unique_lock<std::mutex> g(lock);
+  std::string k(key.data,key.length);
+  Entry e;
+  ERROR_T rc;
+
+  if (key.length!=index->superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+  rc=Exists(k,key,e.intree);
+  if (rc) {
+    return rc;
+  }
+  if (!e.intree) {
+    // only ever lived in active; nothing to tell the tree
+    active.erase(k);
+    activebytes-=EntryBytes(k,index->superblock.info.valuesize);
+    return ERROR_NOERROR;
+  }
+  e.deleted=true;
+  return Put(g,k,e);
+}
+
+ERROR_T BTreeDelta::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  std::unique_lock<std::mutex> g(lock);
+  std::string k(key.data,key.length);
+  Entry e;
+
+  if (key.length!=index->superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+  if (FindEntry(k,e)) {
+    if (e.deleted) {
+      return ERROR_NONEXISTENT;
+    }
+    value=e.value;
+    return ERROR_NOERROR;
+  }
+  // Anything written to the tables from here on is newer than this
+  // lookup, so the tables can be let go before reading the tree
+  g.unlock();
+  std::lock_guard<std::mutex> t(treelock);
+  return index->Lookup(key,value);
+}
+
+
+ERROR_T BTreeDelta::Put(std::unique_lock<std::mutex> &g,
+			const std::string &key,
+			const Entry &e)
+{
+  SIZE_T bytes=EntryBytes(key,index->superblock.info.valuesize);
+  Table::iterator i=active.find(key);
+  ERROR_T rc;
+
+  if (i!=active.end()) {
+    // keep what the tree had before this table first touched the key
+    bool intree=i->second.intree;
+    i->second=e;
+    i->second.intree=intree;
+    return ERROR_NOERROR;
+  }
+  if (activebytes+bytes>maxbytes/2 && !active.empty()) {
+    rc=Freeze(g);
+    if (rc) { return rc; }
+  }
+  active.insert(std::make_pair(key,e));
+  activebytes+=bytes;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeDelta::Drain(std::unique_lock<std::mutex> &g)
+{
+  ERROR_T rc;
+
+  while (!frozen.empty() || merging) {
+    if (mergeerror) {
+      // report it once; the merge picks up where it failed next time
+      rc=mergeerror;
+      mergeerror=ERROR_NOERROR;
+      cond.notify_all();
+      return rc;
+    }
+    if (running || merging) {
+      cond.wait(g);
+      continue;
+    }
+    merging=true;
+    g.unlock();
+    rc=MergeFrozen();
+    g.lock();
+    merging=false;
+    cond.notify_all();
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeDelta::Freeze(std::unique_lock<std::mutex> &g)
+{
+  ERROR_T rc;
+
+  if (!frozen.empty() || merging) {
+    // the last table is still on its way into the tree
+    stalls++;
+    rc=Drain(g);
+    if (rc) { return rc; }
+  }
+  frozen.swap(active);
+  activebytes=0;
+  if (running) {
+    cond.notify_all();
+    return ERROR_NOERROR;
+  }
+  return Drain(g);
+}
+
+ERROR_T BTreeDelta::MergeFrozen()
+{
+  SIZE_T keysize=index->superblock.info.keysize;
+  KEY_T k(keysize);
+  ERROR_T rc=ERROR_NOERROR;
+
+  // Nothing else changes frozen while it is being merged, so it can be
+  // walked without lock; only taking entries out needs it, since
+  // lookups read frozen under lock
+  while (!frozen.empty()) {
+    Table::iterator first=frozen.begin();
+    Table::iterator i=first;
+    {
+      std::lock_guard<std::mutex> t(treelock);
+      for (SIZE_T n=0; i!=frozen.end() && n<batch; ++i, n++) {
+	const Entry &e=i->second;
+	memcpy(k.data,i->first.data(),keysize);
+	if (e.deleted) {
+	  rc=index->Delete(k);
+	  if (rc==ERROR_NONEXISTENT) { rc=ERROR_NOERROR; }
+	} else if (e.intree) {
+	  rc=index->Update(k,e.value);
+	  if (rc==ERROR_NONEXISTENT) { rc=index->Insert(k,e.value); }
+	} else {
+	  rc=index->Insert(k,e.value);
+	  if (rc==ERROR_CONFLICT) { rc=index->Update(k,e.value); }
+	}
+	if (rc) { break; }
+      }
+    }
+    std::lock_guard<std::mutex> g(lock);
+    frozen.erase(first,i);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+void BTreeDelta::MergeThread()
+{
+  std::unique_lock<std::mutex> g(lock);
+  ERROR_T rc;
+
+  while (running) {
+    if (frozen.empty() || merging || mergeerror) {
+      cond.wait(g);
+      continue;
+    }
+    merging=true;
+    g.unlock();
+    rc=MergeFrozen();
+    g.lock();
+    merging=false;
+    if (rc) {
+      mergeerror=rc;
+    }
+    cond.notify_all();
+  }
+}
+
+
+ERROR_T BTreeDelta::Sync()
+{
+  std::unique_lock<std::mutex> g(lock);
+  ERROR_T rc;
+
+  rc=Drain(g);
+  if (rc) { return rc; }
+  if (!active.empty()) {
+    frozen.swap(active);
+    activebytes=0;
+    cond.notify_all();
+  }
+  return Drain(g);
+}
+
+void BTreeDelta::Start()
+{
+  std::lock_guard<std::mutex> g(lock);
+  if (running) { return; }
+  running=true;
+  merger=std::thread(&BTreeDelta::MergeThread,this);
+}
+
+void BTreeDelta::Stop()
+{
+  {
+    std::lock_guard<std::mutex> g(lock);
+    if (!running) { return; }
+    running=false;
+    cond.notify_all();
+  }
+  merger.join();
+}
+
+SIZE_T BTreeDelta::GetNumPending() const
+{
+  std::lock_guard<std::mutex> g(lock);
+  return active.size()+frozen.size();
+}
@@ -0,0 +1,121 @@
+#ifndef _btree_delta
+#define _btree_delta
+
+// In-memory delta store (memtable) in front of a BTreeIndex.
+//
+// Insert, Update and Delete land in a sorted in-memory table and return
+// without touching the tree's blocks; Lookup checks the table before the
+// tree.  Once the table reaches half of its memory budget it is frozen
+// and merged into the tree in key order while a fresh table takes new
+// writes.  With Start() the merge runs on a background thread, in
+// batches, so lookups of the tree get in between; otherwise the write
+// that fills the table does it.  A write that finds the fresh table full
+// too waits for the merge to finish, so memory stays within the budget.
+//
+// The index must not be used directly while a BTreeDelta is in front of
+// it.  Sync() leaves everything in the tree.
+
+#include <map>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "btree.h"
+
+#define BTREE_DELTA_DEFAULT_BYTES (4*1024*1024)
+#define BTREE_DELTA_DEFAULT_BATCH 256
+
+class BTreeDelta {
+ public:
+  BTreeDelta(BTreeIndex *index,
+	     const SIZE_T maxbytes=BTREE_DELTA_DEFAULT_BYTES,
+	     const SIZE_T batch=BTREE_DELTA_DEFAULT_BATCH);
+  // Stops the merge thread and syncs
+  virtual ~BTreeDelta();
+
+  // Same return codes as the BTreeIndex calls, plus any error the last
+  // merge into the tree ran into
+  ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Delete(const KEY_T &key);
+  ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+
+  // Merge everything held in memory into the tree and wait for it
+  ERROR_T Sync();
+
+  // Merge on a background thread.  Without this, writes merge inline.
+  void    Start();
+  void    Stop();
+
+  // Writes held in memory, not yet in the tree
+  SIZE_T  GetNumPending() const;
+
+  // Times a write had to wait for a merge to make room
+  SIZE_T  GetNumStalls() const { return stalls; }
+
+ protected:
+  // The newest change to one key.  intree records whether the key was in
+  // the tree before this table first touched it, so an insert and a
+  // delete of a new key cancel out without a trip to the tree.
+  struct Entry {
+    bool    deleted;
+    bool    intree;
+    VALUE_T value;
+  };
+
+  struct KeyOrder {
+    const BTreeIndex *index;
+    bool operator()(const std::string &lhs, const std::string &rhs) const
+    { return index->CompareKeys(lhs.data(),rhs.data())<0; }
+  };
+
+  typedef std::map<std::string,Entry,KeyOrder> Table;
+
+  // Latest state of key in the tables, or false if neither has it.
+  // Caller holds lock.
+  bool    FindEntry(const std::string &key, Entry &e) const;
+
+  // Is key in the tree or tables?  Caller holds lock.
+  ERROR_T Exists(const std::string &key, const KEY_T &k, bool &intree);
+
+  // Record a change in the active table, freezing it first if it is
+  // full.  Caller holds lock, which may be dropped while waiting.
+  ERROR_T Put(std::unique_lock<std::mutex> &g,
+	      const std::string &key,
+	      const Entry &e);
+
+  // Wait until the frozen table is in the tree, merging it here if no
+  // thread is running.  Caller holds lock.
+  ERROR_T Drain(std::unique_lock<std::mutex> &g);
+
+  // Freeze the active table, waiting for or doing the merge of the last
+  // frozen one first.  Caller holds lock.
+  ERROR_T Freeze(std::unique_lock<std::mutex> &g);
+
+  // Apply the frozen table to the tree, batch entries at a time under
+  // treelock.  Must not hold lock.
+  ERROR_T MergeFrozen();
+
+  void    MergeThread();
+
+  BTreeIndex             *index;
+  SIZE_T                  maxbytes;
+  SIZE_T                  batch;
+
+  // lock covers the tables and the state below; treelock covers the
+  // tree.  lock is always taken first.
+  mutable std::mutex      lock;
+  std::mutex              treelock;
+  std::condition_variable cond;
+  Table                   active;
+  Table                   frozen;
+  SIZE_T                  activebytes;
+  bool                    merging;     // frozen is being merged
+  bool                    running;
+  ERROR_T                 mergeerror;
+  SIZE_T                  stalls;
+  std::thread             merger;
+};
+
+#endif
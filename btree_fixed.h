@@ -0,0 +1,269 @@
+#ifndef _btree_fixed
+#define _btree_fixed
+
+#include <string.h>
+#include <vector>
+
+#include "btree.h"
+
+// BTreeIndexT is a BTreeIndex whose key and value widths are known at
+// compile time.  It reads and writes exactly the same on-disk format, so
+// an index created by one can be attached by the other.  Lookup, Update
+// and Insert are reimplemented so that slot offsets, memmove sizes and key
+// comparisons are all constants the compiler can unroll; everything else
+// (Delete, Display, SanityCheck, splitting) is inherited.
+//
+// Compare must provide
+//   static const SIZE_T KeyCompare;   // the BTreeKeyCompare it implements
+//   static int Compare(const char *lhs, const char *rhs);
+// with Compare returning <0, 0, >0 like memcmp.  Attach checks KeyCompare
+// against the order recorded in the superblock.
+
+template <SIZE_T KeySize>
+struct BTreeBytewiseCompare {
+  static const SIZE_T KeyCompare=BTREE_CMP_BYTES;
+  static int Compare(const char *lhs, const char *rhs) { return memcmp(lhs,rhs,KeySize); }
+};
+
+template <typename T, SIZE_T Type>
+struct BTreeNumericCompare {
+  static const SIZE_T KeyCompare=Type;
+  static int Compare(const char *lhs, const char *rhs)
+  {
+    T l;
+    T r;
+    memcpy(&l,lhs,sizeof(T));
+    memcpy(&r,rhs,sizeof(T));
+    return (l<r) ? -1 : (r<l) ? 1 : 0;
+  }
+};
+
+typedef BTreeNumericCompare<unsigned long long,BTREE_CMP_UINT64> BTreeUInt64Compare;
+typedef BTreeNumericCompare<long long,BTREE_CMP_INT64>           BTreeInt64Compare;
+typedef BTreeNumericCompare<double,BTREE_CMP_DOUBLE>             BTreeDoubleCompare;
+
+
+template <SIZE_T KeySize, SIZE_T ValueSize, class Compare=BTreeBytewiseCompare<KeySize> >
+class BTreeIndexT : public BTreeIndex {
+ public:
+  BTreeIndexT(BufferCache *cache, bool unique=true) :
+    BTreeIndex(KeySize,ValueSize,cache,unique,Compare::KeyCompare)
+  {}
+
+  // Fails with ERROR_SIZE if an existing index has different widths, and
+  // with ERROR_BADCONFIG if it was built with a different key order or
+  // with the split leaf layout or leaf compression, which have no fixed
+  // key/value stride, with buffered updates, which its lookups would
+  // not see, with subtree counts, which its inserts do not keep, or with
+  // a journal, which its inserts do not make room in
+  ERROR_T Attach(const SIZE_T initblock, const bool create=false)
+  {
+    ERROR_T rc=BTreeIndex::Attach(initblock,create);
+    if (rc) { return rc; }
+    if (superblock.info.keysize!=KeySize || superblock.info.valuesize!=ValueSize) {
+      return ERROR_SIZE;
+    }
+    if (GetKeyCompare()!=Compare::KeyCompare || (GetFormat()&(BTREE_FORMAT_SPLITLEAF|BTREE_FORMAT_COMPRESS|BTREE_FORMAT_BUFFERED|BTREE_FORMAT_COUNTED|BTREE_FORMAT_JOURNAL))) {
+      return ERROR_BADCONFIG;
+    }
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T Lookup(const KEY_T &key, VALUE_T &value)
+  {
+    BTreeNode b;
+    SIZE_T slot;
+    ERROR_T rc;
+
+    if (key.length!=KeySize) { return ERROR_SIZE; }
+
+    rc=DescendToLeaf(key.data,b,0);
+    if (rc) { return rc; }
+    if (!FindInLeaf(b,key.data,slot)) {
+      return ERROR_NONEXISTENT;
+    }
+    value=VALUE_T(ValueSize);
+    memcpy(value.data,LeafKey(b,slot)+KeySize,ValueSize);
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T Update(const KEY_T &key, const VALUE_T &value)
+  {
+    std::vector<SIZE_T> path;
+    BTreeNode b;
+    SIZE_T slot;
+    ERROR_T rc;
+
+    if (key.length!=KeySize || value.length!=ValueSize) { return ERROR_SIZE; }
+
+    rc=DescendToLeaf(key.data,b,&path);
+    if (rc) { return rc; }
+    if (!FindInLeaf(b,key.data,slot)) {
+      return ERROR_NONEXISTENT;
+    }
+    memcpy(LeafKey(b,slot)+KeySize,value.data,ValueSize);
+    return WriteNode(path.back(),b);
+  }
+
+  ERROR_T Insert(const KEY_T &key, const VALUE_T &value)
+  {
+    std::vector<SIZE_T> path;
+    std::vector<SIZE_T> offsets;
+    BTreeNode b;
+    BTreeNode parent;
+    SIZE_T slot;
+    SIZE_T level;
+    SIZE_T secondNode;
+    KEY_T promotedKey;
+    ERROR_T rc;
+
+    if (key.length!=KeySize || value.length!=ValueSize) { return ERROR_SIZE; }
+
+    rc=ReadNode(superblock.info.rootnode,b);
+    if (rc) { return rc; }
+    if (b.info.numkeys==0) {
+      // The first insert builds the initial leaves; leave that to the base
+      return BTreeIndex::Insert(key,value);
+    }
+
+    rc=DescendToLeaf(key.data,b,&path,&offsets);
+    if (rc) { return rc; }
+    if (FindInLeaf(b,key.data,slot)) {
+      return ERROR_CONFLICT;
+    }
+
+    // slot is where the key belongs; open up the gap and drop it in
+    char *p=LeafKey(b,slot);
+    memmove(p+LeafPair,p,(b.info.numkeys-slot)*LeafPair);
+    memcpy(p,key.data,KeySize);
+    memcpy(p+KeySize,value.data,ValueSize);
+    b.info.numkeys++;
+    rc=WriteNode(path.back(),b);
+    if (rc) { return rc; }
+    bool full=(b.info.numkeys==NumSlots(b));
+
+    // Walk back up, splitting full children into their parents
+    for (level=path.size()-1; full && level>0; level--) {
+      if (path.size()==2) {
+	// same evening out of the leaves under a one-key root as the base
+	// Insert does
+	rc=ReadNode(path[0],parent);
+	if (rc) { return rc; }
+	if (parent.info.numkeys==1) {
+	  rc=RebalanceChild(parent,offsets[0]);
+	  if (rc) { return rc; }
+	  rc=WriteNode(path[0],parent);
+	  if (rc) { return rc; }
+	  rc=ReadNode(path[1],b);
+	  if (rc) { return rc; }
+	  full=(b.info.numkeys==NumSlots(b));
+	  if (!full) { break; }
+	}
+      }
+      rc=SplitNode(path[level],secondNode,promotedKey);
+      if (rc) { return rc; }
+      rc=ReadNode(path[level-1],parent);
+      if (rc) { return rc; }
+      InsertSeparator(parent,offsets[level-1],promotedKey.data,secondNode);
+      rc=WriteNode(path[level-1],parent);
+      if (rc) { return rc; }
+      full=(parent.info.numkeys==NumSlots(parent));
+    }
+    if (full) {
+      return SplitRoot();
+    }
+    return ERROR_NOERROR;
+  }
+
+ protected:
+  static const SIZE_T LeafPair=KeySize+ValueSize;
+  static const SIZE_T InteriorPair=KeySize+sizeof(SIZE_T);
+
+  // Slots are laid out at a fixed stride from the first key, so only the
+  // base address has to come from the node
+  static char * LeafKey(const BTreeNode &b, const SIZE_T offset)
+  {
+    return b.ResolveKey(0)+offset*LeafPair;
+  }
+
+  static char * InteriorKey(const BTreeNode &b, const SIZE_T offset)
+  {
+    return b.ResolveKey(0)+offset*InteriorPair;
+  }
+
+  // First slot whose key is >= key, i.e. the child to follow in an
+  // interior node, or the insertion point in a leaf
+  static SIZE_T LowerBound(const char *base, const SIZE_T stride, const SIZE_T numkeys, const char *key)
+  {
+    SIZE_T lo=0;
+    SIZE_T hi=numkeys;
+    while (lo<hi) {
+      SIZE_T mid=(lo+hi)/2;
+      if (Compare::Compare(base+mid*stride,key)<0) {
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    return lo;
+  }
+
+  static bool FindInLeaf(const BTreeNode &b, const char *key, SIZE_T &slot)
+  {
+    slot=LowerBound(LeafKey(b,0),LeafPair,b.info.numkeys,key);
+    return slot<b.info.numkeys && Compare::Compare(LeafKey(b,slot),key)==0;
+  }
+
+  // Reads nodes from the root down to the leaf that would hold key,
+  // leaving the leaf in b.  path gets every node visited and offsets the
+  // child slot taken at each interior node.
+  ERROR_T DescendToLeaf(const char *key,
+			BTreeNode &b,
+			std::vector<SIZE_T> *path,
+			std::vector<SIZE_T> *offsets=0)
+  {
+    SIZE_T node=superblock.info.rootnode;
+    SIZE_T offset;
+    SIZE_T ptr;
+    ERROR_T rc;
+
+    while (1) {
+      rc=ReadNode(node,b);
+      if (rc) { return rc; }
+      if (path) { path->push_back(node); }
+      switch (b.info.nodetype) {
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (b.info.numkeys==0) {
+	  return ERROR_NONEXISTENT;
+	}
+	offset=LowerBound(InteriorKey(b,0),InteriorPair,b.info.numkeys,key);
+	if (offsets) { offsets->push_back(offset); }
+	memcpy(&ptr,b.ResolvePtr(offset),sizeof(SIZE_T));
+	node=ptr;
+	// a lookup can stop here if the leaf's filter rules the key out
+	if (!path && LeafFilterExcludes(node,key)) {
+	  return ERROR_NONEXISTENT;
+	}
+	break;
+      case BTREE_LEAF_NODE:
+	return ERROR_NOERROR;
+      default:
+	return ERROR_INSANE;
+      }
+    }
+  }
+
+  // Same shift AddKeyVal does for interior nodes: the promoted key goes
+  // in at offset and the new right sibling becomes pointer offset+1
+  static void InsertSeparator(BTreeNode &b, const SIZE_T offset, const char *key, const SIZE_T newNode)
+  {
+    char *p=InteriorKey(b,offset);
+    memmove(p+InteriorPair,p,(b.info.numkeys-offset)*InteriorPair);
+    memcpy(p,key,KeySize);
+    memcpy(p+KeySize,&newNode,sizeof(SIZE_T));
+    b.info.numkeys++;
+  }
+};
+
+#endif
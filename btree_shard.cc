@@ -0,0 +1,445 @@
+#include <string.h>
+#include <thread>
+#include "btree_shard.h"
+
+// Holds the pairs a scan visits, packed key then value, until they can
+// be handed on in order
+struct ShardScanBuffer : public BTreeScanVisitor {
+  std::vector<char> pairs;
+  SIZE_T            count;
+  ERROR_T           rc;
+
+  ShardScanBuffer() : count(0), rc(ERROR_NOERROR) {}
+
+  ERROR_T Visit(const KEY_VIEW_T &key, const VALUE_VIEW_T &value)
+  {
+    pairs.insert(pairs.end(),key.data,key.data+key.length);
+    pairs.insert(pairs.end(),value.data,value.data+value.length);
+    count++;
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T Replay(const SIZE_T keysize, const SIZE_T valuesize, BTreeScanVisitor &visitor) const
+  {
+    ERROR_T r;
+    for (SIZE_T i=0;i<count;i++) {
+      const char *p=&pairs[i*(keysize+valuesize)];
+      r=visitor.Visit(KEY_VIEW_T(p,keysize),VALUE_VIEW_T(p+keysize,valuesize));
+      if (r) { return r; }
+    }
+    return ERROR_NOERROR;
+  }
+};
+
+// Counts pairs, keeping those from the skip'th on
+struct ShardSplitVisitor : public ShardScanBuffer {
+  SIZE_T skip;
+  SIZE_T seen;
+
+  ShardSplitVisitor(const SIZE_T s) : skip(s), seen(0) {}
+
+  ERROR_T Visit(const KEY_VIEW_T &key, const VALUE_VIEW_T &value)
+  {
+    if (seen++<skip) {
+      return ERROR_NOERROR;
+    }
+    return ShardScanBuffer::Visit(key,value);
+  }
+};
+
+// Feeds the pairs held by a ShardScanBuffer to BulkLoad
+struct ShardBulkSource : public BTreeBulkSource {
+  const ShardScanBuffer &buf;
+  SIZE_T                 keysize;
+  SIZE_T                 valuesize;
+  SIZE_T                 next;
+
+  ShardBulkSource(const ShardScanBuffer &b, const SIZE_T k, const SIZE_T v) :
+    buf(b), keysize(k), valuesize(v), next(0) {}
+
+  ERROR_T Next(KEY_VIEW_T &key, VALUE_VIEW_T &value)
+  {
+    if (next==buf.count) {
+      return ERROR_NONEXISTENT;
+    }
+    const char *p=&buf.pairs[next*(keysize+valuesize)];
+    key=KEY_VIEW_T(p,keysize);
+    value=VALUE_VIEW_T(p+keysize,valuesize);
+    next++;
+    return ERROR_NOERROR;
+  }
+};
+
+// Scan one shard's part of a range into buf
+static void ScanShard(BTreeIndex *index,
+		      std::mutex *lock,
+		      const KEY_VIEW_T lo,
+		      const KEY_VIEW_T hi,
+		      BTreeScanVisitor *buf,
+		      ERROR_T *rc)
+{
+  std::lock_guard<std::mutex> g(*lock);
+  if (index->GetFormat()&BTREE_FORMAT_BUFFERED) {
+    *rc=index->Flush();
+    if (*rc) { return; }
+  }
+  *rc=index->ScanRange(lo,hi,*buf);
+}
+
+
+BTreeShardedIndex::BTreeShardedIndex(SIZE_T ks, SIZE_T vs, SIZE_T cmp) :
+  keysize(ks), valuesize(vs), keycompare(cmp)
+{}
+
+BTreeShardedIndex::~BTreeShardedIndex()
+{
+  Clear();
+}
+
+void BTreeShardedIndex::Clear()
+{
+  for (SIZE_T i=0;i<shards.size();i++) {
+    delete shards[i]->index;
+    delete shards[i];
+  }
+  shards.clear();
+}
+
+void BTreeShardedIndex::AddShard(BTreeIndex *index, BufferCache *cache, const KEY_T *lower)
+{
+  Shard *s=new Shard;
+  s->index=index;
+  s->cache=cache;
+  if (lower) {
+    s->lower=*lower;
+  }
+  s->ops=0;
+  shards.push_back(s);
+}
+
+ERROR_T BTreeShardedIndex::CheckBounds(const std::vector<BufferCache *> &caches,
+				       const std::vector<KEY_T> &bounds) const
+{
+  if (caches.empty() || bounds.size()!=caches.size()-1) {
+    return ERROR_BADCONFIG;
+  }
+  for (SIZE_T i=0;i<bounds.size();i++) {
+    if (bounds[i].length!=keysize) {
+      return ERROR_SIZE;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeShardedIndex::Create(const std::vector<BufferCache *> &caches,
+				  const std::vector<KEY_T> &bounds,
+				  const SIZE_T format)
+{
+  std::unique_lock<std::shared_mutex> t(tablelock);
+  ERROR_T rc;
+
+  rc=CheckBounds(caches,bounds);
+  if (rc) { return rc; }
+  Clear();
+  for (SIZE_T i=0;i<caches.size();i++) {
+    BTreeIndex *index=new BTreeIndex(keysize,valuesize,caches[i],true,keycompare);
+    index->SetFormat(format);
+    rc=index->Attach(0,true);
+    if (rc) {
+      delete index;
+      Clear();
+      return rc;
+    }
+    AddShard(index,caches[i],i>0 ? &bounds[i-1] : 0);
+    // the key order is only known once the first shard is attached
+    if (i>1 && CompareKeys(shards[i-1]->lower.data,shards[i]->lower.data)>=0) {
+      Clear();
+      return ERROR_BADCONFIG;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeShardedIndex::Attach(const std::vector<BufferCache *> &caches,
+				  const std::vector<SIZE_T> &initblocks,
+				  const std::vector<KEY_T> &bounds)
+{
+  std::unique_lock<std::shared_mutex> t(tablelock);
+  ERROR_T rc;
+
+  rc=CheckBounds(caches,bounds);
+  if (rc) { return rc; }
+  if (initblocks.size()!=caches.size()) {
+    return ERROR_BADCONFIG;
+  }
+  Clear();
+  for (SIZE_T i=0;i<caches.size();i++) {
+    BTreeIndex *index=new BTreeIndex(0,0,caches[i],true);
+    rc=index->Attach(initblocks[i],false);
+    if (!rc && (index->superblock.info.keysize!=keysize ||
+		index->superblock.info.valuesize!=valuesize)) {
+      rc=ERROR_SIZE;
+    }
+    if (!rc && index->GetKeyCompare()!=keycompare) {
+      rc=ERROR_BADCONFIG;
+    }
+    if (rc) {
+      delete index;
+      Clear();
+      return rc;
+    }
+    AddShard(index,caches[i],i>0 ? &bounds[i-1] : 0);
+    if (i>1 && CompareKeys(shards[i-1]->lower.data,shards[i]->lower.data)>=0) {
+      Clear();
+      return ERROR_BADCONFIG;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeShardedIndex::Detach(std::vector<BufferCache *> &caches,
+				  std::vector<SIZE_T> &initblocks,
+				  std::vector<KEY_T> &bounds)
+{
+  std::unique_lock<std::shared_mutex> t(tablelock);
+  ERROR_T rc;
+
+  caches.clear();
+  initblocks.clear();
+  bounds.clear();
+  for (SIZE_T i=0;i<shards.size();i++) {
+    SIZE_T initblock;
+    rc=shards[i]->index->Detach(initblock);
+    if (rc) { return rc; }
+    caches.push_back(shards[i]->cache);
+    initblocks.push_back(initblock);
+    if (i>0) {
+      bounds.push_back(shards[i]->lower);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeShardedIndex::Route(const char *key) const
+{
+  // last shard whose lower bound is <= key; shard 0 has no bound
+  SIZE_T lo=1;
+  SIZE_T hi=shards.size();
+  while (lo<hi) {
+    SIZE_T mid=(lo+hi)/2;
+    if (CompareKeys(shards[mid]->lower.data,key)<=0) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo-1;
+}
+
+ERROR_T BTreeShardedIndex::ShardFor(const KEY_T &key, Shard *&s) const
+{
+  if (shards.empty()) {
+    return ERROR_NOTANINDEX;
+  }
+  if (key.length!=keysize) {
+    return ERROR_SIZE;
+  }
+  s=shards[Route(key.data)];
+  s->ops++;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeShardedIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  std::shared_lock<std::shared_mutex> t(tablelock);
+  Shard *s;
+  ERROR_T rc;
+
+  rc=ShardFor(key,s);
+  if (rc) { return rc; }
+  std::lock_guard<std::mutex> g(s->lock);
+  return s->index->Insert(key,value);
+}
+
+ERROR_T BTreeShardedIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  std::shared_lock<std::shared_mutex> t(tablelock);
+  Shard *s;
+  ERROR_T rc;
+
+  rc=ShardFor(key,s);
+  if (rc) { return rc; }
+  std::lock_guard<std::mutex> g(s->lock);
+  return s->index->Update(key,value);
+}
+
+ERROR_T BTreeShardedIndex::Delete(const KEY_T &key)
+{
+  std::shared_lock<std::shared_mutex> t(tablelock);
+  Shard *s;
+  ERROR_T rc;
+
+  rc=ShardFor(key,s);
+  if (rc) { return rc; }
+  std::lock_guard<std::mutex> g(s->lock);
+  return s->index->Delete(key);
+}
+
+ERROR_T BTreeShardedIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  std::shared_lock<std::shared_mutex> t(tablelock);
+  Shard *s;
+  ERROR_T rc;
+
+  rc=ShardFor(key,s);
+  if (rc) { return rc; }
+  std::lock_guard<std::mutex> g(s->lock);
+  return s->index->Lookup(key,value);
+}
+
+
+ERROR_T BTreeShardedIndex::ScanRange(const KEY_VIEW_T &lo, const KEY_VIEW_T &hi, BTreeScanVisitor &visitor)
+{
+  std::shared_lock<std::shared_mutex> t(tablelock);
+  SIZE_T first;
+  SIZE_T last;
+  ERROR_T rc;
+
+  if (shards.empty()) {
+    return ERROR_NOTANINDEX;
+  }
+  if ((lo.length && lo.length!=keysize) || (hi.length && hi.length!=keysize)) {
+    return ERROR_SIZE;
+  }
+  first=lo.length ? Route(lo.data) : 0;
+  last=hi.length ? Route(hi.data) : shards.size()-1;
+  if (last<first) {
+    return ERROR_NOERROR;
+  }
+
+  // The first shard streams straight to the visitor while the others
+  // fill their buffers; those are handed over in shard order as each
+  // one finishes
+  std::vector<ShardScanBuffer> bufs(last-first);
+  std::vector<ERROR_T> rcs(last-first,ERROR_NOERROR);
+  std::vector<std::thread> scans;
+  for (SIZE_T i=first+1;i<=last;i++) {
+    scans.push_back(std::thread(ScanShard,shards[i]->index,&shards[i]->lock,lo,hi,
+				&bufs[i-first-1],&rcs[i-first-1]));
+  }
+  ScanShard(shards[first]->index,&shards[first]->lock,lo,hi,&visitor,&rc);
+  for (SIZE_T i=0;i<scans.size();i++) {
+    scans[i].join();
+    if (!rc) {
+      rc=rcs[i];
+    }
+    if (!rc) {
+      rc=bufs[i].Replay(keysize,valuesize,visitor);
+    }
+    // let go of what has been handed over
+    std::vector<char>().swap(bufs[i].pairs);
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeShardedIndex::SplitShard(const SIZE_T shard, BufferCache *cache)
+{
+  std::unique_lock<std::shared_mutex> t(tablelock);
+  ShardScanBuffer count;
+  ERROR_T rc;
+
+  if (shard>=shards.size()) {
+    return ERROR_NONEXISTENT;
+  }
+  Shard *s=shards[shard];
+  if (s->index->GetFormat()&BTREE_FORMAT_BUFFERED) {
+    rc=s->index->Flush();
+    if (rc) { return rc; }
+  }
+
+  // One pass to count, another to pick up the upper half.  The upper
+  // half is held in memory while the new shard is bulk loaded from it.
+  ShardSplitVisitor counter((SIZE_T)-1);
+  rc=s->index->ScanRange(KEY_VIEW_T(),KEY_VIEW_T(),counter);
+  if (rc) { return rc; }
+  if (counter.seen<2) {
+    return ERROR_NONEXISTENT;
+  }
+  ShardSplitVisitor upper(counter.seen/2);
+  rc=s->index->ScanRange(KEY_VIEW_T(),KEY_VIEW_T(),upper);
+  if (rc) { return rc; }
+
+  BTreeIndex *index=new BTreeIndex(keysize,valuesize,cache,true,keycompare);
+  index->SetFormat(s->index->GetFormat());
+  rc=index->Attach(0,true);
+  if (!rc) {
+    ShardBulkSource source(upper,keysize,valuesize);
+    rc=index->BulkLoad(source);
+  }
+  if (rc) {
+    delete index;
+    return rc;
+  }
+
+  KEY_T lower(keysize);
+  memcpy(lower.data,&upper.pairs[0],keysize);
+  AddShard(index,cache,&lower);
+  // AddShard appends; move it in right after the shard it came from
+  Shard *added=shards.back();
+  shards.pop_back();
+  shards.insert(shards.begin()+shard+1,added);
+
+  // The moved keys now route to the new shard, so if a delete fails
+  // the copies left behind are unreachable rather than wrong
+  KEY_T key(keysize);
+  for (SIZE_T i=0;i<upper.count;i++) {
+    memcpy(key.data,&upper.pairs[i*(keysize+valuesize)],keysize);
+    rc=s->index->Delete(key);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeShardedIndex::SplitHotShard(BufferCache *cache)
+{
+  SIZE_T hot=0;
+  {
+    std::shared_lock<std::shared_mutex> t(tablelock);
+    if (shards.empty()) {
+      return ERROR_NOTANINDEX;
+    }
+    for (SIZE_T i=1;i<shards.size();i++) {
+      if (shards[i]->ops>shards[hot]->ops) {
+	hot=i;
+      }
+    }
+  }
+  ERROR_T rc=SplitShard(hot,cache);
+  std::shared_lock<std::shared_mutex> t(tablelock);
+  for (SIZE_T i=0;i<shards.size();i++) {
+    shards[i]->ops=0;
+  }
+  return rc;
+}
+
+
+SIZE_T BTreeShardedIndex::GetNumShards() const
+{
+  std::shared_lock<std::shared_mutex> t(tablelock);
+  return shards.size();
+}
+
+SIZE_T BTreeShardedIndex::GetShardOps(const SIZE_T shard) const
+{
+  std::shared_lock<std::shared_mutex> t(tablelock);
+  return shard<shards.size() ? (SIZE_T)shards[shard]->ops : 0;
+}
+
+BTreeIndex * BTreeShardedIndex::GetShard(const SIZE_T shard) const
+{
+  std::shared_lock<std::shared_mutex> t(tablelock);
+  return shard<shards.size() ? shards[shard]->index : 0;
+}
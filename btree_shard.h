@@ -0,0 +1,119 @@
+#ifndef _btree_shard
+#define _btree_shard
+
+// Range-partitioned index over several BTreeIndex shards.
+//
+// The keyspace is cut at a sorted list of bounds: shard 0 holds keys
+// below the first bound, shard i keys from bound i-1 up to bound i, and
+// the last shard everything from the last bound up.  Each shard is a
+// complete index on a BufferCache of its own, so it has its own root,
+// superblock, free list and cache memory, and point operations on
+// different shards run in parallel.  ScanRange scans the shards a
+// range touches on a thread each and hands the pairs back in key order.
+// SplitShard moves the upper half of a busy shard onto a new cache.
+//
+// The bounds are not stored on disk; Detach returns them with the
+// shards' superblocks, and Attach takes both back.
+
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <vector>
+
+#include "btree.h"
+
+class BTreeShardedIndex {
+ public:
+  BTreeShardedIndex(SIZE_T keysize,
+		    SIZE_T valuesize,
+		    SIZE_T keycompare=BTREE_CMP_BYTES);
+  // Deletes the shard indexes but not their caches
+  virtual ~BTreeShardedIndex();
+
+  // Create one shard on each cache, split at bounds, which has one key
+  // fewer than there are caches, in increasing order.  format is
+  // BTREE_FORMAT_* for every shard.
+  // return ERROR_BADCONFIG if the bounds do not fit the caches or are
+  // out of order, ERROR_SIZE for a wrongly sized bound
+  ERROR_T Create(const std::vector<BufferCache *> &caches,
+		 const std::vector<KEY_T> &bounds,
+		 const SIZE_T format=0);
+
+  // Attach shards previously returned by Detach
+  ERROR_T Attach(const std::vector<BufferCache *> &caches,
+		 const std::vector<SIZE_T> &initblocks,
+		 const std::vector<KEY_T> &bounds);
+
+  // Detach every shard, returning their caches (which SplitShard may
+  // have added to or reordered) and superblocks in shard order, and the
+  // bounds between them, ready to hand back to Attach
+  ERROR_T Detach(std::vector<BufferCache *> &caches,
+		 std::vector<SIZE_T> &initblocks,
+		 std::vector<KEY_T> &bounds);
+
+  // Same return codes as the BTreeIndex calls
+  ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Delete(const KEY_T &key);
+  ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+
+  // Pairs with lo <= key < hi, in key order, as BTreeIndex::ScanRange.
+  // Each shard the range touches is scanned on its own thread; a shard's
+  // pairs are held until the shards before it have been handed over.
+  ERROR_T ScanRange(const KEY_VIEW_T &lo, const KEY_VIEW_T &hi, BTreeScanVisitor &visitor);
+
+  // Move the keys above the median of shard onto a new shard created on
+  // cache, which goes in right after it.  Blocks all other operations
+  // while it runs.
+  // return ERROR_NONEXISTENT if shard does not exist or has fewer than
+  // two keys
+  ERROR_T SplitShard(const SIZE_T shard, BufferCache *cache);
+
+  // SplitShard the shard with the most operations since the last split,
+  // then start counting again
+  ERROR_T SplitHotShard(BufferCache *cache);
+
+  SIZE_T  GetNumShards() const;
+
+  // Point operations routed to shard since the last split
+  SIZE_T  GetShardOps(const SIZE_T shard) const;
+
+  // The shard's own index, for SanityCheck, Display and the like.  Not
+  // to be updated directly.
+  BTreeIndex * GetShard(const SIZE_T shard) const;
+
+ protected:
+  struct Shard {
+    BTreeIndex         *index;
+    BufferCache        *cache;
+    KEY_T               lower;   // smallest key it may hold; empty for shard 0
+    std::mutex          lock;
+    std::atomic<SIZE_T> ops;
+  };
+
+  // Shard that holds key.  Caller holds tablelock.
+  SIZE_T  Route(const char *key) const;
+
+  // Route with the checks the point operations make first
+  ERROR_T ShardFor(const KEY_T &key, Shard *&s) const;
+
+  int     CompareKeys(const char *lhs, const char *rhs) const
+  { return shards[0]->index->CompareKeys(lhs,rhs); }
+
+  ERROR_T CheckBounds(const std::vector<BufferCache *> &caches,
+		      const std::vector<KEY_T> &bounds) const;
+
+  void    AddShard(BTreeIndex *index, BufferCache *cache, const KEY_T *lower);
+
+  void    Clear();
+
+  SIZE_T  keysize;
+  SIZE_T  valuesize;
+  SIZE_T  keycompare;
+
+  // Shared by operations, exclusive while the shard list changes
+  mutable std::shared_mutex tablelock;
+  std::vector<Shard *>      shards;
+};
+
+#endif
@@ -0,0 +1,531 @@
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "btree_stress.h"
+
+BTreeStressConfig::BTreeStressConfig() :
+  ops(BTREE_STRESS_DEFAULT_OPS), keys(BTREE_STRESS_DEFAULT_KEYS), cluster(0), keyskew(0), valuebands(0), seed(1),
+  inserts(30), deletes(20), updates(15), lookups(30), scans(5), scanlength(50),
+  checkevery(BTREE_STRESS_DEFAULT_CHECK), reattachevery(0), snapshotreaders(0),
+  scanthreads(0), allocations(0)
+{
+}
+
+
+// Collects the pairs a ScanRange hands it
+class StressCollector : public BTreeScanVisitor {
+ public:
+  std::vector<std::pair<std::string,std::string> > pairs;
+
+  ERROR_T Visit(const KEY_VIEW_T &key, const VALUE_VIEW_T &value)
+  {
+    pairs.push_back(std::make_pair(std::string(key.data,key.length),
+				   std::string(value.data,value.length)));
+    return ERROR_NOERROR;
+  }
+};
+
+// The same for a ScanRangeParallel that is not ordered, whose threads
+// all visit at once
+class SharedStressCollector : public StressCollector {
+ public:
+  std::mutex lock;
+
+  ERROR_T Visit(const KEY_VIEW_T &key, const VALUE_VIEW_T &value)
+  {
+    std::lock_guard<std::mutex> g(lock);
+    return StressCollector::Visit(key,value);
+  }
+};
+
+
+BTreeStress::BTreeStress(BTreeIndex *i) :
+  index(i), buffercache(i->buffercache), oracle(KeyOrder{i}), state(1), lastkey(0),
+  reads(0), writes(0), diskreads(0), diskwrites(0),
+  totalreads(0), totalwrites(0), totaldiskreads(0), totaldiskwrites(0),
+  allocations(0), allocs(0), totalallocs(0), compares(0), totalcompares(0), keyskew(0),
+  stopreaders(false), snapshot(0), frozen(KeyOrder{i})
+{
+}
+
+BTreeStress::~BTreeStress()
+{
+}
+
+
+SIZE_T BTreeStress::Random(const SIZE_T n)
+{
+  state^=state<<13;
+  state^=state>>7;
+  state^=state<<17;
+  return n>0 ? (SIZE_T)(state%n) : 0;
+}
+
+void BTreeStress::MakeKey(const SIZE_T n, KEY_T &key) const
+{
+  SIZE_T keysize=index->superblock.info.keysize;
+  unsigned long long u=n;
+
+  for (SIZE_T i=1; i<keyskew; i++) {
+    u*=n;
+  }
+  long long s=u;
+  double d=u;
+
+  memset(key.data,0,keysize);
+  switch (index->keycompare) {
+  case BTREE_CMP_UINT64:
+    memcpy(key.data,&u,sizeof(u));
+    break;
+  case BTREE_CMP_INT64:
+    memcpy(key.data,&s,sizeof(s));
+    break;
+  case BTREE_CMP_DOUBLE:
+    memcpy(key.data,&d,sizeof(d));
+    break;
+  default:
+    // big-endian in the last bytes, so memcmp order is numeric order
+    for (SIZE_T i=0; i<keysize && i<sizeof(u); i++) {
+      key.data[keysize-1-i]=(char)((u>>(8*i))&0xff);
+    }
+    break;
+  }
+}
+
+
+// The cache's counts are read under cachelock, as snapshot readers may
+// be reading blocks meanwhile; what they read is counted in too.
+void BTreeStress::StartCall()
+{
+  std::lock_guard<std::mutex> g(*index->cachelock);
+
+  reads=buffercache->GetNumReads();
+  writes=buffercache->GetNumWrites();
+  diskreads=buffercache->GetNumDiskReads();
+  diskwrites=buffercache->GetNumDiskWrites();
+  if (allocations) {
+    allocs=allocations();
+  }
+  compares=index->GetNumSearchCompares();
+  started=std::chrono::steady_clock::now();
+}
+
+void BTreeStress::EndCall(BTreeStressResult &result)
+{
+  result.seconds+=std::chrono::duration<double>(std::chrono::steady_clock::now()-started).count();
+  if (allocations) {
+    totalallocs+=allocations()-allocs;
+  }
+  totalcompares+=index->GetNumSearchCompares()-compares;
+  std::lock_guard<std::mutex> g(*index->cachelock);
+  totalreads+=buffercache->GetNumReads()-reads;
+  totalwrites+=buffercache->GetNumWrites()-writes;
+  totaldiskreads+=buffercache->GetNumDiskReads()-diskreads;
+  totaldiskwrites+=buffercache->GetNumDiskWrites()-diskwrites;
+}
+
+
+ERROR_T BTreeStress::Fail(BTreeStressResult &result, const char *what, const KEY_T &key, const ERROR_T rc)
+{
+  static const char hex[]="0123456789abcdef";
+  std::string k;
+
+  for (SIZE_T i=0; i<key.length; i++) {
+    k+=hex[(key.data[i]>>4)&0xf];
+    k+=hex[key.data[i]&0xf];
+  }
+  result.failure="op "+std::to_string(result.ops)+": "+what+" of key "+k
+    +" returned "+std::to_string(rc);
+  return ERROR_INSANE;
+}
+
+
+void BTreeStress::MakeValue(const BTreeStressConfig &config, const SIZE_T n, VALUE_T &value)
+{
+  if (config.valuebands>0 && (n/config.valuebands)%2==1) {
+    memset(value.data,0,value.length);
+    return;
+  }
+  for (SIZE_T i=0; i<value.length; i++) {
+    value.data[i]=(char)Random(256);
+  }
+}
+
+
+ERROR_T BTreeStress::Step(const BTreeStressConfig &config, BTreeStressResult &result)
+{
+  SIZE_T keysize=index->superblock.info.keysize;
+  SIZE_T valuesize=index->superblock.info.valuesize;
+  SIZE_T total=config.inserts+config.deletes+config.updates+config.lookups+config.scans;
+  SIZE_T pick=Random(total);
+  SIZE_T n;
+  KEY_T key(keysize);
+  VALUE_T value(valuesize);
+  ERROR_T rc;
+
+  if (config.cluster>0 && config.cluster<config.keys) {
+    n=(lastkey+config.keys+Random(2*config.cluster+1)-config.cluster)%config.keys;
+  } else {
+    n=Random(config.keys);
+  }
+  lastkey=n;
+
+  MakeKey(n,key);
+  std::string k(key.data,keysize);
+  Oracle::iterator o=oracle.find(k);
+  bool found=o!=oracle.end();
+
+  if (pick<config.inserts) {
+    MakeValue(config,n,value);
+    StartCall();
+    rc=index->Insert(key,value);
+    EndCall(result);
+    if (rc!=(found ? ERROR_CONFLICT : ERROR_NOERROR)) {
+      return Fail(result,"Insert",key,rc);
+    }
+    if (!found) {
+      oracle[k]=std::string(value.data,valuesize);
+    }
+    return ERROR_NOERROR;
+  }
+  pick-=config.inserts;
+
+  if (pick<config.deletes) {
+    StartCall();
+    rc=index->Delete(key);
+    EndCall(result);
+    if (rc!=(found ? ERROR_NOERROR : ERROR_NONEXISTENT)) {
+      return Fail(result,"Delete",key,rc);
+    }
+    if (found) {
+      oracle.erase(o);
+    }
+    return ERROR_NOERROR;
+  }
+  pick-=config.deletes;
+
+  if (pick<config.updates) {
+    MakeValue(config,n,value);
+    StartCall();
+    rc=index->Update(key,value);
+    EndCall(result);
+    if (rc!=(found ? ERROR_NOERROR : ERROR_NONEXISTENT)) {
+      return Fail(result,"Update",key,rc);
+    }
+    if (found) {
+      o->second.assign(value.data,valuesize);
+    }
+    return ERROR_NOERROR;
+  }
+  pick-=config.updates;
+
+  if (pick<config.lookups) {
+    StartCall();
+    rc=index->Lookup(key,value);
+    EndCall(result);
+    if (rc!=(found ? ERROR_NOERROR : ERROR_NONEXISTENT)) {
+      return Fail(result,"Lookup",key,rc);
+    }
+    if (found && o->second.compare(0,valuesize,value.data,valuesize)!=0) {
+      return Fail(result,"Lookup (wrong value)",key,rc);
+    }
+    return ERROR_NOERROR;
+  }
+
+  // a scan from key up to key number n+scanlength, or to the end
+  KEY_T hi(n+config.scanlength<config.keys ? keysize : 0);
+  bool ordered=config.scanthreads==0 || Random(2)==0;
+  StressCollector inorder;
+  SharedStressCollector shared;
+  StressCollector &scan=ordered ? inorder : shared;
+
+  if (hi.length>0) {
+    MakeKey(n+config.scanlength,hi);
+  }
+  StartCall();
+  rc=ERROR_NOERROR;
+  if (index->format&BTREE_FORMAT_BUFFERED) {
+    rc=index->Flush();
+  }
+  if (!rc && config.scanthreads==0) {
+    rc=index->ScanRange(key,hi,scan);
+  } else if (!rc) {
+    rc=index->ScanRangeParallel(key,hi,scan,ordered,config.scanthreads);
+  }
+  EndCall(result);
+  if (rc) {
+    return Fail(result,config.scanthreads==0 ? "ScanRange" : "ScanRangeParallel",key,rc);
+  }
+  if (!ordered) {
+    KeyOrder order{index};
+    std::sort(scan.pairs.begin(),scan.pairs.end(),
+	      [&order](const std::pair<std::string,std::string> &lhs,
+		       const std::pair<std::string,std::string> &rhs)
+	      { return order(lhs.first,rhs.first); });
+  }
+  o=oracle.lower_bound(k);
+  for (SIZE_T i=0; i<scan.pairs.size(); i++, ++o) {
+    if (o==oracle.end() || (hi.length>0 && index->CompareKeys(o->first.data(),hi.data)>=0) ||
+	o->first!=scan.pairs[i].first || o->second!=scan.pairs[i].second) {
+      return Fail(result,"ScanRange (wrong pair)",key,rc);
+    }
+  }
+  if (o!=oracle.end() && (hi.length==0 || index->CompareKeys(o->first.data(),hi.data)<0)) {
+    return Fail(result,"ScanRange (missing pair)",key,rc);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeStress::Check(BTreeStressResult &result)
+{
+  StressCollector all;
+  KEY_T open(0);
+  Oracle::const_iterator o;
+  ERROR_T rc;
+
+  result.checks++;
+  rc=index->SanityCheck();
+  if (rc) {
+    return Fail(result,"SanityCheck",open,rc);
+  }
+  if (index->format&BTREE_FORMAT_BUFFERED) {
+    rc=index->Flush();
+    if (rc) { return rc; }
+  }
+  rc=index->ScanRange(open,open,all);
+  if (rc) { return rc; }
+  if (all.pairs.size()!=oracle.size()) {
+    result.failure="op "+std::to_string(result.ops)+": tree has "+std::to_string(all.pairs.size())
+      +" keys, should have "+std::to_string(oracle.size());
+    return ERROR_INSANE;
+  }
+  o=oracle.begin();
+  for (SIZE_T i=0; i<all.pairs.size(); i++, ++o) {
+    if (o->first!=all.pairs[i].first || o->second!=all.pairs[i].second) {
+      KEY_T key(o->first.size());
+      memcpy(key.data,o->first.data(),o->first.size());
+      return Fail(result,"full scan (wrong pair)",key,ERROR_NOERROR);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeStress::Reattach()
+{
+  SIZE_T superblock;
+  ERROR_T rc;
+
+  rc=index->Detach(superblock);
+  if (rc) { return rc; }
+  return index->Attach(superblock,false);
+}
+
+
+ERROR_T BTreeStress::StartReaders(const BTreeStressConfig &config)
+{
+  ERROR_T rc;
+
+  if (config.snapshotreaders==0) {
+    return ERROR_NOERROR;
+  }
+  rc=index->CreateSnapshot(snapshot);
+  if (rc) { return rc; }
+  frozen=oracle;
+  stopreaders=false;
+  for (SIZE_T r=0; r<config.snapshotreaders; r++) {
+    readers.push_back(std::thread(&BTreeStress::ReadSnapshot,this,std::cref(config),r));
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeStress::StopReaders(BTreeStressResult &result)
+{
+  ERROR_T rc;
+
+  if (readers.empty()) {
+    return ERROR_NOERROR;
+  }
+  stopreaders=true;
+  for (SIZE_T r=0; r<readers.size(); r++) {
+    readers[r].join();
+  }
+  readers.clear();
+  rc=index->ReleaseSnapshot(snapshot);
+  if (!readerfailure.empty()) {
+    if (result.failure.empty()) {
+      result.failure="op "+std::to_string(result.ops)+": "+readerfailure;
+    }
+    readerfailure.clear();
+    return ERROR_INSANE;
+  }
+  return rc;
+}
+
+void BTreeStress::ReadSnapshot(const BTreeStressConfig &config, const SIZE_T reader)
+{
+  SIZE_T keysize=index->superblock.info.keysize;
+  SIZE_T valuesize=index->superblock.info.valuesize;
+  unsigned long long x=(config.seed+reader+1)*0x9e3779b97f4a7c15ULL;
+  KEY_T key(keysize);
+  VALUE_T value(valuesize);
+  std::string what;
+  ERROR_T rc;
+
+  for (SIZE_T i=0; !stopreaders && what.empty(); i++) {
+    if (i%256==255) {
+      // now and then the whole snapshot
+      StressCollector all;
+      rc=index->ScanSnapshot(snapshot,all);
+      if (rc) {
+	what="ScanSnapshot returned "+std::to_string(rc);
+	break;
+      }
+      if (all.pairs.size()!=frozen.size()) {
+	what="ScanSnapshot has "+std::to_string(all.pairs.size())+" keys, should have "
+	  +std::to_string(frozen.size());
+	break;
+      }
+      Oracle::const_iterator o=frozen.begin();
+      for (SIZE_T p=0; p<all.pairs.size(); p++, ++o) {
+	if (o->first!=all.pairs[p].first || o->second!=all.pairs[p].second) {
+	  what="ScanSnapshot (wrong pair)";
+	  break;
+	}
+      }
+      continue;
+    }
+    x^=x<<13;
+    x^=x>>7;
+    x^=x<<17;
+    MakeKey(config.keys>0 ? (SIZE_T)(x%config.keys) : 0,key);
+    Oracle::const_iterator o=frozen.find(std::string(key.data,keysize));
+    rc=index->LookupSnapshot(snapshot,key,value);
+    if (rc!=(o!=frozen.end() ? ERROR_NOERROR : ERROR_NONEXISTENT)) {
+      what="LookupSnapshot returned "+std::to_string(rc);
+    } else if (o!=frozen.end() && o->second.compare(0,valuesize,value.data,valuesize)!=0) {
+      what="LookupSnapshot (wrong value)";
+    }
+  }
+  if (!what.empty()) {
+    std::lock_guard<std::mutex> g(readerlock);
+    if (readerfailure.empty()) {
+      readerfailure="snapshot reader "+std::to_string(reader)+": "+what;
+    }
+  }
+}
+
+
+ERROR_T BTreeStress::Run(const BTreeStressConfig &config, BTreeStressResult &result)
+{
+  SIZE_T keysize=index->superblock.info.keysize;
+  StressCollector start;
+  KEY_T open(0);
+  ERROR_T rc;
+
+  result.ops=0;
+  result.checks=0;
+  result.keys=0;
+  result.seconds=0;
+  result.opspersec=0;
+  result.readsperop=0;
+  result.writesperop=0;
+  result.diskreadsperop=0;
+  result.diskwritesperop=0;
+  result.allocsperop=0;
+  result.comparesperop=0;
+  result.failure.clear();
+
+  if (index->keycompare==BTREE_CMP_UINT64 || index->keycompare==BTREE_CMP_INT64 ||
+      index->keycompare==BTREE_CMP_DOUBLE) {
+    if (keysize<8) {
+      return ERROR_SIZE;
+    }
+  } else if (keysize<8 && (config.keys+config.scanlength)>>(8*keysize)!=0) {
+    return ERROR_SIZE;
+  }
+  if (config.inserts+config.deletes+config.updates+config.lookups+config.scans==0) {
+    return ERROR_BADCONFIG;
+  }
+
+  state=config.seed*2654435761ULL+1;
+  lastkey=config.keys/2;
+  totalreads=totalwrites=totaldiskreads=totaldiskwrites=0;
+  totalallocs=0;
+  totalcompares=0;
+  allocations=config.allocations;
+  keyskew=config.keyskew;
+  oracle.clear();
+  if (index->format&BTREE_FORMAT_BUFFERED) {
+    rc=index->Flush();
+    if (rc) { return rc; }
+  }
+  rc=index->ScanRange(open,open,start);
+  if (rc) { return rc; }
+  for (SIZE_T i=0; i<start.pairs.size(); i++) {
+    oracle.insert(start.pairs[i]);
+  }
+
+  rc=StartReaders(config);
+  while (!rc && result.ops<config.ops) {
+    rc=Step(config,result);
+    if (rc) { break; }
+    result.ops++;
+    bool reattach=config.reattachevery>0 && result.ops%config.reattachevery==0;
+    bool check=(config.checkevery>0 && result.ops%config.checkevery==0) || result.ops==config.ops;
+    if (!reattach && !check) {
+      continue;
+    }
+    // the readers' snapshot does not outlast a detach, and is retaken
+    // after a check so they see the updates since
+    rc=StopReaders(result);
+    if (rc) { break; }
+    if (reattach) {
+      rc=Reattach();
+      if (rc) {
+	result.failure="op "+std::to_string(result.ops)+": re-attach returned "+std::to_string(rc);
+	break;
+      }
+    }
+    if (check) {
+      rc=Check(result);
+    }
+    if (!rc && result.ops<config.ops) {
+      rc=StartReaders(config);
+    }
+  }
+  if (!readers.empty()) {
+    ERROR_T readrc=StopReaders(result);
+    if (!rc) {
+      rc=readrc;
+    }
+  }
+
+  // the figures so far, even for a run that stopped
+  result.keys=oracle.size();
+  if (result.seconds>0) {
+    result.opspersec=result.ops/result.seconds;
+  }
+  if (result.ops>0) {
+    result.readsperop=(double)totalreads/result.ops;
+    result.writesperop=(double)totalwrites/result.ops;
+    result.diskreadsperop=(double)totaldiskreads/result.ops;
+    result.diskwritesperop=(double)totaldiskwrites/result.ops;
+    result.allocsperop=(double)totalallocs/result.ops;
+    result.comparesperop=(double)totalcompares/result.ops;
+  }
+  return rc;
+}
+
+
+bool BTreeStress::Regressed(const BTreeStressResult &result,
+			    const BTreeStressResult &baseline,
+			    const double slack)
+{
+  return result.opspersec<baseline.opspersec*(1-slack)
+    || result.readsperop>baseline.readsperop*(1+slack)
+    || result.writesperop>baseline.writesperop*(1+slack)
+    || result.diskreadsperop>baseline.diskreadsperop*(1+slack)
+    || result.diskwritesperop>baseline.diskwritesperop*(1+slack);
+}
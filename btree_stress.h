@@ -0,0 +1,180 @@
+#ifndef _btree_stress
+#define _btree_stress
+
+// Randomized differential stress runs of a BTreeIndex.
+//
+// Run drives the index with a seeded random mix of Insert, Delete,
+// Update, Lookup and ScanRange, applies the same operations to a
+// std::map, and checks every return code and every value read back
+// against the map.  Every so often it also runs SanityCheck and
+// compares the whole tree with the map, and optionally detaches and
+// re-attaches the index first, so that anything an update left only in
+// memory shows up.  The same run measures the index: operations per
+// second and buffer cache block reads and writes per operation, counting
+// only the time and I/O inside the index's own calls.  Compare two
+// results with Regressed to hold an optimization to both.
+//
+// Keys can be drawn near the last one instead of anywhere, the way
+// finger search pays off, keys spread unevenly over their range, and
+// values made to compress well in some key ranges and not at all in
+// others.  Scans can go through ScanRangeParallel,
+// ordered or not, on scanthreads threads.  Given a count of the
+// allocations made so far, a run also reports those made inside the
+// index's calls.
+//
+// Optionally, threads read a snapshot alongside the updates the whole
+// time, checking every LookupSnapshot and ScanSnapshot against a copy of
+// the map as it was when the snapshot was taken.  A new snapshot is
+// taken after each check.
+//
+// The index must be attached, and must not be used by anything else
+// while the run goes on.  Whatever it holds when the run starts is read
+// into the map first.
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "btree.h"
+
+#define BTREE_STRESS_DEFAULT_OPS   100000
+#define BTREE_STRESS_DEFAULT_KEYS  10000
+#define BTREE_STRESS_DEFAULT_CHECK 10000
+
+// The operations of a run, and their weights in the mix
+struct BTreeStressConfig {
+  BTreeStressConfig();
+
+  SIZE_T   ops;
+  SIZE_T   keys;           // keys are drawn from this many distinct ones
+  SIZE_T   cluster;        // within this many of the last one, 0 anywhere
+  SIZE_T   keyskew;        // key number n is laid out as n to this power,
+                           // bunching keys up at the low end; 0 or 1 none
+  SIZE_T   valuebands;     // values all zero, which pack well, in every
+                           // other band of this many key numbers, 0 none
+  unsigned seed;
+  SIZE_T   inserts;
+  SIZE_T   deletes;
+  SIZE_T   updates;
+  SIZE_T   lookups;
+  SIZE_T   scans;          // each over up to scanlength keys
+  SIZE_T   scanlength;
+  SIZE_T   checkevery;     // full check this many ops apart, 0 only at the end
+  SIZE_T   reattachevery;  // detach and attach again, 0 never
+  SIZE_T   snapshotreaders; // threads reading a snapshot meanwhile, 0 none
+  SIZE_T   scanthreads;    // scan with ScanRangeParallel on these, 0 ScanRange
+  SIZE_T (*allocations)(); // allocations made so far, 0 not to count them
+};
+
+struct BTreeStressResult {
+  SIZE_T   ops;            // run before it finished or stopped
+  SIZE_T   checks;
+  SIZE_T   keys;           // in the index at the end
+  double   seconds;        // inside the index's calls
+  double   opspersec;
+  double   readsperop;     // buffer cache block reads and writes
+  double   writesperop;
+  double   diskreadsperop; // those of them that went to disk
+  double   diskwritesperop;
+  double   allocsperop;    // if config.allocations is given
+  double   comparesperop;  // key comparisons by node searches
+  // The first disagreement with the map, empty if none
+  std::string failure;
+};
+
+class BTreeStress {
+ public:
+  BTreeStress(BTreeIndex *index);
+  virtual ~BTreeStress();
+
+  // return ERROR_INSANE at the first disagreement with the map, which
+  // result.failure describes, or the error of a check or re-attach that
+  // failed; ERROR_SIZE for a key too short to hold keys distinct ones
+  ERROR_T Run(const BTreeStressConfig &config, BTreeStressResult &result);
+
+  // Whether result is worse than baseline by more than slack (0.1 for
+  // 10%): fewer operations a second, or more block reads or writes per
+  // operation
+  static bool Regressed(const BTreeStressResult &result,
+			const BTreeStressResult &baseline,
+			const double slack);
+
+ protected:
+  struct KeyOrder {
+    const BTreeIndex *index;
+    bool operator()(const std::string &lhs, const std::string &rhs) const
+    { return index->CompareKeys(lhs.data(),rhs.data())<0; }
+  };
+
+  typedef std::map<std::string,std::string,KeyOrder> Oracle;
+
+  // Key number n, laid out for the index's key order, so that keys
+  // numbered apart compare apart
+  void    MakeKey(const SIZE_T n, KEY_T &key) const;
+
+  // Random bytes for key number n, or zeros if its band says so
+  void    MakeValue(const BTreeStressConfig &config, const SIZE_T n, VALUE_T &value);
+
+  // Run one operation and check it against the map.  Times and counts
+  // the I/O of the index call alone.
+  ERROR_T Step(const BTreeStressConfig &config, BTreeStressResult &result);
+
+  // SanityCheck, then the whole tree against the map
+  ERROR_T Check(BTreeStressResult &result);
+
+  ERROR_T Reattach();
+
+  // Fill result.failure and return ERROR_INSANE
+  ERROR_T Fail(BTreeStressResult &result, const char *what, const KEY_T &key, const ERROR_T rc);
+
+  // xorshift, so a seed gives the same run everywhere
+  SIZE_T  Random(const SIZE_T n);
+
+  // Start and stop timing an index call
+  void    StartCall();
+  void    EndCall(BTreeStressResult &result);
+
+  // Take a snapshot and start the threads reading it, or stop them and
+  // release it, returning ERROR_INSANE with result.failure filled in if
+  // one of them saw the snapshot disagree with the map
+  ERROR_T StartReaders(const BTreeStressConfig &config);
+  ERROR_T StopReaders(BTreeStressResult &result);
+
+  // One reader thread's loop
+  void    ReadSnapshot(const BTreeStressConfig &config, const SIZE_T reader);
+
+  BTreeIndex  *index;
+  BufferCache *buffercache;
+  Oracle       oracle;
+  unsigned long long state;   // of the random number generator
+  SIZE_T       lastkey;       // number of the last key drawn
+  std::chrono::steady_clock::time_point started;
+  SIZE_T       reads;
+  SIZE_T       writes;
+  SIZE_T       diskreads;
+  SIZE_T       diskwrites;
+  // I/O summed over the index calls, for the per-op figures
+  SIZE_T       totalreads;
+  SIZE_T       totalwrites;
+  SIZE_T       totaldiskreads;
+  SIZE_T       totaldiskwrites;
+  SIZE_T     (*allocations)();
+  SIZE_T       allocs;
+  SIZE_T       totalallocs;
+  SIZE_T       compares;
+  SIZE_T       totalcompares;
+  SIZE_T       keyskew;       // config.keyskew, for MakeKey
+  // The snapshot readers, and the map as of their snapshot
+  std::vector<std::thread> readers;
+  std::atomic<bool>        stopreaders;
+  SIZE_T                   snapshot;
+  Oracle                   frozen;
+  std::mutex               readerlock;
+  std::string              readerfailure;  // under readerlock
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include "btree_stress.h"
+
+// Counts the allocations Lookup, Insert, Update and Delete make inside
+// the index, which should be none once a thread's node pool has warmed
+// up.  operator new is replaced to count them, and the buffer cache is
+// given as many blocks as the disk, so that every block stays in memory
+// and what is counted is the index's own.  Each format is run once to
+// warm up and once to count; exits non-zero if any counted run
+// allocated, or disagreed with its map.
+
+void usage()
+{
+  cerr << "usage: btree_stress_allocs filestem keysize valuesize\n";
+}
+
+static std::atomic<SIZE_T> allocations(0);
+
+void *operator new(size_t n)
+{
+  allocations.fetch_add(1,std::memory_order_relaxed);
+  void *p=malloc(n ? n : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  free(p);
+}
+
+static SIZE_T CountAllocations()
+{
+  return allocations.load(std::memory_order_relaxed);
+}
+
+struct StressFormat {
+  const char *name;
+  SIZE_T      format;
+};
+
+// the formats whose hot paths allocate nothing
+static const StressFormat formats[] = {
+  {"plain",      0},
+  {"checksum",   BTREE_FORMAT_CHECKSUM},
+  {"journal",    BTREE_FORMAT_JOURNAL|BTREE_FORMAT_CHECKSUM},
+};
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T keysize;
+  SIZE_T valuesize;
+  int failed=0;
+  ERROR_T rc;
+
+  if (argc!=4) {
+    usage();
+    return -1;
+  }
+  filestem=argv[1];
+  keysize=atoi(argv[2]);
+  valuesize=atoi(argv[3]);
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,disk.GetNumBlocks());
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  for (SIZE_T f=0;f<sizeof(formats)/sizeof(formats[0]);f++) {
+    BTreeIndex btree(keysize,valuesize,&cache);
+    BTreeStressConfig config;
+    BTreeStressResult result;
+    SIZE_T superblock;
+
+    btree.SetFormat(formats[f].format);
+    rc=btree.Attach(0,true);
+    if (rc) {
+      cout << formats[f].name << " FAILED: can't create the index due to error " << rc << endl;
+      failed++;
+      continue;
+    }
+    // no scans, whose visitor allocates, and no re-attaches
+    config.inserts=30;
+    config.deletes=20;
+    config.updates=20;
+    config.lookups=30;
+    config.scans=0;
+    config.checkevery=0;
+    BTreeStress stress(&btree);
+    rc=stress.Run(config,result);
+    if (!rc) {
+      config.seed=2;
+      config.allocations=CountAllocations;
+      rc=stress.Run(config,result);
+    }
+    cout << formats[f].name
+	 << " ops " << result.ops
+	 << " keys " << result.keys
+	 << " allocs/op " << result.allocsperop;
+    if (rc) {
+      cout << " FAILED: " << (result.failure.empty() ? "error "+std::to_string(rc) : result.failure);
+      failed++;
+    } else if (result.allocsperop>0) {
+      cout << " ALLOCATES";
+      failed++;
+    }
+    cout << endl;
+    btree.Detach(superblock);
+  }
+
+  cache.Detach();
+  if (failed) {
+    cerr << failed << " formats failed" << endl;
+    return 1;
+  }
+  return 0;
+}
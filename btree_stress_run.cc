@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <map>
+#include <string>
+#include "btree_stress.h"
+
+// Runs BTreeStress over the supported formats and a few operation
+// mixes, printing the figures of each run.  Exits non-zero if any run
+// disagrees with its map.  Given a baseline file, it also exits
+// non-zero if any run is slower, or does more block I/O per operation,
+// than the baseline by more than slack (0.25 unless given); a baseline
+// that does not exist yet is written from this run's figures.  Each
+// run is made BTREE_STRESS_REPEATS times and the fastest kept, as one
+// run alone is too short to time reliably; the I/O figures are the
+// same every time, except for runs with snapshot readers, which are
+// only checked.
+//
+// It also runs finger search off and on, over keys drawn near the last
+// one and over keys drawn anywhere, for the reads per operation each
+// way, binary and interpolation search over uint64 keys spread evenly
+// and bunched up at the low end, for the key comparisons per operation
+// each way, and mostly deletes on a compressed index whose values pack
+// well in some key ranges and not at all in others, re-attaching often
+// so that a leaf left too big for its block shows up as lost keys.
+
+#define BTREE_STRESS_REPEATS 3
+
+void usage()
+{
+  cerr << "usage: btree_stress_run filestem cachesize keysize valuesize [baseline [slack]]\n";
+}
+
+struct StressFormat {
+  const char *name;
+  SIZE_T      format;
+};
+
+static const StressFormat formats[] = {
+  {"plain",      0},
+  {"checksum",   BTREE_FORMAT_CHECKSUM},
+  {"splitleaf",  BTREE_FORMAT_SPLITLEAF},
+  {"compress",   BTREE_FORMAT_COMPRESS|BTREE_FORMAT_CHECKSUM},
+  {"buffered",   BTREE_FORMAT_BUFFERED},
+  {"counted",    BTREE_FORMAT_COUNTED},
+  {"journal",    BTREE_FORMAT_JOURNAL|BTREE_FORMAT_CHECKSUM},
+};
+
+struct StressMix {
+  const char *name;
+  SIZE_T      inserts, deletes, updates, lookups, scans;
+  SIZE_T      snapshotreaders;
+  SIZE_T      scanthreads;
+};
+
+static const StressMix mixes[] = {
+  {"mixed",      30, 20, 15, 30,  5, 0, 0},
+  {"readmostly",  5,  5,  5, 80,  5, 0, 0},
+  {"churn",      45, 40, 10,  5,  0, 0, 0},
+  // updates while two threads read a snapshot
+  {"snapshots",  30, 20, 15, 30,  5, 2, 0},
+  // scans on four threads, ordered and not
+  {"pscan",      20, 15, 10, 35, 20, 0, 4},
+};
+
+// Keys drawn within this many of the last one, for the finger runs
+#define BTREE_STRESS_CLUSTER 50
+
+// Key number n is laid out as n cubed, for the skewed search runs
+#define BTREE_STRESS_SKEW 3
+
+// Widths of the bands of packable values for the uneven runs; which
+// of them leaves neighbouring leaves packing unevenly depends on the
+// key, value and block sizes
+static const SIZE_T valuebands[] = {2, 5, 8, 11, 14, 20, 26};
+
+// name -> figures, one run a line
+typedef std::map<std::string,BTreeStressResult> Baseline;
+
+static bool ReadBaseline(const char *file, Baseline &baseline)
+{
+  ifstream in(file);
+  std::string name;
+  BTreeStressResult r;
+
+  if (!in.good()) {
+    return false;
+  }
+  while (in >> name >> r.opspersec >> r.readsperop >> r.writesperop
+	 >> r.diskreadsperop >> r.diskwritesperop) {
+    baseline[name]=r;
+  }
+  return true;
+}
+
+// Makes the runs, checking each against the baseline or recording it
+struct StressGate {
+  BufferCache *cache;
+  SIZE_T       keysize;
+  SIZE_T       valuesize;
+  Baseline     baseline;
+  bool         havebaseline;
+  ofstream     record;
+  double       slack;
+  int          failed;
+  int          regressed;
+
+  // keycompare other than BTREE_CMP_BYTES makes the keys 8 bytes
+  void Run(const std::string &name, const SIZE_T format, const bool finger,
+	   const BTreeStressConfig &config,
+	   const SIZE_T keycompare=BTREE_CMP_BYTES,
+	   const SIZE_T searchmode=BTREE_SEARCH_BINARY);
+};
+
+void StressGate::Run(const std::string &name, const SIZE_T format, const bool finger,
+		     const BTreeStressConfig &config,
+		     const SIZE_T keycompare, const SIZE_T searchmode)
+{
+  BTreeStressResult result;
+  ERROR_T rc;
+
+  rc=ERROR_NOERROR;
+  for (SIZE_T r=0;r<BTREE_STRESS_REPEATS && !rc;r++) {
+    BTreeIndex btree(keycompare==BTREE_CMP_BYTES ? keysize : 8,valuesize,cache,true,keycompare);
+    BTreeStressResult run;
+    SIZE_T superblock;
+
+    btree.SetFormat(format);
+    rc=btree.Attach(0,true);
+    if (rc) {
+      result.failure="can't create the index due to error "+std::to_string(rc);
+      break;
+    }
+    btree.SetFingerSearch(finger);
+    rc=btree.SetSearchMode(searchmode);
+    if (rc) {
+      result.failure="can't set the search mode due to error "+std::to_string(rc);
+      btree.Detach(superblock);
+      break;
+    }
+    BTreeStress stress(&btree);
+    rc=stress.Run(config,run);
+    if (rc || r==0 || run.opspersec>result.opspersec) {
+      result=run;
+    }
+    btree.Detach(superblock);
+  }
+  cout << name
+       << " ops " << result.ops
+       << " keys " << result.keys
+       << " ops/s " << result.opspersec
+       << " reads/op " << result.readsperop
+       << " writes/op " << result.writesperop
+       << " diskreads/op " << result.diskreadsperop
+       << " diskwrites/op " << result.diskwritesperop
+       << " compares/op " << result.comparesperop;
+  if (rc) {
+    cout << " FAILED: " << (result.failure.empty() ? "error "+std::to_string(rc) : result.failure) << endl;
+    failed++;
+    return;
+  }
+  if (config.snapshotreaders>0) {
+    // the readers' I/O is counted in, and depends on how the threads
+    // were scheduled, so there is nothing to hold the run to
+  } else if (havebaseline) {
+    Baseline::const_iterator b=baseline.find(name);
+    if (b!=baseline.end() && BTreeStress::Regressed(result,b->second,slack)) {
+      cout << " REGRESSED";
+      regressed++;
+    }
+  } else if (record.is_open()) {
+    record << name << " " << result.opspersec << " " << result.readsperop << " "
+	   << result.writesperop << " " << result.diskreadsperop << " "
+	   << result.diskwritesperop << "\n";
+  }
+  cout << endl;
+}
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  StressGate gate;
+  ERROR_T rc;
+
+  if (argc<5 || argc>7) {
+    usage();
+    return -1;
+  }
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  gate.keysize=atoi(argv[3]);
+  gate.valuesize=atoi(argv[4]);
+  gate.havebaseline=false;
+  gate.slack=0.25;
+  gate.failed=0;
+  gate.regressed=0;
+  if (argc>5) {
+    gate.havebaseline=ReadBaseline(argv[5],gate.baseline);
+    if (!gate.havebaseline) {
+      gate.record.open(argv[5]);
+    }
+  }
+  if (argc>6) {
+    gate.slack=atof(argv[6]);
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+  gate.cache=&cache;
+
+  for (SIZE_T f=0;f<sizeof(formats)/sizeof(formats[0]);f++) {
+    for (SIZE_T m=0;m<sizeof(mixes)/sizeof(mixes[0]);m++) {
+      BTreeStressConfig config;
+
+      config.inserts=mixes[m].inserts;
+      config.deletes=mixes[m].deletes;
+      config.updates=mixes[m].updates;
+      config.lookups=mixes[m].lookups;
+      config.scans=mixes[m].scans;
+      config.snapshotreaders=mixes[m].snapshotreaders;
+      config.scanthreads=mixes[m].scanthreads;
+      config.reattachevery=config.ops/4;
+      gate.Run(std::string(formats[f].name)+"/"+mixes[m].name,formats[f].format,false,config);
+    }
+  }
+
+  // finger search off and on, mostly lookups, with keys clustered and not
+  for (SIZE_T c=0;c<2;c++) {
+    for (SIZE_T on=0;on<2;on++) {
+      BTreeStressConfig config;
+
+      config.inserts=10;
+      config.deletes=5;
+      config.updates=10;
+      config.lookups=75;
+      config.scans=0;
+      config.cluster=c ? BTREE_STRESS_CLUSTER : 0;
+      gate.Run(std::string("finger/")+(c ? "clustered" : "uniform")+(on ? "/on" : "/off"),0,on,config);
+    }
+  }
+
+  // binary and interpolation search, mostly lookups, over uint64 keys
+  // spread evenly and not
+  for (SIZE_T skew=0;skew<2;skew++) {
+    for (SIZE_T mode=0;mode<2;mode++) {
+      BTreeStressConfig config;
+
+      config.inserts=10;
+      config.deletes=5;
+      config.updates=10;
+      config.lookups=75;
+      config.scans=0;
+      config.keyskew=skew ? BTREE_STRESS_SKEW : 0;
+      gate.Run(std::string("search/")+(skew ? "skewed" : "uniform")+(mode ? "/interpolate" : "/binary"),
+	       0,false,config,BTREE_CMP_UINT64,
+	       mode ? BTREE_SEARCH_INTERPOLATE : BTREE_SEARCH_BINARY);
+    }
+  }
+
+  // deletes on a compressed index, with values packing unevenly
+  for (SIZE_T v=0;v<sizeof(valuebands)/sizeof(valuebands[0]);v++) {
+    BTreeStressConfig config;
+
+    config.ops=30000;
+    config.keys=3000;
+    config.inserts=35;
+    config.deletes=55;
+    config.updates=5;
+    config.lookups=5;
+    config.scans=0;
+    config.valuebands=valuebands[v];
+    config.reattachevery=20;
+    gate.Run("compress/uneven/"+std::to_string(valuebands[v]),
+	     BTREE_FORMAT_COMPRESS|BTREE_FORMAT_CHECKSUM,false,config);
+  }
+
+  cache.Detach();
+  if (gate.failed || gate.regressed) {
+    cerr << gate.failed << " runs failed, " << gate.regressed << " regressed" << endl;
+    return 1;
+  }
+  return 0;
+}